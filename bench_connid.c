@@ -0,0 +1,124 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* Compares the SipHash connection ids of ot_connid.c with the rijndael
+   ids udp workers used to make, build with "make bench_connid". The old
+   path is reproduced as it was, one encryption per id and a second one
+   whenever the id did not match the current hour. */
+
+/* System */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_connid.h"
+#include "ot_rijndael.h"
+
+#define BENCH_ADDRESSES 4096
+#define BENCH_ROUNDS    10000000
+
+time_t g_now_seconds;
+
+static uint32_t g_rijndael_round_key[44];
+static uint32_t g_key_of_the_hour[2];
+
+static void aes_make_connectionid( uint32_t connid[2], const ot_ip6 remoteip, int age ) {
+  uint32_t plain[4], crypt[4];
+  int i;
+
+  memcpy( plain, remoteip, sizeof( plain ) );
+  for( i=0; i<4; ++i ) plain[i] ^= g_key_of_the_hour[age];
+  rijndaelEncrypt128( g_rijndael_round_key, (uint8_t*)remoteip, (uint8_t*)crypt );
+  connid[0] = crypt[0] ^ crypt[1];
+  connid[1] = crypt[2] ^ crypt[3];
+}
+
+static int aes_verify_connectionid( const uint32_t connid[2], const ot_ip6 remoteip ) {
+  uint32_t expected[2];
+  aes_make_connectionid( expected, remoteip, 0 );
+  if( connid[0] == expected[0] && connid[1] == expected[1] )
+    return 1;
+  aes_make_connectionid( expected, remoteip, 1 );
+  return connid[0] == expected[0] && connid[1] == expected[1];
+}
+
+static double bench_now( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_report( const char *name, double seconds, unsigned long sink ) {
+  printf( "%-28s %8.1f ns/id %8.2f M ids/s  (%lu)\n", name, seconds * 1e9 / BENCH_ROUNDS, BENCH_ROUNDS / seconds / 1e6, sink );
+}
+
+int main( void ) {
+  static ot_ip6  addresses[BENCH_ADDRESSES];
+  static uint32_t connids[BENCH_ADDRESSES][2];
+  uint8_t        key[16];
+  unsigned long  sink;
+  double         start;
+  int            i;
+
+  srandom( time( NULL ) );
+  for( i=0; i<BENCH_ADDRESSES; ++i ) {
+    int j;
+    for( j=0; j<16; ++j )
+      addresses[i][j] = random();
+  }
+  for( i=0; i<16; ++i )
+    key[i] = random();
+  rijndaelKeySetupEnc128( g_rijndael_round_key, key );
+  g_key_of_the_hour[0] = random();
+  g_key_of_the_hour[1] = random();
+  connid_init( );
+  g_now_seconds = time( NULL );
+
+  /* Every id must verify before anything is timed */
+  for( i=0; i<BENCH_ADDRESSES; ++i ) {
+    connid_make( connids[i], addresses[i], 6881 );
+    if( !connid_verify( connids[i], addresses[i], 6881 ) ) {
+      fprintf( stderr, "siphash id for address %d does not verify\n", i );
+      return 1;
+    }
+  }
+
+  start = bench_now( );
+  for( sink=0, i=0; i<BENCH_ROUNDS; ++i ) {
+    uint32_t connid[2];
+    aes_make_connectionid( connid, addresses[i % BENCH_ADDRESSES], 0 );
+    sink += connid[0];
+  }
+  bench_report( "rijndael make", bench_now( ) - start, sink );
+
+  start = bench_now( );
+  for( sink=0, i=0; i<BENCH_ROUNDS; ++i ) {
+    uint32_t connid[2];
+    connid_make( connid, addresses[i % BENCH_ADDRESSES], 6881 );
+    sink += connid[0];
+  }
+  bench_report( "siphash make", bench_now( ) - start, sink );
+
+  /* A stale or forged id costs both epochs on either path */
+  start = bench_now( );
+  for( sink=0, i=0; i<BENCH_ROUNDS; ++i )
+    sink += aes_verify_connectionid( connids[i % BENCH_ADDRESSES], addresses[i % BENCH_ADDRESSES] );
+  bench_report( "rijndael verify mismatch", bench_now( ) - start, sink );
+
+  start = bench_now( );
+  for( sink=0, i=0; i<BENCH_ROUNDS; ++i )
+    sink += connid_verify( connids[i % BENCH_ADDRESSES], addresses[( i + 1 ) % BENCH_ADDRESSES], 6881 );
+  bench_report( "siphash verify mismatch", bench_now( ) - start, sink );
+
+  start = bench_now( );
+  for( sink=0, i=0; i<BENCH_ROUNDS; ++i )
+    sink += connid_verify( connids[i % BENCH_ADDRESSES], addresses[i % BENCH_ADDRESSES], 6881 );
+  bench_report( "siphash verify match", bench_now( ) - start, sink );
+
+  return 0;
+}
@@ -19,6 +19,13 @@
 #ifdef WANT_SYSLOGS
 #include <syslog.h>
 #endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#ifdef WANT_IO_URING
+#include <poll.h>
+#include <netinet/in.h>
+#endif
 
 /* Libowfat */
 #include "socket.h"
@@ -37,6 +44,10 @@
 #include "ot_stats.h"
 #include "ot_livesync.h"
 #include "ot_persist.h"
+#include "ot_uring.h"
+#include "ot_fullscrape.h"
+#include "ot_iovec.h"
+#include "ot_clean.h"
 
 /* Globals */
 time_t       g_now_seconds;
@@ -48,6 +59,7 @@ int          g_self_pipe[2];
 static char * g_serverdir;
 static char * g_serveruser;
 static unsigned int g_udp_workers;
+static int g_udp_workers_cpu = -1;
 
 static void panic( const char *routine ) {
   fprintf( stderr, "%s: %s\n", routine, strerror(errno) );
@@ -155,26 +167,30 @@ static size_t header_complete( char * request, ssize_t byte_count ) {
   return 0;
 }
 
+#ifdef WANT_IO_URING
+static void uring_forget( const int64 sock );
+#endif
+
 static void handle_dead( const int64 sock ) {
   struct http_data* cookie=io_getcookie( sock );
+#ifdef WANT_IO_URING
+  uring_forget( sock );
+#endif
   if( cookie ) {
     iob_reset( &cookie->batch );
     array_reset( &cookie->request );
     if( cookie->flag & STRUCT_HTTP_FLAG_WAITINGFORTASK )
       mutex_workqueue_canceltask( sock );
+    fullscrape_snapshot_release( cookie->snapshot );
+    http_release_iovec( cookie );
     free( cookie );
   }
   io_close( sock );
 }
 
-static void handle_read( const int64 sock, struct ot_workstruct *ws ) {
+/* Handles byte_count bytes just read into ws->inbuf */
+static void handle_read_data( const int64 sock, struct ot_workstruct *ws, ssize_t byte_count ) {
   struct http_data* cookie = io_getcookie( sock );
-  ssize_t byte_count;
-
-  if( ( byte_count = io_tryread( sock, ws->inbuf, G_INBUF_SIZE ) ) <= 0 ) {
-    handle_dead( sock );
-    return;
-  }
 
   /* If we get the whole request in one packet, handle it without copying */
   if( !array_start( &cookie->request ) ) {
@@ -204,62 +220,498 @@ static void handle_read( const int64 sock, struct ot_workstruct *ws ) {
   }
 }
 
+static void handle_read( const int64 sock, struct ot_workstruct *ws ) {
+  ssize_t byte_count;
+
+  if( ( byte_count = io_tryread( sock, ws->inbuf, G_INBUF_SIZE ) ) <= 0 ) {
+    handle_dead( sock );
+    return;
+  }
+  handle_read_data( sock, ws, byte_count );
+}
+
 static void handle_write( const int64 sock ) {
   struct http_data* cookie=io_getcookie( sock );
-  if( !cookie || ( iob_send( sock, &cookie->batch ) <= 0 ) )
+  int64 res;
+
+  if( !cookie || ( ( res = iob_send( sock, &cookie->batch ) ) <= 0 && res != -1 ) ) {
+    handle_dead( sock );
+    return;
+  }
+
+  /* A streamed answer outran its worker: stop polling until the next part
+     arrives and let the worker go on */
+  if( ( cookie->flag & STRUCT_HTTP_FLAG_STREAMING ) && ( cookie->flag & STRUCT_HTTP_FLAG_WAITINGFORTASK ) ) {
+    if( !iob_bytesleft( &cookie->batch ) ) {
+      http_release_iovec( cookie );
+      io_dontwantwrite( sock );
+      mutex_workqueue_streamdrained( sock );
+    }
+  } else if( res == -1 )
     handle_dead( sock );
 }
 
-static void handle_accept( const int64 serversocket ) {
+/* Sets up a freshly accepted connection, returns 0 if it had to be closed */
+static int handle_new_connection( const int64 sock, const ot_ip6 ip ) {
   struct http_data *cookie;
+  tai6464 t;
+
+  /* Put fd into a non-blocking mode */
+  io_nonblock( sock );
+
+  if( !io_fd( sock ) ||
+      !( cookie = (struct http_data*)malloc( sizeof(struct http_data) ) ) ) {
+    io_close( sock );
+    return 0;
+  }
+  memset(cookie, 0, sizeof( struct http_data ) );
+  memcpy(cookie->ip,ip,sizeof(ot_ip6));
+
+  io_setcookie( sock, cookie );
+
+  stats_issue_event( EVENT_ACCEPT, FLAG_TCP, (uintptr_t)ip);
+
+  /* That breaks taia encapsulation. But there is no way to take system
+     time this often in FreeBSD and libowfat does not allow to set unix time */
+  taia_uint( &t, 0 ); /* Clear t */
+  tai_unix( &(t.sec), (g_now_seconds + OT_CLIENT_TIMEOUT) );
+  io_timeout( sock, t );
+  return 1;
+}
+
+static void handle_accept( const int64 serversocket ) {
   int64 sock;
   ot_ip6 ip;
   uint16 port;
-  tai6464 t;
 
-  while( ( sock = socket_accept6( serversocket, ip, &port, NULL ) ) != -1 ) {
+  while( ( sock = socket_accept6( serversocket, ip, &port, NULL ) ) != -1 )
+    if( handle_new_connection( sock, ip ) )
+      io_wantread( sock );
+}
+
+#ifdef WANT_IO_URING
+/* The io_uring backend replaces io_wait and the readiness driven try-reads
+   with completions: accepts and receives deliver their data right away,
+   udp answers are sent with sendmsg from the ring. Requests still run
+   through http_handle_request and udp_handle_packet, so both loops behave
+   the same. Each connection has at most one operation in flight, tagged
+   with a generation so completions for an fd that was closed and reused
+   meanwhile are recognised and dropped. */
+#define OT_URING_ENTRIES         4096
+#define OT_URING_BUFFERS         1024
+#define OT_URING_MAX_SOCKETS     64
+#define OT_URING_UDP_INFLIGHT    16
+#define OT_URING_UDP_SENDSLOTS   256
+
+enum { URING_OP_NONE, URING_OP_ACCEPT, URING_OP_RECV, URING_OP_POLLOUT, URING_OP_UDP_RECV, URING_OP_UDP_SEND,
+       URING_OP_SELFPIPE, URING_OP_TICK, URING_OP_CANCEL };
+
+#define URING_DATA(op,gen,idx) ( ( (uint64_t)(op) << 56 ) | ( (uint64_t)( (gen) & 0xffffff ) << 32 ) | (uint32_t)(idx) )
+#define URING_DATA_OP(data)    ( (int)( (data) >> 56 ) )
+#define URING_DATA_GEN(data)   ( (uint32_t)( (data) >> 32 ) & 0xffffff )
+#define URING_DATA_IDX(data)   ( (uint32_t)(data) )
+
+typedef struct {
+  int64                   sock;
+  PROTO_FLAG              proto;
+  struct sockaddr_storage addr;
+  socklen_t               addrlen;
+} ot_uring_socket;
+
+typedef struct {
+  int64                   sock;
+  struct msghdr           msg;
+  struct iovec            iov;
+  struct sockaddr_storage addr;
+} ot_uring_udp_recv;
+
+typedef struct {
+  struct msghdr           msg;
+  struct iovec            iov;
+  struct sockaddr_storage addr;
+  char                    buf[G_OUTBUF_SIZE];
+} ot_uring_udp_send;
+
+typedef struct {
+  uint32_t gen;
+  uint8_t  op;
+} ot_uring_conn;
+
+static ot_uring_socket    g_uring_sockets[OT_URING_MAX_SOCKETS];
+static unsigned int       g_uring_socket_count;
+static ot_uring_udp_recv *g_uring_udp_recv;
+static unsigned int       g_uring_udp_recv_count;
+static ot_uring_udp_send *g_uring_udp_send;
+static unsigned int       g_uring_udp_send_free[OT_URING_UDP_SENDSLOTS];
+static unsigned int       g_uring_udp_send_free_count;
+static ot_uring_conn     *g_uring_conns;
+static size_t             g_uring_conns_size;
+static char               g_uring_pipebuf[64];
+static struct __kernel_timespec g_uring_tick = { 1, 0 };
+
+static void uring_add_socket( const int64 sock, PROTO_FLAG proto ) {
+  if( g_uring_socket_count == OT_URING_MAX_SOCKETS )
+    exerr( "Too many listen sockets for io_uring." );
+  g_uring_sockets[g_uring_socket_count].sock  = sock;
+  g_uring_sockets[g_uring_socket_count].proto = proto;
+  ++g_uring_socket_count;
+}
+
+static ot_uring_conn *uring_conn( const int64 sock ) {
+  if( (size_t)sock >= g_uring_conns_size ) {
+    size_t new_size = g_uring_conns_size ? 2 * g_uring_conns_size : 1024;
+    ot_uring_conn *new_conns;
+    while( new_size <= (size_t)sock ) new_size *= 2;
+    if( !( new_conns = realloc( g_uring_conns, new_size * sizeof(ot_uring_conn) ) ) )
+      panic( "uring_conn" );
+    memset( new_conns + g_uring_conns_size, 0, ( new_size - g_uring_conns_size ) * sizeof(ot_uring_conn) );
+    g_uring_conns = new_conns;
+    g_uring_conns_size = new_size;
+  }
+  return g_uring_conns + sock;
+}
+
+/* Called from handle_dead: whatever we still have in flight on this fd
+   is cancelled and its completion will be ignored */
+static void uring_forget( const int64 sock ) {
+  ot_uring_conn *conn;
+  if( (size_t)sock >= g_uring_conns_size ) return;
+  conn = g_uring_conns + sock;
+  if( conn->op != URING_OP_NONE ) {
+    struct io_uring_sqe *sqe = uring_get_sqe( );
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = URING_DATA( conn->op, conn->gen, sock );
+    sqe->user_data = URING_DATA( URING_OP_CANCEL, 0, 0 );
+    conn->op = URING_OP_NONE;
+  }
+  ++conn->gen;
+}
+
+static void uring_arm_accept( unsigned int idx ) {
+  struct io_uring_sqe *sqe = uring_get_sqe( );
+  ot_uring_socket *s = g_uring_sockets + idx;
+  s->addrlen      = sizeof(s->addr);
+  sqe->opcode     = IORING_OP_ACCEPT;
+  sqe->fd         = s->sock;
+  sqe->addr       = (uint64_t)(uintptr_t)&s->addr;
+  sqe->addr2      = (uint64_t)(uintptr_t)&s->addrlen;
+  sqe->user_data  = URING_DATA( URING_OP_ACCEPT, 0, idx );
+}
+
+static void uring_arm_udp_recv( unsigned int idx ) {
+  struct io_uring_sqe *sqe = uring_get_sqe( );
+  ot_uring_udp_recv *r = g_uring_udp_recv + idx;
+  r->msg.msg_name    = &r->addr;
+  r->msg.msg_namelen = sizeof(r->addr);
+  r->msg.msg_iov     = &r->iov;
+  r->msg.msg_iovlen  = 1;
+  r->iov.iov_base    = NULL;
+  r->iov.iov_len     = G_INBUF_SIZE;
+  sqe->opcode     = IORING_OP_RECVMSG;
+  sqe->fd         = r->sock;
+  sqe->addr       = (uint64_t)(uintptr_t)&r->msg;
+  sqe->len        = 1;
+  sqe->flags      = IOSQE_BUFFER_SELECT;
+  sqe->buf_group  = OT_URING_BUFFER_GROUP;
+  sqe->user_data  = URING_DATA( URING_OP_UDP_RECV, 0, idx );
+}
+
+static void uring_arm_selfpipe( void ) {
+  struct io_uring_sqe *sqe = uring_get_sqe( );
+  sqe->opcode     = IORING_OP_READ;
+  sqe->fd         = g_self_pipe[0];
+  sqe->addr       = (uint64_t)(uintptr_t)g_uring_pipebuf;
+  sqe->len        = sizeof(g_uring_pipebuf);
+  sqe->off        = (uint64_t)-1;
+  sqe->user_data  = URING_DATA( URING_OP_SELFPIPE, 0, 0 );
+}
+
+/* Wakes us up periodically for timeouts and livesync, as io_wait would */
+static void uring_arm_tick( void ) {
+  struct io_uring_sqe *sqe = uring_get_sqe( );
+  sqe->opcode     = IORING_OP_TIMEOUT;
+  sqe->fd         = -1;
+  sqe->addr       = (uint64_t)(uintptr_t)&g_uring_tick;
+  sqe->len        = 1;
+  sqe->user_data  = URING_DATA( URING_OP_TICK, 0, 0 );
+}
+
+/* Decide what a connection waits for next, mirroring what io_wantread and
+   io_wantwrite would have told the kernel in the io_wait loop */
+static void uring_arm_conn( const int64 sock ) {
+  struct http_data    *cookie = io_getcookie( sock );
+  ot_uring_conn       *conn;
+  struct io_uring_sqe *sqe;
+
+  if( !cookie ) return;
+  conn = uring_conn( sock );
+  if( conn->op != URING_OP_NONE ) return;
+
+  if( iob_bytesleft( &cookie->batch ) ) {
+    sqe = uring_get_sqe( );
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = sock;
+    sqe->poll32_events = POLLOUT;
+    conn->op = URING_OP_POLLOUT;
+  } else if( !( cookie->flag & STRUCT_HTTP_FLAG_WAITINGFORTASK ) ) {
+    sqe = uring_get_sqe( );
+    sqe->opcode        = IORING_OP_RECV;
+    sqe->fd            = sock;
+    sqe->len           = G_INBUF_SIZE;
+    sqe->flags         = IOSQE_BUFFER_SELECT;
+    sqe->buf_group     = OT_URING_BUFFER_GROUP;
+    conn->op = URING_OP_RECV;
+  } else
+    return;
+  sqe->user_data = URING_DATA( conn->op, conn->gen, sock );
+}
+
+static void uring_sockaddr_ip6( const struct sockaddr_storage *addr, ot_ip6 ip, uint16_t *port ) {
+  if( addr->ss_family == AF_INET6 ) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)addr;
+    memcpy( ip, &sin6->sin6_addr, sizeof(ot_ip6) );
+    *port = ntohs( sin6->sin6_port );
+  } else {
+    const struct sockaddr_in *sin = (const struct sockaddr_in*)addr;
+    memcpy( ip, V4mappedprefix, sizeof(V4mappedprefix) );
+    memcpy( ip + sizeof(V4mappedprefix), &sin->sin_addr, 4 );
+    *port = ntohs( sin->sin_port );
+  }
+}
+
+static void uring_handle_udp( struct ot_workstruct *ws, unsigned int idx, int res, unsigned int flags ) {
+  ot_uring_udp_recv *r = g_uring_udp_recv + idx;
+  ot_uring_udp_send *s = NULL;
+  char              *inbuf = ws->inbuf, *outbuf = ws->outbuf;
+  unsigned int       bid = flags >> IORING_CQE_BUFFER_SHIFT;
+  size_t             reply_size;
+  ot_ip6             remoteip;
+  uint16_t           remoteport;
+
+  if( !( flags & IORING_CQE_F_BUFFER ) )
+    return;
+
+  /* Answer straight from a send slot, if we have one left */
+  if( g_uring_udp_send_free_count )
+    s = g_uring_udp_send + g_uring_udp_send_free[--g_uring_udp_send_free_count];
+
+  uring_sockaddr_ip6( &r->addr, remoteip, &remoteport );
+  ws->inbuf = uring_buffer( bid );
+  if( s ) ws->outbuf = s->buf;
+  reply_size = udp_handle_packet( ws, res, remoteip, remoteport );
+  ws->inbuf = inbuf;
+  ws->outbuf = outbuf;
+  uring_buffer_release( bid );
+  if( reply_size )
+    stats_issue_event( EVENT_SENT, FLAG_UDP, reply_size );
+
+  if( !s ) {
+    if( reply_size )
+      socket_send6( r->sock, ws->outbuf, reply_size, remoteip, remoteport, 0 );
+  } else if( !reply_size )
+    g_uring_udp_send_free[g_uring_udp_send_free_count++] = s - g_uring_udp_send;
+  else {
+    struct io_uring_sqe *sqe = uring_get_sqe( );
+    memcpy( &s->addr, &r->addr, r->msg.msg_namelen );
+    s->msg.msg_name    = &s->addr;
+    s->msg.msg_namelen = r->msg.msg_namelen;
+    s->msg.msg_iov     = &s->iov;
+    s->msg.msg_iovlen  = 1;
+    s->iov.iov_base    = s->buf;
+    s->iov.iov_len     = reply_size;
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = r->sock;
+    sqe->addr      = (uint64_t)(uintptr_t)&s->msg;
+    sqe->len       = 1;
+    sqe->user_data = URING_DATA( URING_OP_UDP_SEND, 0, s - g_uring_udp_send );
+  }
+  /* Queued replies count as written */
+  stats_trace_end( ws );
+}
+
+static void uring_handle_completion( struct ot_workstruct *ws, uint64_t data, int res, unsigned int flags ) {
+  const int64    sock = URING_DATA_IDX( data );
+  ot_uring_conn *conn = NULL;
+  ot_ip6         ip;
+  uint16_t       port;
+
+  switch( URING_DATA_OP( data ) ) {
+  case URING_OP_ACCEPT:
+    if( res >= 0 ) {
+      uring_sockaddr_ip6( &g_uring_sockets[sock].addr, ip, &port );
+      if( handle_new_connection( res, ip ) )
+        uring_arm_conn( res );
+    }
+    uring_arm_accept( sock );
+    return;
+  case URING_OP_RECV:
+  case URING_OP_POLLOUT:
+    conn = uring_conn( sock );
+    if( URING_DATA_GEN( data ) != ( conn->gen & 0xffffff ) ) {
+      /* Stale completion for a connection we have closed */
+      if( flags & IORING_CQE_F_BUFFER )
+        uring_buffer_release( flags >> IORING_CQE_BUFFER_SHIFT );
+      return;
+    }
+    conn->op = URING_OP_NONE;
+    break;
+  case URING_OP_UDP_RECV:
+    if( res > 0 )
+      uring_handle_udp( ws, sock, res, flags );
+    else if( flags & IORING_CQE_F_BUFFER )
+      uring_buffer_release( flags >> IORING_CQE_BUFFER_SHIFT );
+    uring_arm_udp_recv( sock );
+    return;
+  case URING_OP_UDP_SEND:
+    g_uring_udp_send_free[g_uring_udp_send_free_count++] = sock;
+    return;
+  case URING_OP_SELFPIPE:
+    uring_arm_selfpipe( );
+    return;
+  case URING_OP_TICK:
+    uring_arm_tick( );
+    return;
+  default:
+    return;
+  }
 
-    /* Put fd into a non-blocking mode */
-    io_nonblock( sock );
+  if( URING_DATA_OP( data ) == URING_OP_RECV ) {
+    if( res > 0 && ( flags & IORING_CQE_F_BUFFER ) ) {
+      char *inbuf = ws->inbuf;
+      unsigned int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+      ws->inbuf = uring_buffer( bid );
+      handle_read_data( sock, ws, res );
+      ws->inbuf = inbuf;
+      uring_buffer_release( bid );
+    } else {
+      if( flags & IORING_CQE_F_BUFFER )
+        uring_buffer_release( flags >> IORING_CQE_BUFFER_SHIFT );
+      /* Out of buffers is no reason to drop the client, just try again */
+      if( res != -ENOBUFS ) {
+        handle_dead( sock );
+        return;
+      }
+    }
+  } else {
+    struct http_data *cookie;
+    if( res < 0 ) {
+      handle_dead( sock );
+      return;
+    }
+    handle_write( sock );
+    /* Once everything is out, the connection is done, unless a stream
+       waits for its next part */
+    if( ( cookie = io_getcookie( sock ) ) && !iob_bytesleft( &cookie->batch ) &&
+        !( ( cookie->flag & STRUCT_HTTP_FLAG_STREAMING ) && ( cookie->flag & STRUCT_HTTP_FLAG_WAITINGFORTASK ) ) ) {
+      handle_dead( sock );
+      return;
+    }
+  }
+  uring_arm_conn( sock );
+}
+
+static int uring_setup( void ) {
+  unsigned int i, j, udp_count = 0;
+
+  if( uring_init( OT_URING_ENTRIES, OT_URING_BUFFERS, G_INBUF_SIZE ) )
+    return -1;
+
+  for( i = 0; i < g_uring_socket_count; ++i )
+    if( g_uring_sockets[i].proto == FLAG_UDP )
+      ++udp_count;
+
+  g_uring_udp_recv_count = udp_count * OT_URING_UDP_INFLIGHT;
+  g_uring_udp_recv = calloc( g_uring_udp_recv_count + 1, sizeof(ot_uring_udp_recv) );
+  g_uring_udp_send = calloc( OT_URING_UDP_SENDSLOTS, sizeof(ot_uring_udp_send) );
+  if( !g_uring_udp_recv || !g_uring_udp_send )
+    panic( "uring_setup" );
+  for( i = 0; i < OT_URING_UDP_SENDSLOTS; ++i )
+    g_uring_udp_send_free[g_uring_udp_send_free_count++] = i;
+
+  for( i = 0, udp_count = 0; i < g_uring_socket_count; ++i ) {
+    if( g_uring_sockets[i].proto == FLAG_TCP )
+      uring_arm_accept( i );
+    else
+      for( j = 0; j < OT_URING_UDP_INFLIGHT; ++j, ++udp_count ) {
+        g_uring_udp_recv[udp_count].sock = g_uring_sockets[i].sock;
+        uring_arm_udp_recv( udp_count );
+      }
+  }
+  uring_arm_selfpipe( );
+  uring_arm_tick( );
+  return 0;
+}
+
+static void uring_mainloop( struct ot_workstruct *ws ) {
+  time_t next_timeout_check = g_now_seconds + OT_CLIENT_TIMEOUT_CHECKINTERVAL;
+  struct io_uring_cqe *cqe;
+  struct iovec *iovector;
+  int    iovec_entries, is_partial;
 
-    if( !io_fd( sock ) ||
-        !( cookie = (struct http_data*)malloc( sizeof(struct http_data) ) ) ) {
-      io_close( sock );
-      continue;
+  for( ; ; ) {
+    int64 sock;
+
+    uring_enter( 1 );
+
+    while( ( cqe = uring_peek_cqe( ) ) ) {
+      uint64_t     data  = cqe->user_data;
+      int          res   = cqe->res;
+      unsigned int flags = cqe->flags;
+      uring_cqe_seen( );
+      uring_handle_completion( ws, data, res, flags );
     }
-    memset(cookie, 0, sizeof( struct http_data ) );
-    memcpy(cookie->ip,ip,sizeof(ot_ip6));
 
-    io_setcookie( sock, cookie );
-    io_wantread( sock );
+    while( ( sock = mutex_workqueue_popresult( &iovec_entries, &iovector, &is_partial ) ) != -1 ) {
+      if( http_sendiovecdata( sock, ws, iovec_entries, iovector, is_partial ) == -1 ) {
+        handle_dead( sock );
+        continue;
+      }
+      /* The answer replaces a receive that may still be pending */
+      uring_forget( sock );
+      uring_arm_conn( sock );
+    }
 
-    stats_issue_event( EVENT_ACCEPT, FLAG_TCP, (uintptr_t)ip);
+    if( g_now_seconds > next_timeout_check ) {
+      while( ( sock = io_timeouted() ) != -1 )
+        handle_dead( sock );
+      next_timeout_check = g_now_seconds + OT_CLIENT_TIMEOUT_CHECKINTERVAL;
+    }
 
-    /* That breaks taia encapsulation. But there is no way to take system
-       time this often in FreeBSD and libowfat does not allow to set unix time */
-    taia_uint( &t, 0 ); /* Clear t */
-    tai_unix( &(t.sec), (g_now_seconds + OT_CLIENT_TIMEOUT) );
-    io_timeout( sock, t );
+    livesync_ticker();
+
+    /* Enforce setting the clock */
+    signal_handler( SIGALRM );
   }
 }
+#endif
 
 static void * server_mainloop( void * args ) {
   struct ot_workstruct ws;
   time_t next_timeout_check = g_now_seconds + OT_CLIENT_TIMEOUT_CHECKINTERVAL;
   struct iovec *iovector;
-  int    iovec_entries;
+  int    iovec_entries, is_partial;
 
   (void)args;
 
   /* Initialize our "thread local storage" */
   ws.inbuf   = malloc( G_INBUF_SIZE );
   ws.outbuf  = malloc( G_OUTBUF_SIZE );
+  ws.traced  = 0;
 #ifdef _DEBUG_HTTPERROR
   ws.debugbuf= malloc( G_DEBUGBUF_SIZE );
 #endif
   if( !ws.inbuf || !ws.outbuf )
     panic( "Initializing worker failed" );
 
+#ifdef WANT_IO_URING
+  if( !uring_setup( ) ) {
+    uring_mainloop( &ws );
+    return 0;
+  }
+  fputs( "io_uring not usable on this kernel, falling back to io_wait.\n", stderr );
+#endif
+
   for( ; ; ) {
     int64 sock;
 
@@ -277,8 +729,9 @@ static void * server_mainloop( void * args ) {
         handle_read( sock, &ws );
     }
 
-    while( ( sock = mutex_workqueue_popresult( &iovec_entries, &iovector ) ) != -1 )
-      http_sendiovecdata( sock, &ws, iovec_entries, iovector );
+    while( ( sock = mutex_workqueue_popresult( &iovec_entries, &iovector, &is_partial ) ) != -1 )
+      if( http_sendiovecdata( sock, &ws, iovec_entries, iovector, is_partial ) == -1 )
+        handle_dead( sock );
 
     while( ( sock = io_canwrite( ) ) != -1 )
       handle_write( sock );
@@ -334,9 +787,13 @@ static int64_t ot_try_bind( ot_ip6 ip, uint16_t port, int backlog, PROTO_FLAG pr
 
   if( (proto == FLAG_UDP) && g_udp_workers ) {
     io_block( sock );
-    udp_init( sock, g_udp_workers );
-  } else
+    udp_init( sock, g_udp_workers, g_udp_workers_cpu );
+  } else {
     io_wantread( sock );
+#ifdef WANT_IO_URING
+    uring_add_socket( sock, proto );
+#endif
+  }
 
 #ifdef _DEBUG
   fputs( " success.\n", stderr);
@@ -477,6 +934,60 @@ int parse_configfile( char * config_filename ) {
       char *value = p + 18;
       while( isspace(*value) ) ++value;
       scan_uint( value, &g_udp_workers );
+    } else if(!byte_diff(p,22,"listen.udp.workers.cpu" ) && isspace(p[22])) {
+      char *value = p + 22;
+      while( isspace(*value) ) ++value;
+      if( !scan_int( value, &g_udp_workers_cpu ) ) goto parse_error;
+    } else if(!byte_diff(p,24,"tasks.fullscrape.workers" ) && isspace(p[24])) {
+      char *value = p + 24;
+      unsigned int workers;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &workers ) ) goto parse_error;
+      mutex_workqueue_setworkers( TASK_FULLSCRAPE, workers );
+    } else if(!byte_diff(p,19,"tasks.stats.workers" ) && isspace(p[19])) {
+      char *value = p + 19;
+      unsigned int workers;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &workers ) ) goto parse_error;
+      mutex_workqueue_setworkers( TASK_STATS, workers );
+    } else if(!byte_diff(p,18,"stats.trace.sample" ) && isspace(p[18])) {
+      char *value = p + 18;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_trace_sample ) ) goto parse_error;
+    } else if(!byte_diff(p,13,"clean.threads" ) && isspace(p[13])) {
+      char *value = p + 13;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_clean_threads ) ) goto parse_error;
+    } else if(!byte_diff(p,11,"clean.cycle" ) && isspace(p[11])) {
+      char *value = p + 11;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_clean_cycle ) ) goto parse_error;
+    } else if(!byte_diff(p,17,"iovec.pool.chunks" ) && isspace(p[17])) {
+      char *value = p + 17;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_iovec_pool_chunks ) ) goto parse_error;
+    } else if(!byte_diff(p,20,"iovec.pool.hugepages" ) && isspace(p[20])) {
+      char *value = p + 20;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_iovec_pool_hugepages ) ) goto parse_error;
+#ifdef WANT_FULLSCRAPE
+    } else if(!byte_diff(p,16,"fullscrape.cache" ) && isspace(p[16])) {
+      char *value = p + 16;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_fullscrape_cache_interval ) ) goto parse_error;
+    } else if(!byte_diff(p,18,"fullscrape.threads" ) && isspace(p[18])) {
+      char *value = p + 18;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_fullscrape_threads ) ) goto parse_error;
+    } else if(!byte_diff(p,21,"fullscrape.delta.keep" ) && isspace(p[21])) {
+      char *value = p + 21;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_fullscrape_delta_keep ) ) goto parse_error;
+    } else if(!byte_diff(p,20,"fullscrape.checksums" ) && isspace(p[20])) {
+      char *value = p + 20;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_fullscrape_checksums ) ) goto parse_error;
+#endif
 #ifdef WANT_ACCESSLIST_WHITE
     } else if(!byte_diff(p, 16, "access.whitelist" ) && isspace(p[16])) {
       set_config_option( &g_accesslist_filename, p+17 );
@@ -702,7 +1213,7 @@ int main( int argc, char **argv ) {
   }
 
   if( !g_udp_workers )
-    udp_init( -1, 0 );
+    udp_init( -1, 0, -1 );
 
 #ifdef WANT_SYSLOGS
   openlog( "opentracker", 0, LOG_USER );
@@ -715,8 +1226,13 @@ int main( int argc, char **argv ) {
   g_now_seconds = time( NULL );
 
   /* Create our self pipe which allows us to interrupt mainloops
-     io_wait in case some data is available to send out */
+     io_wait in case some data is available to send out. On Linux an
+     eventfd does, it folds any number of wakeups into one read. */
+#ifdef __linux__
+  if( ( g_self_pipe[0] = g_self_pipe[1] = eventfd( 0, EFD_NONBLOCK ) ) == -1 )
+#else
   if( pipe( g_self_pipe ) == -1 )
+#endif
     panic( "selfpipe failed: " );
   if( !io_fd( g_self_pipe[0] ) )
     panic( "selfpipe io_fd failed: " );
@@ -745,4 +1261,4 @@ int main( int argc, char **argv ) {
   return 0;
 }
 
-const char *g_version_opentracker_c = "$Source: /home/cvsroot/opentracker/opentracker.c,v $: $Revision: 1.238 $\n";
+const char *g_version_opentracker_c = "$Source: /home/cvsroot/opentracker/opentracker.c,v $: $Revision: 1.244 $\n";
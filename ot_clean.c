@@ -7,6 +7,9 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
 
 /* Libowfat */
 #include "io.h"
@@ -17,6 +20,34 @@
 #include "ot_vector.h"
 #include "ot_clean.h"
 #include "ot_stats.h"
+#include "ot_fullscrape.h"
+#include "ot_usdt.h"
+
+unsigned int g_clean_threads = 1;
+unsigned int g_clean_cycle   = OT_CLEAN_INTERVAL_MINUTES * 60;
+
+/* One per cleaner thread, which owns buckets bucket_first up to but not
+   including bucket_last. The numbers are only written by their thread. */
+typedef struct {
+  pthread_t          thread;
+  int                bucket_first, bucket_last;
+  uint64_t           pass_ns;       /* Own part of the last cycle */
+  uint64_t           backoff_ns;    /* Current extra pause per bucket */
+  unsigned long long backoffs;      /* Times contention raised the backoff */
+} ot_clean_shard;
+
+static ot_clean_shard  clean_shards[OT_CLEAN_MAX_THREADS];
+static unsigned int    clean_shard_count;
+
+/* Shards wait for each other at the end of a cycle, so that the last one
+   can publish what they found in one go. Cycle numbers only under
+   clean_mutex. */
+static pthread_mutex_t clean_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  clean_cycle_done = PTHREAD_COND_INITIALIZER;
+static unsigned int    clean_shards_done;
+static uint64_t        clean_cycle_started;
+static unsigned long long clean_cycles, clean_cycles_late;
+static uint64_t        clean_cycle_last, clean_cycle_min, clean_cycle_max, clean_cycle_sum;
 
 /* Returns amount of removed peers */
 static ssize_t clean_single_bucket( ot_peer *peers, size_t peer_count, time_t timedout, int *removed_seeders ) {
@@ -44,26 +75,38 @@ static ssize_t clean_single_bucket( ot_peer *peers, size_t peer_count, time_t ti
 }
 
 /* Clean a single torrent
-   return 1 if torrent timed out
+   return 1 if torrent timed out, the caller then drops it and delta full
+   scrapes report it as deleted
 */
 int clean_single_torrent( ot_torrent *torrent ) {
   ot_peerlist *peer_list = torrent->peer_list;
   ot_vector *bucket_list = &peer_list->peers;
   time_t timedout = (time_t)( g_now_minutes - peer_list->base );
   int num_buckets = 1, removed_seeders = 0;
+  size_t removed_total = 0;
+
+  OT_USDT3( clean_torrent, torrent->hash, peer_list->peer_count, timedout );
 
   /* No need to clean empty torrent */
   if( !timedout )
     return 0;
 
   /* Torrent has idled out */
-  if( timedout > OT_TORRENT_TIMEOUT )
+  if( timedout > OT_TORRENT_TIMEOUT ) {
+    fullscrape_delta_removed( torrent );
+    stats_top_remove( torrent );
     return 1;
+  }
 
   /* Nothing to be cleaned here? Test if torrent is worth keeping */
   if( timedout > OT_PEER_TIMEOUT ) {
-    if( !peer_list->peer_count )
-      return peer_list->down_count ? 0 : 1;
+    if( !peer_list->peer_count ) {
+      if( peer_list->down_count )
+        return 0;
+      fullscrape_delta_removed( torrent );
+      stats_top_remove( torrent );
+      return 1;
+    }
     timedout = OT_PEER_TIMEOUT;
   }
 
@@ -74,6 +117,7 @@ int clean_single_torrent( ot_torrent *torrent ) {
 
   while( num_buckets-- ) {
     size_t removed_peers = clean_single_bucket( bucket_list->data, bucket_list->size, timedout, &removed_seeders );
+    removed_total         += removed_peers;
     peer_list->peer_count -= removed_peers;
     bucket_list->size     -= removed_peers;
     if( bucket_list->size < removed_peers )
@@ -82,6 +126,11 @@ int clean_single_torrent( ot_torrent *torrent ) {
   }
 
   peer_list->seed_count -= removed_seeders;
+  if( removed_total ) {
+    peer_list->modified = g_now_seconds;
+    stats_issue_peers( -(ssize_t)removed_total, -(ssize_t)removed_seeders );
+    stats_top_update( torrent );
+  }
 
   /* See, if we need to convert a torrent from simple vector to bucket list */
   if( ( peer_list->peer_count > OT_PEER_BUCKET_MINCOUNT ) || OT_PEERLIST_HASBUCKETS(peer_list) )
@@ -98,13 +147,74 @@ int clean_single_torrent( ot_torrent *torrent ) {
 
 }
 
-/* Clean up all peers in current bucket, remove timedout pools and
+static void clean_sleep( uint64_t ns ) {
+  struct timespec ts;
+  ts.tv_sec  = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  nanosleep( &ts, NULL );
+}
+
+/* Spread a shard's buckets evenly over the cycle: sleep until the next
+   one is due, not at all when running late. While ahead, back off for
+   as long as lock requests keep waiting for taken buckets, but never
+   past the end of the cycle. */
+static void clean_pace( ot_clean_shard *shard, uint64_t started, int done, size_t *stalls ) {
+  const int buckets = shard->bucket_last - shard->bucket_first;
+  uint64_t  slot = (uint64_t)g_clean_cycle * 1000000000 / buckets;
+  uint64_t  due  = started + slot * done, end = started + slot * buckets, now = stats_latency_start( ), wait;
+  size_t    stalls_now = mutex_bucket_stalls( );
+
+  if( stalls_now - *stalls > OT_CLEAN_BUSY_STALLS ) {
+    shard->backoff_ns = shard->backoff_ns ? 2 * shard->backoff_ns : OT_CLEAN_BACKOFF_MIN * 1000;
+    if( shard->backoff_ns > slot )
+      shard->backoff_ns = slot;
+    ++shard->backoffs;
+  } else
+    shard->backoff_ns /= 2;
+  *stalls = stalls_now;
+
+  if( due <= now )
+    return;
+  wait = due - now + shard->backoff_ns;
+  if( now + wait > end )
+    wait = end - now;
+  clean_sleep( wait );
+}
+
+/* The last shard through publishes the cycle and wakes the others */
+static void clean_cycle_finish( void ) {
+  pthread_mutex_lock( &clean_mutex );
+  if( ++clean_shards_done == clean_shard_count ) {
+    uint64_t now = stats_latency_start( ), took = now - clean_cycle_started;
+
+    stats_shape_publish( clean_shard_count );
+
+    if( !clean_cycles++ || took < clean_cycle_min ) clean_cycle_min = took;
+    if( took > clean_cycle_max ) clean_cycle_max = took;
+    if( took > (uint64_t)g_clean_cycle * 1050000000 ) ++clean_cycles_late;
+    clean_cycle_last    = took;
+    clean_cycle_sum    += took;
+    clean_cycle_started = now;
+    clean_shards_done   = 0;
+    pthread_cond_broadcast( &clean_cycle_done );
+  } else {
+    unsigned long long cycle = clean_cycles;
+    while( cycle == clean_cycles )
+      pthread_cond_wait( &clean_cycle_done, &clean_mutex );
+  }
+  pthread_mutex_unlock( &clean_mutex );
+}
+
+/* Clean up all peers in the shard's buckets, remove timedout pools and
  torrents */
 static void * clean_worker( void * args ) {
-  (void) args;
+  ot_clean_shard *shard = (ot_clean_shard *)args;
+  mutex_bucket_set_class( LOCK_CLASS_CLEAN );
   while( 1 ) {
-    int bucket = OT_BUCKET_COUNT;
-    while( bucket-- ) {
+    uint64_t started = stats_latency_start( );
+    size_t   stalls  = mutex_bucket_stalls( );
+    int      bucket  = shard->bucket_last, done = 0;
+    while( bucket-- > shard->bucket_first ) {
       ot_vector *torrents_list = mutex_bucket_lock( bucket );
       size_t     toffs;
       int        delta_torrentcount = 0;
@@ -117,23 +227,68 @@ static void * clean_worker( void * args ) {
           --toffs;
         }
       }
+      stats_shape_bucket( shard - clean_shards, torrents_list );
       mutex_bucket_unlock( bucket, delta_torrentcount );
       if( !g_opentracker_running )
         return NULL;
-      usleep( OT_CLEAN_SLEEP );
+      clean_pace( shard, started, ++done, &stalls );
     }
-    stats_cleanup();
+    shard->pass_ns = stats_latency_start( ) - started;
+    clean_cycle_finish( );
   }
   return NULL;
 }
 
-static pthread_t thread_id;
 void clean_init( void ) {
-  pthread_create( &thread_id, NULL, clean_worker, NULL );
+  unsigned int i;
+
+  if( g_clean_threads < 1 ) g_clean_threads = 1;
+  if( g_clean_threads > OT_CLEAN_MAX_THREADS ) g_clean_threads = OT_CLEAN_MAX_THREADS;
+  if( g_clean_cycle < 1 ) g_clean_cycle = 1;
+
+  clean_shard_count   = g_clean_threads;
+  clean_cycle_started = stats_latency_start( );
+  for( i=0; i<clean_shard_count; ++i ) {
+    clean_shards[i].bucket_first = i * OT_BUCKET_COUNT / clean_shard_count;
+    clean_shards[i].bucket_last  = ( i + 1 ) * OT_BUCKET_COUNT / clean_shard_count;
+  }
+  for( i=0; i<clean_shard_count; ++i )
+    pthread_create( &clean_shards[i].thread, NULL, clean_worker, clean_shards + i );
 }
 
 void clean_deinit( void ) {
-  pthread_cancel( thread_id );
+  unsigned int i;
+  for( i=0; i<clean_shard_count; ++i )
+    pthread_cancel( clean_shards[i].thread );
+}
+
+size_t clean_return_stats( char *reply ) {
+  unsigned long long cycles, late;
+  uint64_t last, min, max, sum, since;
+  char *r = reply;
+  unsigned int i;
+
+  pthread_mutex_lock( &clean_mutex );
+  cycles = clean_cycles; late = clean_cycles_late;
+  last = clean_cycle_last; min = clean_cycle_min; max = clean_cycle_max; sum = clean_cycle_sum;
+  since = stats_latency_start( ) - clean_cycle_started;
+  pthread_mutex_unlock( &clean_mutex );
+
+  r += sprintf( r, "%u clean threads, target cycle %u s, current cycle running for %.1f s\n", clean_shard_count, g_clean_cycle, since / 1e9 );
+  if( cycles )
+    r += sprintf( r, "%llu cycles, %llu over target, last %.1f s, min %.1f s, avg %.1f s, max %.1f s\n",
+                  cycles, late, last / 1e9, min / 1e9, sum / 1e9 / cycles, max / 1e9 );
+  else
+    r += sprintf( r, "no cycle has completed yet\n" );
+
+  r += sprintf( r, "\n%-6s %-12s %12s %12s %12s\n", "shard", "buckets", "last pass s", "backoff ms", "backoffs" );
+  for( i=0; i<clean_shard_count; ++i ) {
+    ot_clean_shard *shard = clean_shards + i;
+    char range[32];
+    sprintf( range, "%d-%d", shard->bucket_first, shard->bucket_last - 1 );
+    r += sprintf( r, "%-6u %-12s %12.1f %12.1f %12llu\n", i, range, shard->pass_ns / 1e9, shard->backoff_ns / 1e6, shard->backoffs );
+  }
+  return r - reply;
 }
 
-const char *g_version_clean_c = "$Source: /home/cvsroot/opentracker/ot_clean.c,v $: $Revision: 1.21 $\n";
+const char *g_version_clean_c = "$Source: /home/cvsroot/opentracker/ot_clean.c,v $: $Revision: 1.30 $\n";
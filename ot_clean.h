@@ -6,14 +6,28 @@
 #ifndef __OT_CLEAN_H__
 #define __OT_CLEAN_H__
 
-/* The amount of time a clean cycle should take */
+/* The amount of time a clean cycle should take, unless told otherwise
+   by clean.cycle */
 #define OT_CLEAN_INTERVAL_MINUTES       2
 
-/* So after each bucket wait 1 / OT_BUCKET_COUNT intervals */
-#define OT_CLEAN_SLEEP ( ( ( OT_CLEAN_INTERVAL_MINUTES ) * 60 * 1000000 ) / ( OT_BUCKET_COUNT ) )
+/* Cleaner threads, each owning an equal share of the buckets */
+#define OT_CLEAN_MAX_THREADS            16
 
-void clean_init( void );
-void clean_deinit( void );
-int  clean_single_torrent( ot_torrent *torrent );
+/* A cleaner backs off when more than this many bucket lock requests,
+   its own and everyone else's, had to wait since it finished its
+   previous bucket. Backoff starts at OT_CLEAN_BACKOFF_MIN microseconds
+   and doubles for as long as that goes on, at most to the time paced for
+   a single bucket. It only lengthens pauses taken while ahead of
+   schedule, and never beyond the end of the cycle. */
+#define OT_CLEAN_BUSY_STALLS            16
+#define OT_CLEAN_BACKOFF_MIN            1000
+
+extern unsigned int g_clean_threads;
+extern unsigned int g_clean_cycle;
+
+void   clean_init( void );
+void   clean_deinit( void );
+int    clean_single_torrent( ot_torrent *torrent );
+size_t clean_return_stats( char *reply );
 
 #endif
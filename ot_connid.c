@@ -0,0 +1,99 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_connid.h"
+
+/* Connection ids are a SipHash-2-4 MAC over remote ip, port and epoch,
+   keyed with a secret drawn once at startup. Since the epoch is part of
+   the MAC input, ids rotate by themselves when the clock advances and no
+   worker ever needs to write shared key state. */
+static uint64_t g_connid_key[2];
+
+#define ROTL(x,b) (uint64_t)( ((x) << (b)) | ( (x) >> (64 - (b))) )
+#define SIPROUND                                               \
+  do {                                                         \
+    v0 += v1; v1 = ROTL(v1,13); v1 ^= v0; v0 = ROTL(v0,32);    \
+    v2 += v3; v3 = ROTL(v3,16); v3 ^= v2;                      \
+    v0 += v3; v3 = ROTL(v3,21); v3 ^= v0;                      \
+    v2 += v1; v1 = ROTL(v1,17); v1 ^= v2; v2 = ROTL(v2,32);    \
+  } while(0)
+
+static uint64_t read_le64( const uint8_t *p ) {
+  return (uint64_t)p[0]       | (uint64_t)p[1] <<  8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+         (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint64_t siphash24( const uint64_t key[2], const uint8_t *in, size_t inlen ) {
+  uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+  uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+  uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+  uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+  uint64_t b  = ((uint64_t)inlen) << 56, m;
+  const uint8_t *end = in + inlen - ( inlen % 8 );
+
+  for( ; in != end; in += 8 ) {
+    m = read_le64( in );
+    v3 ^= m; SIPROUND; SIPROUND; v0 ^= m;
+  }
+
+  /* Remaining bytes go into the length word */
+  while( inlen-- & 7 )
+    b |= ((uint64_t)in[inlen & 7]) << ( 8 * ( inlen & 7 ) );
+
+  v3 ^= b; SIPROUND; SIPROUND; v0 ^= b;
+  v2 ^= 0xff; SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static void connid_make_for_epoch( uint32_t connid[2], const ot_ip6 remoteip, uint16_t remoteport, uint32_t epoch ) {
+  uint8_t  plain[ sizeof(ot_ip6) + 2 + 4 ];
+  uint64_t mac;
+
+  memcpy( plain, remoteip, sizeof(ot_ip6) );
+  memcpy( plain + sizeof(ot_ip6), &remoteport, 2 );
+  memcpy( plain + sizeof(ot_ip6) + 2, &epoch, 4 );
+
+  mac = siphash24( g_connid_key, plain, sizeof(plain) );
+  memcpy( connid, &mac, sizeof(mac) );
+}
+
+void connid_make( uint32_t connid[2], const ot_ip6 remoteip, uint16_t remoteport ) {
+  connid_make_for_epoch( connid, remoteip, remoteport, (uint32_t)( g_now_seconds / OT_CONNID_EPOCH_SECONDS ) );
+}
+
+int connid_verify( const uint32_t connid[2], const ot_ip6 remoteip, uint16_t remoteport ) {
+  uint32_t epoch = (uint32_t)( g_now_seconds / OT_CONNID_EPOCH_SECONDS ), expected[2];
+
+  connid_make_for_epoch( expected, remoteip, remoteport, epoch );
+  if( connid[0] == expected[0] && connid[1] == expected[1] )
+    return 1;
+
+  /* Client may still use the id it got in the previous epoch */
+  connid_make_for_epoch( expected, remoteip, remoteport, epoch - 1 );
+  return connid[0] == expected[0] && connid[1] == expected[1];
+}
+
+void connid_init( void ) {
+  int fd = open( "/dev/urandom", O_RDONLY );
+
+  if( fd < 0 || read( fd, g_connid_key, sizeof(g_connid_key) ) != (ssize_t)sizeof(g_connid_key) ) {
+    fprintf( stderr, "Warning: Can't read /dev/urandom, falling back to random() for connection id key.\n" );
+    g_connid_key[0] = ( (uint64_t)random() << 32 ) ^ random();
+    g_connid_key[1] = ( (uint64_t)random() << 32 ) ^ random();
+  }
+  if( fd >= 0 )
+    close( fd );
+}
+
+const char *g_version_connid_c = "$Source: /home/cvsroot/opentracker/ot_connid.c,v $: $Revision: 1.0 $\n";
@@ -0,0 +1,22 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_CONNID_H__
+#define __OT_CONNID_H__
+
+/* Connection ids handed out to udp clients are valid for the epoch they
+   were made in and the one after, so between two and four minutes */
+#define OT_CONNID_EPOCH_SECONDS 120
+
+void connid_init( void );
+
+/* Derive the connection id for remote address and port in current epoch */
+void connid_make( uint32_t connid[2], const ot_ip6 remoteip, uint16_t remoteport );
+
+/* Returns 1 if connid was made for remote address and port in the
+   current or previous epoch, 0 otherwise */
+int  connid_verify( const uint32_t connid[2], const ot_ip6 remoteip, uint16_t remoteport );
+
+#endif
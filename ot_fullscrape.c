@@ -9,32 +9,62 @@
 #include <sys/param.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <pthread.h>
 #include <arpa/inet.h>
-#ifdef WANT_COMPRESSION_GZIP
 #include <zlib.h>
-#endif
 
 /* Libowfat */
 #include "byte.h"
 #include "io.h"
 #include "textcode.h"
+#include "uint32.h"
+#include "uint64.h"
 
 /* Opentracker */
 #include "trackerlogic.h"
 #include "ot_mutex.h"
 #include "ot_iovec.h"
 #include "ot_fullscrape.h"
+#include "ot_stats.h"
+#include "ot_usdt.h"
 
 /* Fetch full scrape info for all torrents
    Full scrapes usually are huge and one does not want to
    allocate more memory. So lets get them in 512k units
 */
-#define OT_SCRAPE_CHUNK_SIZE (512*1024)
+#define OT_SCRAPE_CHUNK_SIZE OT_IOVEC_POOL_CHUNK_SIZE
 
 /* "d8:completei%zde10:downloadedi%zde10:incompletei%zdee" */
 #define OT_SCRAPE_MAXENTRYLEN 256
 
+/* Upper bound for threads working on one full scrape */
+#define OT_FULLSCRAPE_MAX_THREADS 16
+unsigned int g_fullscrape_threads = 1;
+
+/* Columnar full scrape, made for mirrors that mmap it and binary search.
+   All numbers are big endian.
+
+   header, 16 bytes: "OTfc", uint8 version, uint8 flags (1: blocks carry
+     a crc32), uint8 hash bits resolved by the directory, uint8 bytes
+     stored per hash, uint32 most torrents per block, uint32 0
+   blocks of torrents in hash order, never spanning a directory prefix:
+     the hashes without the leading bytes the directory implies, then
+     unsigned LEB128 varint columns of seeders, leechers and downloaded
+   block table, per block: uint64 offset, uint32 index of its first
+     torrent and, if flagged, the crc32 of the block
+   directory: ( 1 << hash bits ) + 1 uint32, the first block per prefix
+   tail, 24 bytes: uint64 offset of the block table, uint32 blocks,
+     uint32 torrents, uint32 0, "OTfc" */
+#define OT_COLUMNAR_MAGIC          "OTfc"
+#define OT_COLUMNAR_VERSION        1
+#define OT_COLUMNAR_FLAG_CRC32     1
+#define OT_COLUMNAR_BLOCK_TORRENTS 256
+#define OT_COLUMNAR_HASH_SKIP      ( OT_BUCKET_COUNT_BITS / 8 )
+#define OT_COLUMNAR_HASH_BYTES     ( sizeof(ot_hash) - OT_COLUMNAR_HASH_SKIP )
+#define OT_COLUMNAR_VARINT_MAX     10
+unsigned int g_fullscrape_checksums = 0;
+
 #ifdef WANT_COMPRESSION_GZIP
 #define IF_COMPRESSION( TASK ) if( mode & TASK_FLAG_GZIP ) TASK
 #define WANT_COMPRESSION_GZIP_PARAM( param1, param2, param3 ) , param1, param2, param3
@@ -44,44 +74,274 @@
 #endif
 
 /* Forward declaration */
-static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode );
+static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode, const ot_fullscrape_query *query, ot_taskid taskid );
 
 /* Converter function from memory to human readable hex strings
    XXX - Duplicated from ot_stats. Needs fix. */
 static char*to_hex(char*d,uint8_t*s){char*m="0123456789ABCDEF";char *t=d;char*e=d+40;while(d<e){*d++=m[*s>>4];*d++=m[*s++&15];}*d=0;return t;}
 
-/* This is the entry point into this worker thread
-   It grabs tasks from mutex_tasklist and delivers results back
-*/
-static void * fullscrape_worker( void * args ) {
-  int iovec_entries;
+/* Mirrors fetch the same full scrape over and over. Each format and
+   compression keeps its last result as a snapshot that is rebuilt at most
+   every g_fullscrape_cache_interval seconds. Connections sending a
+   snapshot hold a reference, so a rebuild never pulls buffers from under
+   them and the last one out unmaps the old snapshot. */
+#define OT_FULLSCRAPE_CACHE_FORMATS 5
+#define OT_FULLSCRAPE_CACHE_COMPRESSIONS 3
+
+struct ot_fullscrape_snapshot {
+  int           iovec_entries;
   struct iovec *iovector;
+  size_t        refcount;
+  ot_time       made;
+};
+
+typedef struct {
+  ot_fullscrape_snapshot *snapshot;
+  int                     building;
+  unsigned long long      hits;
+  unsigned long long      builds;
+} ot_fullscrape_cache;
+
+unsigned int               g_fullscrape_cache_interval = OT_FULLSCRAPE_CACHE_INTERVAL;
+static ot_fullscrape_cache g_fullscrape_cache[OT_FULLSCRAPE_CACHE_FORMATS][OT_FULLSCRAPE_CACHE_COMPRESSIONS];
+static pthread_mutex_t     g_fullscrape_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t      g_fullscrape_cache_built = PTHREAD_COND_INITIALIZER;
+static const char         *g_fullscrape_cache_names[OT_FULLSCRAPE_CACHE_FORMATS] = { "bencode", "tpb binary", "tpb ascii", "tpb urlencoded", "columnar" };
+static const char         *g_fullscrape_cache_compressions[OT_FULLSCRAPE_CACHE_COMPRESSIONS] = { "", " gzip", " bzip2" };
+
+/* Cache slot per full scrape mode, state dumps and deltas are not cached */
+static const int           g_fullscrape_cache_slots[] = { 0, 1, 2, 3, -1, -1, 4 };
+
+static ot_fullscrape_cache *fullscrape_cache_entry( ot_tasktype mode ) {
+  const int task = ( mode & TASK_TASK_MASK ) - TASK_FULLSCRAPE;
+  const int compression = ( mode & TASK_FLAG_GZIP ) ? 1 : ( mode & TASK_FLAG_BZIP2 ) ? 2 : 0;
+  int format;
+
+  if( !g_fullscrape_cache_interval || task < 0 || task >= (int)( sizeof( g_fullscrape_cache_slots ) / sizeof( int ) ) )
+    return NULL;
+  if( ( format = g_fullscrape_cache_slots[task] ) < 0 )
+    return NULL;
+  return &g_fullscrape_cache[format][compression];
+}
 
-  (void) args;
+/* Call with g_fullscrape_cache_mutex held */
+static void fullscrape_snapshot_unref( ot_fullscrape_snapshot *snapshot ) {
+  if( snapshot && !--snapshot->refcount ) {
+    iovec_free( &snapshot->iovec_entries, &snapshot->iovector );
+    free( snapshot->iovector );
+    free( snapshot );
+  }
+}
 
-  while( 1 ) {
-    ot_tasktype tasktype = TASK_FULLSCRAPE;
-    ot_taskid   taskid   = mutex_workqueue_poptask( &tasktype );
-    fullscrape_make( &iovec_entries, &iovector, tasktype );
-    if( mutex_workqueue_pushresult( taskid, iovec_entries, iovector ) )
-      iovec_free( &iovec_entries, &iovector );
-    if( !g_opentracker_running )
-      return NULL;
+/* Worker side: answers cacheable modes by refreshing the snapshot if it is
+   stale and leaves the vector empty, telling the main thread to pick up
+   the snapshot. Concurrent requests for a snapshot being built wait for it
+   instead of walking the buckets themselves. Everything else, including
+   sharded and filtered pulls, is streamed to the client while it is
+   being made. */
+static void fullscrape_make_cached( int *iovec_entries, struct iovec **iovector, ot_tasktype mode, const void *taskarg, ot_taskid taskid ) {
+  const ot_fullscrape_query *query = taskarg;
+  ot_fullscrape_cache    *entry = fullscrape_cache_entry( mode );
+  ot_fullscrape_snapshot *snapshot;
+  uint64_t                started = stats_latency_start( );
+
+  if( !entry || OT_FULLSCRAPE_QUERY_FILTERED( query ) ) {
+    fullscrape_make( iovec_entries, iovector, mode, query, taskid );
+    stats_issue_latency( LATENCY_FULLSCRAPE, started );
+    return;
   }
-  return NULL;
+
+  *iovec_entries = 0;
+  *iovector = NULL;
+
+  pthread_mutex_lock( &g_fullscrape_cache_mutex );
+  while( entry->building )
+    pthread_cond_wait( &g_fullscrape_cache_built, &g_fullscrape_cache_mutex );
+  if( entry->snapshot && g_now_seconds < entry->snapshot->made + (ot_time)g_fullscrape_cache_interval ) {
+    ++entry->hits;
+    pthread_mutex_unlock( &g_fullscrape_cache_mutex );
+    return;
+  }
+  entry->building = 1;
+  pthread_mutex_unlock( &g_fullscrape_cache_mutex );
+
+  if( ( snapshot = malloc( sizeof( ot_fullscrape_snapshot ) ) ) ) {
+    fullscrape_make( &snapshot->iovec_entries, &snapshot->iovector, mode, query, 0 );
+    stats_issue_latency( LATENCY_FULLSCRAPE, started );
+    snapshot->refcount = 1;
+    snapshot->made     = g_now_seconds;
+    if( !snapshot->iovec_entries ) {
+      free( snapshot );
+      snapshot = NULL;
+    }
+  }
+
+  pthread_mutex_lock( &g_fullscrape_cache_mutex );
+  if( snapshot ) {
+    fullscrape_snapshot_unref( entry->snapshot );
+    entry->snapshot = snapshot;
+  }
+  entry->building = 0;
+  ++entry->builds;
+  pthread_cond_broadcast( &g_fullscrape_cache_built );
+  pthread_mutex_unlock( &g_fullscrape_cache_mutex );
+}
+
+ot_fullscrape_snapshot *fullscrape_snapshot_acquire( ot_tasktype mode, int *iovec_entries, struct iovec **iovector ) {
+  ot_fullscrape_cache    *entry = fullscrape_cache_entry( mode );
+  ot_fullscrape_snapshot *snapshot = NULL;
+
+  if( !entry )
+    return NULL;
+
+  pthread_mutex_lock( &g_fullscrape_cache_mutex );
+  if( ( snapshot = entry->snapshot ) ) {
+    ++snapshot->refcount;
+    *iovec_entries = snapshot->iovec_entries;
+    *iovector      = snapshot->iovector;
+  }
+  pthread_mutex_unlock( &g_fullscrape_cache_mutex );
+  return snapshot;
+}
+
+void fullscrape_snapshot_release( ot_fullscrape_snapshot *snapshot ) {
+  if( !snapshot )
+    return;
+  pthread_mutex_lock( &g_fullscrape_cache_mutex );
+  fullscrape_snapshot_unref( snapshot );
+  pthread_mutex_unlock( &g_fullscrape_cache_mutex );
+}
+
+size_t fullscrape_cache_return_stats( char *reply ) {
+  char *r = reply;
+  int format, compression;
+
+  r += sprintf( r, "fullscrape cache, rebuilt at most every %u seconds\n", g_fullscrape_cache_interval );
+  pthread_mutex_lock( &g_fullscrape_cache_mutex );
+  for( format=0; format<OT_FULLSCRAPE_CACHE_FORMATS; ++format )
+    for( compression=0; compression<OT_FULLSCRAPE_CACHE_COMPRESSIONS; ++compression ) {
+      ot_fullscrape_cache *entry = &g_fullscrape_cache[format][compression];
+      ot_fullscrape_snapshot *snapshot = entry->snapshot;
+      char name[32];
+      if( !entry->builds )
+        continue;
+      sprintf( name, "%s%s:", g_fullscrape_cache_names[format], g_fullscrape_cache_compressions[compression] );
+      r += sprintf( r, "%-22s %llu hits, %llu builds", name, entry->hits, entry->builds );
+      if( snapshot )
+        r += sprintf( r, ", age %lds, %zu bytes, %zu users", (long)( g_now_seconds - snapshot->made ),
+                      iovec_length( &snapshot->iovec_entries, &snapshot->iovector ), snapshot->refcount - 1 );
+      *r++ = '\n';
+    }
+  pthread_mutex_unlock( &g_fullscrape_cache_mutex );
+  return r - reply;
+}
+
+/* Delta full scrapes. Every torrent carries the second of its last count
+   change, so a delta only writes out torrents changed since the token
+   the mirror got with its last answer. Torrents dropped by the cleaner
+   leave a tombstone in their bucket's list, guarded by the bucket lock
+   like the torrents themselves. Tombstones are appended in time order
+   and expire after g_fullscrape_delta_keep seconds, tokens older than
+   that, from before our start or from the future get a complete answer
+   flagged "full", telling the mirror to drop what it has. */
+typedef struct {
+  ot_hash hash;
+  ot_time removed;
+} ot_tombstone;
+
+/* Tombstones outlive the keep time by this many seconds, so a token that
+   just passed the check still finds all of its tombstones */
+#define OT_FULLSCRAPE_DELTA_GRACE 60
+
+unsigned int     g_fullscrape_delta_keep = OT_FULLSCRAPE_DELTA_KEEP;
+static ot_vector g_fullscrape_tombstones[OT_BUCKET_COUNT];
+static ot_time   g_fullscrape_delta_start;
+
+/* Call with the torrent's bucket locked */
+void fullscrape_delta_removed( ot_torrent *torrent ) {
+  ot_vector    *tombstones = g_fullscrape_tombstones + ( uint32_read_big( (char*)torrent->hash ) >> OT_BUCKET_COUNT_SHIFT );
+  ot_tombstone *stones = tombstones->data;
+  size_t        expired = 0;
+
+  while( expired < tombstones->size && stones[expired].removed + (ot_time)( g_fullscrape_delta_keep + OT_FULLSCRAPE_DELTA_GRACE ) < g_now_seconds )
+    ++expired;
+  if( expired ) {
+    memmove( stones, stones + expired, ( tombstones->size - expired ) * sizeof( ot_tombstone ) );
+    tombstones->size -= expired;
+  }
+
+  if( tombstones->size == tombstones->space ) {
+    size_t space = tombstones->space ? 2 * tombstones->space : OT_VECTOR_MIN_MEMBERS;
+    if( !( stones = realloc( tombstones->data, space * sizeof( ot_tombstone ) ) ) )
+      return;
+    tombstones->data  = stones;
+    tombstones->space = space;
+  }
+
+  memcpy( stones[tombstones->size].hash, torrent->hash, sizeof(ot_hash) );
+  stones[tombstones->size++].removed = g_now_seconds;
 }
 
-static pthread_t thread_id;
+/* Collects the hashes in the query's range of torrents removed at or after
+   since and not back again. Only the tail of each bucket's tombstones is
+   looked at. */
+static int fullscrape_delta_deleted( ot_time since, const ot_fullscrape_query *query, ot_hash **deleted, size_t *deleted_count ) {
+  const int bucket_last = query->prefix_last >> OT_BUCKET_COUNT_SHIFT;
+  ot_hash *grown;
+  size_t   space = 0;
+  int      bucket;
+
+  *deleted = NULL;
+  *deleted_count = 0;
+  for( bucket=query->prefix_first >> OT_BUCKET_COUNT_SHIFT; bucket<=bucket_last; ++bucket ) {
+    ot_vector    *torrents_list = mutex_bucket_lock( bucket );
+    ot_vector    *tombstones    = g_fullscrape_tombstones + bucket;
+    ot_tombstone *stones        = tombstones->data;
+    size_t        i             = tombstones->size;
+
+    while( i-- && stones[i].removed >= since ) {
+      const uint32_t prefix = uint32_read_big( (char*)stones[i].hash );
+      int exactmatch;
+      if( prefix < query->prefix_first || prefix > query->prefix_last )
+        continue;
+      binary_search( stones[i].hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+      if( exactmatch )
+        continue;
+      if( *deleted_count == space ) {
+        space = space ? 2 * space : 1024;
+        if( !( grown = realloc( *deleted, space * sizeof( ot_hash ) ) ) ) {
+          mutex_bucket_unlock( bucket, 0 );
+          free( *deleted );
+          *deleted = NULL;
+          *deleted_count = 0;
+          return -1;
+        }
+        *deleted = grown;
+      }
+      memcpy( (*deleted)[(*deleted_count)++], stones[i].hash, sizeof(ot_hash) );
+    }
+    mutex_bucket_unlock( bucket, 0 );
+  }
+  return 0;
+}
+
+/* Full scrapes are made by the fullscrape worker pool, its size is set
+   by tasks.fullscrape.workers */
 void fullscrape_init( ) {
-  pthread_create( &thread_id, NULL, fullscrape_worker, NULL );
+  g_fullscrape_delta_start = g_now_seconds;
+  mutex_workqueue_startworkers( TASK_FULLSCRAPE, fullscrape_make_cached );
 }
 
 void fullscrape_deinit( ) {
-  pthread_cancel( thread_id );
+  int bucket;
+  mutex_workqueue_stopworkers( TASK_FULLSCRAPE );
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket )
+    free( g_fullscrape_tombstones[bucket].data );
+  byte_zero( g_fullscrape_tombstones, sizeof( g_fullscrape_tombstones ) );
 }
 
-void fullscrape_deliver( int64 sock, ot_tasktype tasktype ) {
-  mutex_workqueue_pushtask( sock, tasktype );
+void fullscrape_deliver( int64 sock, ot_tasktype tasktype, const ot_fullscrape_query *query ) {
+  mutex_workqueue_pushtask( sock, tasktype, query, sizeof( ot_fullscrape_query ) );
 }
 
 static int fullscrape_increase( int *iovec_entries, struct iovec **iovector,
@@ -116,19 +376,286 @@ static int fullscrape_increase( int *iovec_entries, struct iovec **iovector,
   return 0;
 }
 
-static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode ) {
+typedef struct {
+  uint64_t offset;
+  uint32_t first;
+  uint32_t crc;
+} ot_fullscrape_block;
+
+/* A columnar block being collected under the bucket lock */
+typedef struct {
+  size_t  count;
+  size_t  column_size[3];
+  uint8_t hashes[OT_COLUMNAR_BLOCK_TORRENTS * OT_COLUMNAR_HASH_BYTES];
+  uint8_t columns[3][OT_COLUMNAR_BLOCK_TORRENTS * OT_COLUMNAR_VARINT_MAX];
+} ot_columnar_block;
+
+/* Shared by the slices of one full scrape. The columnar footer indexes
+   all blocks, so the last slice waits for the others to finish. */
+struct ot_fullscrape_job {
+  pthread_mutex_t             mutex;
+  pthread_cond_t              slice_done;
+  int                         done;
+  int                         slice_count;
+  struct ot_fullscrape_slice *slices;
+  uint32_t                    directory[OT_BUCKET_COUNT + 1];
+};
+
+/* A slice is a range of buckets turned into its own list of buffers, so
+   several threads can work on one full scrape. With gzip every slice is
+   a raw deflate stream ending on a byte boundary, only the last one is
+   finished, so concatenated they form one gzip member, like pigz does. */
+struct ot_fullscrape_slice {
+  ot_tasktype   mode;
+  int           bucket_first, bucket_last;
+  int           iovec_entries;
+  struct iovec *iovector;
+
+  /* Set for the first slice of a streamed answer, its finished buffers go
+     to the client right away */
+  ot_taskid     taskid;
+
+  /* Columnar only: uncompressed bytes and torrents written so far and the
+     blocks they went to, offsets and indexes relative to the slice */
+  struct ot_fullscrape_job *job;
+  uint64_t      written;
+  size_t        torrents;
+  ot_fullscrape_block *blocks;
+  size_t        block_count, block_space;
+
+  /* Only torrents in the query's prefix range passing its filters */
+  const ot_fullscrape_query *query;
+
+  /* Deltas only: the first slice lists the deleted torrents, the last one
+     hands out the token */
+  ot_time       since, token;
+  int           full;
+  ot_hash      *deleted;
+  size_t        deleted_count;
+#ifdef WANT_COMPRESSION_GZIP
+  uint32_t      crc;
+  size_t        length;
+  char         *trailer;
+#endif
+};
+
+#ifdef WANT_COMPRESSION_GZIP
+/* Feeds the uncompressed bytes in compress_buffer to the slice's stream */
+static void fullscrape_deflate( struct ot_fullscrape_slice *slice, z_stream *strm, char *compress_buffer, char *r, int zaction ) {
+  int zres;
+  strm->next_in  = (uint8_t*)compress_buffer;
+  strm->avail_in = r - compress_buffer;
+  slice->crc     = crc32( slice->crc, (uint8_t*)compress_buffer, r - compress_buffer );
+  slice->length += r - compress_buffer;
+  zres = deflate( strm, zaction );
+  if( ( zres < Z_OK ) && ( zres != Z_BUF_ERROR ) )
+    fprintf( stderr, "deflate() failed while in fullscrape_make().\n" );
+}
+#endif
+
+/* Streaming: hands all finished buffers of the slice to the client, this
+   may block until it caught up, so never call it with a bucket locked.
+   Returns -1 with the slice's buffers freed if nobody listens anymore. */
+static int fullscrape_stream( struct ot_fullscrape_slice *slice ) {
+  struct iovec *finished = slice->iovector;
+
+  if( !slice->taskid || slice->iovec_entries < 2 )
+    return 0;
+  if( !( slice->iovector = malloc( sizeof( struct iovec ) ) ) ) {
+    slice->iovector = finished;
+    return 0;
+  }
+
+  *slice->iovector = finished[slice->iovec_entries - 1];
+  if( mutex_workqueue_pushchunk( slice->taskid, slice->iovec_entries - 1, finished ) ) {
+    slice->iovec_entries = 1;
+    iovec_free( &slice->iovec_entries, &slice->iovector );
+    return -1;
+  }
+  slice->iovec_entries = 1;
+  return 0;
+}
+
+/* Gives up on a slice, which is marked failed by its empty vector */
+static int fullscrape_abort( struct ot_fullscrape_slice *slice WANT_COMPRESSION_GZIP_PARAM( z_stream *strm, char *compress_buffer, int zaction ) ) {
+#ifdef WANT_COMPRESSION_GZIP
+  (void)compress_buffer; (void)zaction;
+  if( slice->mode & TASK_FLAG_GZIP )
+    deflateEnd( strm );
+#endif
+  iovec_free( &slice->iovec_entries, &slice->iovector );
+  return -1;
+}
+
+/* Columnar only: appends len bytes. Blocks are collected aside and are
+   larger than the room fullscrape_increase guarantees, so they go out in
+   pieces. */
+static int fullscrape_emit( struct ot_fullscrape_slice *slice, char **r, char **re, const void *data, size_t len
+                            WANT_COMPRESSION_GZIP_PARAM( z_stream *strm, char *compress_buffer, int zaction ) ) {
+  slice->written += len;
+
+#ifdef WANT_COMPRESSION_GZIP
+  if( slice->mode & TASK_FLAG_GZIP ) {
+    fullscrape_deflate( slice, strm, (char*)data, (char*)data + len, zaction );
+    *r = (char*)strm->next_out;
+    while( *r >= *re )
+      if( fullscrape_increase( &slice->iovec_entries, &slice->iovector, r, re, strm, slice->mode, zaction ) )
+        return -1;
+    *r = compress_buffer;
+    return 0;
+  }
+#endif
+
+  while( len ) {
+    const size_t piece = len < OT_SCRAPE_MAXENTRYLEN ? len : OT_SCRAPE_MAXENTRYLEN;
+    memcpy( *r, data, piece );
+    *r += piece;
+    data = (const char*)data + piece;
+    len -= piece;
+    while( *r >= *re )
+      if( fullscrape_increase( &slice->iovec_entries, &slice->iovector, r, re WANT_COMPRESSION_GZIP_PARAM( strm, slice->mode, zaction ) ) )
+        return -1;
+  }
+  return 0;
+}
+
+static size_t fmt_varint( uint8_t *d, uint64_t value ) {
+  size_t length = 1;
+  for( ; value >= 0x80; value >>= 7, ++length )
+    *d++ = 0x80 | ( value & 0x7f );
+  *d = value;
+  return length;
+}
+
+static void fullscrape_columnar_add( ot_columnar_block *block, ot_hash *hash, ot_peerlist *peer_list ) {
+  const uint64_t counts[3] = { peer_list->seed_count, peer_list->peer_count - peer_list->seed_count, peer_list->down_count };
+  int column;
+
+  memcpy( block->hashes + block->count * OT_COLUMNAR_HASH_BYTES, (uint8_t*)*hash + OT_COLUMNAR_HASH_SKIP, OT_COLUMNAR_HASH_BYTES );
+  for( column=0; column<3; ++column )
+    block->column_size[column] += fmt_varint( block->columns[column] + block->column_size[column], counts[column] );
+  ++block->count;
+}
+
+/* Writes out the collected block and notes it for the block table */
+static int fullscrape_columnar_flush( struct ot_fullscrape_slice *slice, ot_columnar_block *block, char **r, char **re
+                                      WANT_COMPRESSION_GZIP_PARAM( z_stream *strm, char *compress_buffer, int zaction ) ) {
+  ot_fullscrape_block *entry;
+  int column;
+
+  if( !block->count )
+    return 0;
+
+  if( slice->block_count == slice->block_space ) {
+    size_t space = slice->block_space ? 2 * slice->block_space : 64;
+    if( !( entry = realloc( slice->blocks, space * sizeof( ot_fullscrape_block ) ) ) )
+      return fullscrape_abort( slice WANT_COMPRESSION_GZIP_PARAM( strm, compress_buffer, zaction ) );
+    slice->blocks      = entry;
+    slice->block_space = space;
+  }
+  entry = slice->blocks + slice->block_count++;
+  entry->offset = slice->written;
+  entry->first  = slice->torrents;
+  entry->crc    = 0;
+
+  if( g_fullscrape_checksums ) {
+    entry->crc = crc32( 0, block->hashes, block->count * OT_COLUMNAR_HASH_BYTES );
+    for( column=0; column<3; ++column )
+      entry->crc = crc32( entry->crc, block->columns[column], block->column_size[column] );
+  }
+
+  if( fullscrape_emit( slice, r, re, block->hashes, block->count * OT_COLUMNAR_HASH_BYTES WANT_COMPRESSION_GZIP_PARAM( strm, compress_buffer, zaction ) ) )
+    return -1;
+  for( column=0; column<3; ++column )
+    if( fullscrape_emit( slice, r, re, block->columns[column], block->column_size[column] WANT_COMPRESSION_GZIP_PARAM( strm, compress_buffer, zaction ) ) )
+      return -1;
+
+  slice->torrents += block->count;
+  block->count = 0;
+  byte_zero( block->column_size, sizeof( block->column_size ) );
+  return 0;
+}
+
+/* Last slice only: waits for the others and writes block table, directory
+   and tail for all of them */
+static int fullscrape_columnar_footer( struct ot_fullscrape_slice *slice, char **r, char **re
+                                       WANT_COMPRESSION_GZIP_PARAM( z_stream *strm, char *compress_buffer, int zaction ) ) {
+  struct ot_fullscrape_job *job = slice->job;
+  const size_t entry_size = g_fullscrape_checksums ? 16 : 12;
+  size_t   block_count = 0, torrents = 0, footer_size, b;
+  uint64_t written = 0;
+  char    *footer, *f;
+  int      i, bucket, failed = 0;
+
+  pthread_mutex_lock( &job->mutex );
+  while( job->done < job->slice_count - 1 )
+    pthread_cond_wait( &job->slice_done, &job->mutex );
+  pthread_mutex_unlock( &job->mutex );
+
+  for( i=0; i<job->slice_count; ++i ) {
+    failed      |= !job->slices[i].iovec_entries;
+    block_count += job->slices[i].block_count;
+  }
+  footer_size = block_count * entry_size + ( OT_BUCKET_COUNT + 1 ) * sizeof( uint32_t ) + 24;
+  if( failed || !( f = footer = malloc( footer_size ) ) )
+    return fullscrape_abort( slice WANT_COMPRESSION_GZIP_PARAM( strm, compress_buffer, zaction ) );
+
+  /* Rebase the slices' offsets, indexes and directory entries */
+  for( i=0, block_count=0; i<job->slice_count; ++i ) {
+    struct ot_fullscrape_slice *s = job->slices + i;
+    for( b=0; b<s->block_count; ++b ) {
+      uint64_pack_big( f, written + s->blocks[b].offset );
+      uint32_pack_big( f + 8, torrents + s->blocks[b].first );
+      if( g_fullscrape_checksums )
+        uint32_pack_big( f + 12, s->blocks[b].crc );
+      f += entry_size;
+    }
+    for( bucket=s->bucket_first; bucket<s->bucket_last; ++bucket )
+      job->directory[bucket] += block_count;
+    written     += s->written;
+    torrents    += s->torrents;
+    block_count += s->block_count;
+  }
+  /* Prefixes outside a sharded pull have no blocks */
+  for( bucket=slice->bucket_last; bucket<=OT_BUCKET_COUNT; ++bucket )
+    job->directory[bucket] = block_count;
+  for( bucket=0; bucket<=OT_BUCKET_COUNT; ++bucket, f += 4 )
+    uint32_pack_big( f, job->directory[bucket] );
+
+  uint64_pack_big( f, written );
+  uint32_pack_big( f + 8, block_count );
+  uint32_pack_big( f + 12, torrents );
+  uint32_pack_big( f + 16, 0 );
+  memcpy( f + 20, OT_COLUMNAR_MAGIC, 4 );
+
+  i = fullscrape_emit( slice, r, re, footer, footer_size WANT_COMPRESSION_GZIP_PARAM( strm, compress_buffer, zaction ) );
+  free( footer );
+  return i;
+}
+
+static void *fullscrape_fill_slice( void *args ) {
+  struct ot_fullscrape_slice *slice = args;
+  int     *iovec_entries = &slice->iovec_entries;
+  struct iovec **iovector = &slice->iovector;
+  const ot_tasktype mode = slice->mode;
+  const ot_fullscrape_query *query = slice->query;
+  const int first = slice == slice->job->slices, last = slice == slice->job->slices + slice->job->slice_count - 1;
   int      bucket;
   char    *r, *re;
+  ot_columnar_block block;
 #ifdef WANT_COMPRESSION_GZIP
   char     compress_buffer[OT_SCRAPE_MAXENTRYLEN];
   z_stream strm;
 #endif
 
+  block.count = 0;
+  byte_zero( block.column_size, sizeof( block.column_size ) );
+
   /* Setup return vector... */
   *iovec_entries = 0;
   *iovector = NULL;
   if( !( r = iovec_increase( iovec_entries, iovector, OT_SCRAPE_CHUNK_SIZE ) ) )
-    return;
+    return NULL;
 
   /* re points to low watermark */
   re = r + OT_SCRAPE_CHUNK_SIZE - OT_SCRAPE_MAXENTRYLEN;
@@ -140,29 +667,95 @@ static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tas
     strm.next_in   = (uint8_t*)compress_buffer;
     strm.next_out  = (uint8_t*)r;
     strm.avail_out = OT_SCRAPE_CHUNK_SIZE;
-    if( deflateInit2(&strm,7,Z_DEFLATED,31,8,Z_DEFAULT_STRATEGY) != Z_OK )
+    /* The gzip header is ours to write, since the slices share it */
+    if( first ) {
+      static const char gzip_header[10] = { 0x1f, (char)0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+      memcpy( r, gzip_header, sizeof( gzip_header ) );
+      strm.next_out  += sizeof( gzip_header );
+      strm.avail_out -= sizeof( gzip_header );
+    }
+    slice->crc    = crc32( 0, NULL, 0 );
+    slice->length = 0;
+    if( deflateInit2(&strm,7,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) != Z_OK )
       fprintf( stderr, "not ok.\n" );
     r = compress_buffer;
   }
 #endif
 
-  if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
+  if( first && ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE_DELTA ) {
+    size_t i;
+    r += sprintf( r, "d7:deletedl" );
+    for( i=0; i<slice->deleted_count; ++i ) {
+      *r++='2'; *r++='0'; *r++=':';
+      memcpy( r, slice->deleted[i], sizeof(ot_hash) ); r += sizeof(ot_hash);
+
+#ifdef WANT_COMPRESSION_GZIP
+      if( mode & TASK_FLAG_GZIP ) {
+        fullscrape_deflate( slice, &strm, compress_buffer, r, Z_NO_FLUSH );
+        r = (char*)strm.next_out;
+      }
+#endif
+
+      while( r >= re )
+        if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, Z_NO_FLUSH ) ) )
+          return NULL;
+
+      IF_COMPRESSION( r = compress_buffer; )
+    }
+    r += sprintf( r, "e5:filesd" );
+  } else if( first && ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
     r += sprintf( r, "d5:filesd" );
+  else if( first && ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE_COLUMNAR ) {
+    char header[16] = OT_COLUMNAR_MAGIC;
+    header[4] = OT_COLUMNAR_VERSION;
+    header[5] = g_fullscrape_checksums ? OT_COLUMNAR_FLAG_CRC32 : 0;
+    header[6] = OT_BUCKET_COUNT_BITS;
+    header[7] = OT_COLUMNAR_HASH_BYTES;
+    uint32_pack_big( header + 8, OT_COLUMNAR_BLOCK_TORRENTS );
+    uint32_pack_big( header + 12, 0 );
+    if( fullscrape_emit( slice, &r, &re, header, sizeof( header ) WANT_COMPRESSION_GZIP_PARAM( &strm, compress_buffer, Z_NO_FLUSH ) ) )
+      return NULL;
+  }
 
   /* For each bucket... */
-  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
+  for( bucket=slice->bucket_first; bucket<slice->bucket_last; ++bucket ) {
     /* Get exclusive access to that bucket */
     ot_vector *torrents_list = mutex_bucket_lock( bucket );
     size_t tor_offset;
 
+    if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE_COLUMNAR )
+      slice->job->directory[bucket] = slice->block_count;
+
     /* For each torrent in this bucket.. */
     for( tor_offset=0; tor_offset<torrents_list->size; ++tor_offset ) {
       /* Address torrents members */
       ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[tor_offset] ).peer_list;
       ot_hash     *hash      =&( ((ot_torrent*)(torrents_list->data))[tor_offset] ).hash;
 
+      /* Only deltas have a since */
+      if( peer_list->modified < slice->since )
+        continue;
+
+      /* Sharded and filtered pulls */
+      if( peer_list->peer_count < query->min_peers || ( query->seeded_only && !peer_list->seed_count ) )
+        continue;
+      if( uint32_read_big( (char*)*hash ) < query->prefix_first || uint32_read_big( (char*)*hash ) > query->prefix_last )
+        continue;
+
+      /* Columnar blocks are collected and written out when full */
+      if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE_COLUMNAR ) {
+        fullscrape_columnar_add( &block, hash, peer_list );
+        if( block.count == OT_COLUMNAR_BLOCK_TORRENTS &&
+            fullscrape_columnar_flush( slice, &block, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, compress_buffer, Z_NO_FLUSH ) ) ) {
+          mutex_bucket_unlock( bucket, 0 );
+          return NULL;
+        }
+        continue;
+      }
+
       switch( mode & TASK_TASK_MASK ) {
       case TASK_FULLSCRAPE:
+      case TASK_FULLSCRAPE_DELTA:
       default:
         /* push hash as bencoded string */
         *r++='2'; *r++='0'; *r++=':';
@@ -193,53 +786,203 @@ static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tas
 
 #ifdef WANT_COMPRESSION_GZIP
      if( mode & TASK_FLAG_GZIP ) {
-        int zres;
-        strm.next_in  = (uint8_t*)compress_buffer;
-        strm.avail_in = r - compress_buffer;
-        zres = deflate( &strm, Z_NO_FLUSH );
-        if( ( zres < Z_OK ) && ( zres != Z_BUF_ERROR ) )
-          fprintf( stderr, "deflate() failed while in fullscrape_make().\n" );
+        fullscrape_deflate( slice, &strm, compress_buffer, r, Z_NO_FLUSH );
         r = (char*)strm.next_out;
       }
 #endif
 
       /* Check if there still is enough buffer left */
       while( r >= re )
-       if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, Z_NO_FLUSH ) ) )
-         return mutex_bucket_unlock( bucket, 0 );
+       if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, Z_NO_FLUSH ) ) ) {
+         mutex_bucket_unlock( bucket, 0 );
+         return NULL;
+       }
 
       IF_COMPRESSION( r = compress_buffer; )
     }
 
+    /* Blocks do not span buckets, so the directory can point at them */
+    if( fullscrape_columnar_flush( slice, &block, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, compress_buffer, Z_NO_FLUSH ) ) ) {
+      mutex_bucket_unlock( bucket, 0 );
+      return NULL;
+    }
+
     /* All torrents done: release lock on current bucket */
     mutex_bucket_unlock( bucket, 0 );
 
     /* Parent thread died? */
     if( !g_opentracker_running )
-      return;
+      return NULL;
+
+    if( fullscrape_stream( slice ) ) {
+      IF_COMPRESSION( deflateEnd(&strm); )
+      return NULL;
+    }
   }
 
-  if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
+  if( last && ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
     r += sprintf( r, "ee" );
+  if( last && ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE_DELTA )
+    r += sprintf( r, "e4:fulli%de5:tokeni%llde" "e", slice->full, (long long)slice->token );
+  if( last && ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE_COLUMNAR )
+    if( fullscrape_columnar_footer( slice, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, compress_buffer, Z_NO_FLUSH ) ) )
+      return NULL;
 
 #ifdef WANT_COMPRESSION_GZIP
   if( mode & TASK_FLAG_GZIP ) {
-    strm.next_in  = (uint8_t*)compress_buffer;
-    strm.avail_in = r - compress_buffer;
-    if( deflate( &strm, Z_FINISH ) < Z_OK )
-      fprintf( stderr, "deflate() failed while in fullscrape_make()'s endgame.\n" );
+    /* Only the last slice ends the stream, the others just flush to a
+       byte boundary so the next slice's blocks can follow */
+    const int zaction = last ? Z_FINISH : Z_SYNC_FLUSH;
+    struct iovec *current;
+
+    fullscrape_deflate( slice, &strm, compress_buffer, r, zaction );
     r = (char*)strm.next_out;
 
     while( r >= re )
-      if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, Z_FINISH ) ) )
-        return mutex_bucket_unlock( bucket, 0 );
+      if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, zaction ) ) )
+        return NULL;
     deflateEnd(&strm);
+
+    /* Leave room for the trailer, crc and length are known after all
+       slices are done */
+    current = *iovector + *iovec_entries - 1;
+    if( last && (char*)current->iov_base + current->iov_len - r < 8 )
+      if( !( r = iovec_fix_increase_or_free( iovec_entries, iovector, r, 8 ) ) )
+        return NULL;
+    if( last ) {
+      slice->trailer = r;
+      r += 8;
+    }
   }
 #endif
 
   /* Release unused memory in current output buffer */
   iovec_fixlast( iovec_entries, iovector, r );
+  return NULL;
+}
+
+static void *fullscrape_make_slice( void *args ) {
+  struct ot_fullscrape_slice *slice = args;
+
+  mutex_bucket_set_class( LOCK_CLASS_FULLSCRAPE );
+  fullscrape_fill_slice( slice );
+
+  pthread_mutex_lock( &slice->job->mutex );
+  ++slice->job->done;
+  pthread_cond_broadcast( &slice->job->slice_done );
+  pthread_mutex_unlock( &slice->job->mutex );
+  return NULL;
+}
+
+static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode, const ot_fullscrape_query *query, ot_taskid taskid ) {
+  struct ot_fullscrape_slice slices[OT_FULLSCRAPE_MAX_THREADS];
+  struct ot_fullscrape_job   job;
+  pthread_t threads[OT_FULLSCRAPE_MAX_THREADS];
+  const int bucket_first = query->prefix_first >> OT_BUCKET_COUNT_SHIFT;
+  const int buckets      = ( query->prefix_last >> OT_BUCKET_COUNT_SHIFT ) + 1 - bucket_first;
+  int       slice_count = g_fullscrape_threads, started, i, failed = 0, full = 0;
+  ot_time   since = query->since, token = g_now_seconds;
+  ot_hash  *deleted = NULL;
+  size_t    deleted_count = 0;
+
+  if( slice_count < 1 ) slice_count = 1;
+  if( slice_count > OT_FULLSCRAPE_MAX_THREADS ) slice_count = OT_FULLSCRAPE_MAX_THREADS;
+  if( slice_count > buckets ) slice_count = buckets;
+
+  /* Changes from now on carry at least the token's second. A token we can
+     not answer for is served everything. */
+  if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE_DELTA ) {
+    if( since < g_fullscrape_delta_start || since > token || since + (ot_time)g_fullscrape_delta_keep < token ||
+        fullscrape_delta_deleted( since, query, &deleted, &deleted_count ) ) {
+      since = 0;
+      full  = 1;
+    }
+  } else
+    since = 0;
+
+  OT_USDT2( fullscrape_start, mode, slice_count );
+  pthread_mutex_init( &job.mutex, NULL );
+  pthread_cond_init( &job.slice_done, NULL );
+  job.done        = 0;
+  job.slice_count = slice_count;
+  job.slices      = slices;
+  byte_zero( job.directory, sizeof( job.directory ) );
+
+  /* Only the buckets holding the query's prefix range are walked */
+  for( i=0; i<slice_count; ++i ) {
+    slices[i].mode          = mode;
+    slices[i].query         = query;
+    slices[i].bucket_first  = bucket_first + ( i * buckets ) / slice_count;
+    slices[i].bucket_last   = bucket_first + ( ( i + 1 ) * buckets ) / slice_count;
+    slices[i].since         = since;
+    slices[i].token         = token;
+    slices[i].full          = full;
+    slices[i].deleted       = deleted;
+    slices[i].deleted_count = deleted_count;
+    slices[i].taskid        = 0;
+    slices[i].job           = &job;
+    slices[i].written       = 0;
+    slices[i].torrents      = 0;
+    slices[i].blocks        = NULL;
+    slices[i].block_count   = slices[i].block_space = 0;
+  }
+
+  /* Only the first slice's buffers are next in line for the client, the
+     others are glued on when all are done */
+  slices[0].taskid = taskid;
+
+  /* We do the first slice ourselves, helpers that fail to start as well */
+  for( started=1; started<slice_count; ++started )
+    if( pthread_create( threads + started, NULL, fullscrape_make_slice, slices + started ) )
+      break;
+  fullscrape_make_slice( slices );
+  for( i=started; i<slice_count; ++i )
+    fullscrape_make_slice( slices + i );
+  for( i=1; i<started; ++i )
+    pthread_join( threads[i], NULL );
+  OT_USDT2( fullscrape_done, mode, slice_count );
+  free( deleted );
+  for( i=0; i<slice_count; ++i )
+    free( slices[i].blocks );
+  pthread_cond_destroy( &job.slice_done );
+  pthread_mutex_destroy( &job.mutex );
+
+  /* Glue the slices' buffers together in bucket order */
+  *iovec_entries = 0;
+  for( i=0; i<slice_count; ++i ) {
+    failed |= !slices[i].iovec_entries;
+    *iovec_entries += slices[i].iovec_entries;
+  }
+  if( failed || !( *iovector = malloc( *iovec_entries * sizeof( struct iovec ) ) ) ) {
+    for( i=0; i<slice_count; ++i ) {
+      iovec_free( &slices[i].iovec_entries, &slices[i].iovector );
+      free( slices[i].iovector );
+    }
+    *iovec_entries = 0;
+    *iovector = NULL;
+    return;
+  }
+  *iovec_entries = 0;
+  for( i=0; i<slice_count; ++i ) {
+    memcpy( *iovector + *iovec_entries, slices[i].iovector, slices[i].iovec_entries * sizeof( struct iovec ) );
+    *iovec_entries += slices[i].iovec_entries;
+    free( slices[i].iovector );
+  }
+
+#ifdef WANT_COMPRESSION_GZIP
+  if( mode & TASK_FLAG_GZIP ) {
+    uint32_t crc    = slices[0].crc;
+    size_t   length = slices[0].length;
+    char    *t      = slices[slice_count-1].trailer;
+    for( i=1; i<slice_count; ++i ) {
+      crc     = crc32_combine( crc, slices[i].crc, slices[i].length );
+      length += slices[i].length;
+    }
+    uint32_pack( t, crc );
+    uint32_pack( t + 4, (uint32_t)length );
+  }
+#endif
 }
 #endif
 
-const char *g_version_fullscrape_c = "$Source: /home/cvsroot/opentracker/ot_fullscrape.c,v $: $Revision: 1.36 $\n";
+const char *g_version_fullscrape_c = "$Source: /home/cvsroot/opentracker/ot_fullscrape.c,v $: $Revision: 1.46 $\n";
@@ -8,14 +8,41 @@
 
 #ifdef WANT_FULLSCRAPE
 
+typedef struct ot_fullscrape_snapshot ot_fullscrape_snapshot;
+
+/* What a full scrape covers: for deltas the torrents changed since the
+   token, a range of hash prefixes, given as the first four bytes read big
+   endian, both inclusive, and the torrents passing the filters */
+typedef struct {
+  ot_time  since;
+  uint32_t prefix_first, prefix_last;
+  uint32_t min_peers;
+  uint32_t seeded_only;
+} ot_fullscrape_query;
+
+#define OT_FULLSCRAPE_QUERY_ALL { 0, 0, 0xffffffff, 0, 0 }
+#define OT_FULLSCRAPE_QUERY_FILTERED(query) ( (query)->prefix_first || (query)->prefix_last != 0xffffffff || (query)->min_peers || (query)->seeded_only )
+
+extern unsigned int g_fullscrape_cache_interval;
+extern unsigned int g_fullscrape_threads;
+extern unsigned int g_fullscrape_delta_keep;
+extern unsigned int g_fullscrape_checksums;
+
 void fullscrape_init( );
 void fullscrape_deinit( );
-void fullscrape_deliver( int64 sock, ot_tasktype tasktype );
+void fullscrape_deliver( int64 sock, ot_tasktype tasktype, const ot_fullscrape_query *query );
+void fullscrape_delta_removed( ot_torrent *torrent );
+
+ot_fullscrape_snapshot *fullscrape_snapshot_acquire( ot_tasktype mode, int *iovec_entries, struct iovec **iovector );
+void   fullscrape_snapshot_release( ot_fullscrape_snapshot *snapshot );
+size_t fullscrape_cache_return_stats( char *reply );
 
 #else
 
 #define fullscrape_init()
 #define fullscrape_deinit()
+#define fullscrape_snapshot_release( snapshot )
+#define fullscrape_delta_removed( torrent )
 
 #endif
 
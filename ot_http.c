@@ -39,6 +39,7 @@ ssize_t g_stats_path_len;
 enum {
   SUCCESS_HTTP_HEADER_LENGTH = 80,
   SUCCESS_HTTP_HEADER_LENGTH_CONTENT_ENCODING = 32,
+  SUCCESS_HTTP_HEADER_LENGTH_CONTENT_TYPE = 64,
   SUCCESS_HTTP_SIZE_OFF = 17 };
 
 static void http_senddata( const int64 sock, struct ot_workstruct *ws ) {
@@ -58,7 +59,9 @@ static void http_senddata( const int64 sock, struct ot_workstruct *ws ) {
   } else
     array_reset( &cookie->request );
 
+  stats_issue_event( EVENT_SENT, FLAG_TCP, ws->reply_size );
   written_size = write( sock, ws->reply, ws->reply_size );
+  stats_trace_end( ws );
   if( ( written_size < 0 ) || ( ( written_size == ws->reply_size ) && !ws->keep_alive ) ) {
     array_reset( &cookie->request );
     free( cookie ); io_close( sock ); return;
@@ -114,11 +117,37 @@ ssize_t http_issue_error( const int64 sock, struct ot_workstruct *ws, int code )
   return ws->reply_size = -2;
 }
 
-ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector ) {
+/* The batch only points into the worker's buffers, the cookie keeps them
+   until they are sent or the connection is gone. Takes ownership. */
+static int http_hold_iovec( struct http_data *cookie, int iovec_entries, struct iovec *iovector ) {
+  struct iovec *held = realloc( cookie->iovector, ( cookie->iovec_entries + iovec_entries ) * sizeof(struct iovec) );
+  int i;
+
+  if( !held ) {
+    iovec_free( &iovec_entries, &iovector );
+    free( iovector );
+    return -1;
+  }
+  for( i=0; i<iovec_entries; ++i ) {
+    iob_addbuf( &cookie->batch, iovector[i].iov_base, iovector[i].iov_len );
+    held[ cookie->iovec_entries++ ] = iovector[i];
+  }
+  cookie->iovector = held;
+  free( iovector );
+  return 0;
+}
+
+void http_release_iovec( struct http_data *cookie ) {
+  iovec_free( &cookie->iovec_entries, &cookie->iovector );
+  free( cookie->iovector );
+  cookie->iovector = NULL;
+}
+
+ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector, int is_partial ) {
   struct http_data *cookie = io_getcookie( sock );
   char *header;
   int i;
-  size_t header_size, size = iovec_length( &iovec_entries, &iovector );
+  size_t header_size, size;
   tai6464 t;
 
   /* No cookie? Bad socket. Leave. */
@@ -130,40 +159,87 @@ ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iove
   /* If this socket collected request in a buffer, free it now */
   array_reset( &cookie->request );
 
-  /* If we came here, wait for the answer is over */
-  cookie->flag &= ~STRUCT_HTTP_FLAG_WAITINGFORTASK;
+  /* Answers from the workers arrive long after their request was read */
+  stats_issue_requester( cookie->ip );
+
+  /* Unless more parts follow, wait for the answer is over */
+  if( !is_partial )
+    cookie->flag &= ~STRUCT_HTTP_FLAG_WAITINGFORTASK;
+
+  /* Later parts of a streamed answer queue up behind what we already
+     have. A stream ending without a part lost its worker, all we can do
+     then is tell the caller to close the connection. */
+  if( cookie->flag & STRUCT_HTTP_FLAG_STREAMING ) {
+    if( !iovec_entries && !is_partial )
+      return -1;
+    stats_issue_event( EVENT_SENT, FLAG_TCP, iovec_length( &iovec_entries, &iovector ) );
+    if( http_hold_iovec( cookie, iovec_entries, iovector ) )
+      return -1;
+    taia_now( &t ); taia_addsec( &t, &t, OT_CLIENT_TIMEOUT_SEND );
+    io_timeout( sock, t );
+    if( iovec_entries )
+      io_wantwrite( sock );
+    return 0;
+  }
+
+  /* An empty full scrape answer waits for us in the snapshot cache. We
+     keep a reference until the connection is gone. */
+  fullscrape_snapshot_release( cookie->snapshot );
+  cookie->snapshot = NULL;
+#ifdef WANT_FULLSCRAPE
+  if( !iovec_entries && cookie->fullscrape_mode )
+    cookie->snapshot = fullscrape_snapshot_acquire( cookie->fullscrape_mode, &iovec_entries, &iovector );
+  cookie->fullscrape_mode = 0;
+#endif
 
   /* Our answers never are 0 vectors. Return an error. */
   if( !iovec_entries ) {
     HTTPERROR_500;
   }
+  size = iovec_length( &iovec_entries, &iovector );
+
+  /* The first part of a streamed answer. We can not know its length and
+     HTTP/1.0 has no chunked encoding, so the body ends when we close. */
+  if( is_partial )
+    cookie->flag |= STRUCT_HTTP_FLAG_STREAMING;
 
   /* Prepare space for http header */
-  header = malloc( SUCCESS_HTTP_HEADER_LENGTH + SUCCESS_HTTP_HEADER_LENGTH_CONTENT_ENCODING );
+  header = malloc( SUCCESS_HTTP_HEADER_LENGTH + SUCCESS_HTTP_HEADER_LENGTH_CONTENT_ENCODING + SUCCESS_HTTP_HEADER_LENGTH_CONTENT_TYPE );
   if( !header ) {
-    iovec_free( &iovec_entries, &iovector );
+    if( !cookie->snapshot )
+      iovec_free( &iovec_entries, &iovector );
     HTTPERROR_500;
   }
 
-  if( cookie->flag & STRUCT_HTTP_FLAG_GZIP )
+  if( is_partial )
+    header_size = sprintf( header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n%s\r\n",
+      cookie->flag & STRUCT_HTTP_FLAG_GZIP ? "Content-Encoding: gzip\r\n" : cookie->flag & STRUCT_HTTP_FLAG_BZIP2 ? "Content-Encoding: bzip2\r\n" : "" );
+  else if( cookie->flag & STRUCT_HTTP_FLAG_GZIP )
     header_size = sprintf( header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Encoding: gzip\r\nContent-Length: %zd\r\n\r\n", size );
   else if( cookie->flag & STRUCT_HTTP_FLAG_BZIP2 )
     header_size = sprintf( header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Encoding: bzip2\r\nContent-Length: %zd\r\n\r\n", size );
+  else if( cookie->flag & STRUCT_HTTP_FLAG_OPENMETRICS )
+    header_size = sprintf( header, "HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\nContent-Length: %zd\r\n\r\n", size );
   else
     header_size = sprintf( header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zd\r\n\r\n", size );
 
   iob_reset( &cookie->batch );
   iob_addbuf_free( &cookie->batch, header, header_size );
+  stats_issue_event( EVENT_SENT, FLAG_TCP, header_size + size );
 
-  /* Will move to ot_iovec.c */
-  for( i=0; i<iovec_entries; ++i )
-    iob_addbuf_munmap( &cookie->batch, iovector[i].iov_base, iovector[i].iov_len );
-  free( iovector );
+  if( cookie->snapshot ) {
+    for( i=0; i<iovec_entries; ++i )
+      iob_addbuf( &cookie->batch, iovector[i].iov_base, iovector[i].iov_len );
+  } else if( http_hold_iovec( cookie, iovec_entries, iovector ) ) {
+    iob_reset( &cookie->batch );
+    HTTPERROR_500;
+  }
 
   /* writeable sockets timeout after 10 minutes */
   taia_now( &t ); taia_addsec( &t, &t, OT_CLIENT_TIMEOUT_SEND );
   io_timeout( sock, t );
-  io_dontwantread( sock );
+  /* No io_dontwantread here, the socket stopped reading when its task was
+     queued. Saying it twice makes libowfat lose count of watched fds. */
   io_wantwrite( sock );
   return 0;
 }
@@ -177,14 +253,18 @@ static const ot_keywords keywords_mode[] =
     { "s24s", TASK_STATS_SLASH24S }, { "tpbs", TASK_STATS_TPB }, { "herr", TASK_STATS_HTTPERRORS }, { "completed", TASK_STATS_COMPLETED },
     { "top100", TASK_STATS_TOP100 }, { "top10", TASK_STATS_TOP10 }, { "renew", TASK_STATS_RENEW }, { "syncs", TASK_STATS_SYNCS }, { "version", TASK_STATS_VERSION },
     { "everything", TASK_STATS_EVERYTHING }, { "statedump", TASK_FULLSCRAPE_TRACKERSTATE }, { "fulllog", TASK_STATS_FULLLOG },
-    { "woodpeckers", TASK_STATS_WOODPECKERS},
+    { "woodpeckers", TASK_STATS_WOODPECKERS}, { "udpworkers", TASK_STATS_UDP_WORKERS }, { "tasks", TASK_STATS_TASKS }, { "locks", TASK_STATS_LOCKS }, { "shape", TASK_STATS_SHAPE }, { "clean", TASK_STATS_CLEAN },
+    { "iovecs", TASK_STATS_IOVEC_POOL }, { "latency", TASK_STATS_LATENCY }, { "metrics", TASK_STATS_METRICS }, { "costs", TASK_STATS_COSTS }, { "traces", TASK_STATS_TRACES },
+#ifdef WANT_FULLSCRAPE
+    { "fscache", TASK_STATS_FULLSCRAPE_CACHE },
+#endif
 #ifdef WANT_LOG_NUMWANT
     { "numwants", TASK_STATS_NUMWANTS},
 #endif
     { NULL, -3 } };
 static const ot_keywords keywords_format[] =
   { { "bin", TASK_FULLSCRAPE_TPB_BINARY }, { "ben", TASK_FULLSCRAPE }, { "url", TASK_FULLSCRAPE_TPB_URLENCODED },
-    { "txt", TASK_FULLSCRAPE_TPB_ASCII }, { NULL, -3 } };
+    { "txt", TASK_FULLSCRAPE_TPB_ASCII }, { "col", TASK_FULLSCRAPE_COLUMNAR }, { NULL, -3 } };
 
   int mode = TASK_STATS_PEERS, scanon = 1, format = 0;
 
@@ -216,6 +296,7 @@ static const ot_keywords keywords_format[] =
 
   if( mode == TASK_STATS_TPB ) {
     struct http_data* cookie = io_getcookie( sock );
+    const ot_fullscrape_query query = OT_FULLSCRAPE_QUERY_ALL;
     tai6464 t;
 #ifdef WANT_COMPRESSION_GZIP
     ws->request[ws->request_size] = 0;
@@ -233,7 +314,8 @@ static const ot_keywords keywords_format[] =
 
     /* Clients waiting for us should not easily timeout */
     taia_uint( &t, 0 ); io_timeout( sock, t );
-    fullscrape_deliver( sock, format );
+    cookie->fullscrape_mode = format;
+    fullscrape_deliver( sock, format, &query );
     io_dontwantread( sock );
     return ws->reply_size = -2;
   }
@@ -241,10 +323,16 @@ static const ot_keywords keywords_format[] =
 
   /* default format for now */
   if( ( mode & TASK_CLASS_MASK ) == TASK_STATS ) {
+    struct http_data* cookie = io_getcookie( sock );
     tai6464 t;
-    /* Complex stats also include expensive memory debugging tools */
+    /* Complex stats also include expensive memory debugging tools.
+       Mark the socket, so the task is cancelled if it goes away. */
+    cookie->flag |= STRUCT_HTTP_FLAG_WAITINGFORTASK;
+    if( mode == TASK_STATS_METRICS )
+      cookie->flag |= STRUCT_HTTP_FLAG_OPENMETRICS;
     taia_uint( &t, 0 ); io_timeout( sock, t );
     stats_deliver( sock, mode );
+    io_dontwantread( sock );
     return ws->reply_size = -2;
   }
 
@@ -259,7 +347,7 @@ typedef struct { ot_ip6 ip; ot_time last_fullscrape; } ot_scrape_log;
 #endif
 
 #ifdef WANT_FULLSCRAPE
-static ssize_t http_handle_fullscrape( const int64 sock, struct ot_workstruct *ws ) {
+static ssize_t http_handle_fullscrape( const int64 sock, struct ot_workstruct *ws, ot_tasktype mode, const ot_fullscrape_query *query ) {
   struct http_data* cookie = io_getcookie( sock );
   int format = 0;
   tai6464 t;
@@ -303,7 +391,9 @@ static ssize_t http_handle_fullscrape( const int64 sock, struct ot_workstruct *w
   cookie->flag |= STRUCT_HTTP_FLAG_WAITINGFORTASK;
   /* Clients waiting for us should not easily timeout */
   taia_uint( &t, 0 ); io_timeout( sock, t );
-  fullscrape_deliver( sock, TASK_FULLSCRAPE | format );
+  /* Sharded and filtered answers never come from the snapshot cache */
+  cookie->fullscrape_mode = OT_FULLSCRAPE_QUERY_FILTERED( query ) ? 0 : mode | format;
+  fullscrape_deliver( sock, mode | format, query );
   io_dontwantread( sock );
   return ws->reply_size = -2;
 }
@@ -353,11 +443,31 @@ static ssize_t http_handle_human( const int64 sock, struct ot_workstruct *ws, ch
 }
 #endif
 
+#ifdef WANT_FULLSCRAPE
+/* Reads a hex info_hash prefix of up to eight digits, the digits left out
+   are taken from pad */
+static int http_scan_prefix( const char *data, ssize_t len, uint32_t pad, uint32_t *prefix ) {
+  unsigned long value;
+  if( ( len <= 0 ) || ( len > 8 ) || scan_xlong( data, &value ) != (size_t)len )
+    return -1;
+  *prefix = len == 8 ? value : ( value << ( 4 * ( 8 - len ) ) ) | ( pad >> ( 4 * len ) );
+  return 0;
+}
+#endif
+
 static ssize_t http_handle_scrape( const int64 sock, struct ot_workstruct *ws, char *read_ptr ) {
-  static const ot_keywords keywords_scrape[] = { { "info_hash", 1 }, { NULL, -3 } };
+  static const ot_keywords keywords_scrape[] = { { "info_hash", 1 }, { "since", 2 }, { "from", 3 }, { "to", 4 },
+    { "minpeers", 5 }, { "seeded", 6 }, { NULL, -3 } };
 
   ot_hash * multiscrape_buf = (ot_hash*)ws->request;
-  int scanon = 1, numwant = 0;
+  int scanon = 1, numwant = 0, delta = 0;
+  unsigned long since = 0;
+#ifdef WANT_FULLSCRAPE
+  ot_fullscrape_query query = OT_FULLSCRAPE_QUERY_ALL;
+  int sharded = 0, filtered = 0, tmp;
+#endif
+  char *write_ptr;
+  ssize_t len;
 
   /* This is to hack around stupid clients that send "scrape ?info_hash" */
   if( read_ptr[-1] != '?' ) {
@@ -376,9 +486,51 @@ static ssize_t http_handle_scrape( const int64 sock, struct ot_workstruct *ws, c
       if( scan_urlencoded_query( &read_ptr, (char*)(multiscrape_buf + numwant++), SCAN_SEARCHPATH_VALUE ) != (ssize_t)sizeof(ot_hash) )
         HTTPERROR_400_PARAM;
       break;
+    case  2: /* matched "since" */
+      len = scan_urlencoded_query( &read_ptr, write_ptr = read_ptr, SCAN_SEARCHPATH_VALUE );
+      if( ( len <= 0 ) || scan_ulong( write_ptr, &since ) != (size_t)len ) HTTPERROR_400_PARAM;
+      delta = 1;
+      break;
+#ifdef WANT_FULLSCRAPE
+    case  3: /* matched "from" */
+      len = scan_urlencoded_query( &read_ptr, write_ptr = read_ptr, SCAN_SEARCHPATH_VALUE );
+      if( http_scan_prefix( write_ptr, len, 0, &query.prefix_first ) ) HTTPERROR_400_PARAM;
+      sharded = 1;
+      break;
+    case  4: /* matched "to" */
+      len = scan_urlencoded_query( &read_ptr, write_ptr = read_ptr, SCAN_SEARCHPATH_VALUE );
+      if( http_scan_prefix( write_ptr, len, 0xffffffff, &query.prefix_last ) ) HTTPERROR_400_PARAM;
+      sharded = 1;
+      break;
+    case  5: /* matched "minpeers" */
+      len = scan_urlencoded_query( &read_ptr, write_ptr = read_ptr, SCAN_SEARCHPATH_VALUE );
+      if( ( len <= 0 ) || scan_fixed_int( write_ptr, len, &tmp ) || ( tmp < 0 ) ) HTTPERROR_400_PARAM;
+      query.min_peers = tmp;
+      sharded = filtered = 1;
+      break;
+    case  6: /* matched "seeded" */
+      len = scan_urlencoded_query( &read_ptr, write_ptr = read_ptr, SCAN_SEARCHPATH_VALUE );
+      if( ( len <= 0 ) || scan_fixed_int( write_ptr, len, &tmp ) ) HTTPERROR_400_PARAM;
+      query.seeded_only = tmp != 0;
+      sharded = filtered = 1;
+      break;
+#endif
     }
   }
 
+#ifdef WANT_FULLSCRAPE
+  /* A token instead of hashes asks for the torrents changed since, a
+     prefix range or filter for a part of the full scrape */
+  if( !numwant && ( delta || sharded ) ) {
+    if( query.prefix_first > query.prefix_last ) HTTPERROR_400_PARAM;
+    /* A delta can not tell about torrents that just stopped matching a
+       filter, so mirrors would keep them forever */
+    if( delta && filtered ) HTTPERROR_400_PARAM;
+    query.since = (ot_time)since;
+    return http_handle_fullscrape( sock, ws, delta ? TASK_FULLSCRAPE_DELTA : TASK_FULLSCRAPE, &query );
+  }
+#endif
+
   /* No info_hash found? Inform user */
   if( !numwant ) HTTPERROR_400_PARAM;
 
@@ -389,6 +541,7 @@ static ssize_t http_handle_scrape( const int64 sock, struct ot_workstruct *ws, c
   /* Enough for http header + whole scrape string */
   ws->reply_size = return_tcp_scrape_for_torrent( multiscrape_buf, numwant, ws->reply );
   stats_issue_event( EVENT_SCRAPE, FLAG_TCP, ws->reply_size );
+  stats_issue_latency( LATENCY_TCP_SCRAPE, ws->request_start );
   return ws->reply_size;
 }
 
@@ -439,9 +592,10 @@ static ssize_t http_handle_announce( const int64 sock, struct ot_workstruct *ws,
   if( accesslist_isblessed( cookie->ip, OT_PERMISSION_MAY_PROXY ) ) {
     ot_ip6 proxied_ip;
     char *fwd = http_header( ws->request, ws->header_size, "x-forwarded-for" );
-    if( fwd && scan_ip6( fwd, proxied_ip ) )
+    if( fwd && scan_ip6( fwd, proxied_ip ) ) {
       OT_SETIP( &ws->peer, proxied_ip );
-    else
+      stats_issue_requester( proxied_ip );
+    } else
       OT_SETIP( &ws->peer, cookie->ip );
   } else
 #endif
@@ -562,12 +716,14 @@ static ssize_t http_handle_announce( const int64 sock, struct ot_workstruct *ws,
   if( !ws->hash )
     return ws->reply_size = sprintf( ws->reply, "d14:failure reason80:Your client forgot to send your torrent's info_hash. Please upgrade your client.e" );
 
+  stats_trace_begin( ws, FLAG_TCP );
   if( OT_PEERFLAG( &ws->peer ) & PEER_FLAG_STOPPED )
     ws->reply_size = remove_peer_from_torrent( FLAG_TCP, ws );
   else
     ws->reply_size = add_peer_to_torrent_and_return_peers( FLAG_TCP, ws, numwant );
 
-  stats_issue_event( EVENT_ANNOUNCE, FLAG_TCP, ws->reply_size);
+  stats_issue_event( EVENT_ANNOUNCE, FLAG_TCP, (uintptr_t)&ws->peer );
+  stats_issue_latency( LATENCY_TCP_ANNOUNCE, ws->request_start );
   return ws->reply_size;
 }
 
@@ -575,8 +731,13 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
   ssize_t reply_off, len;
   char   *read_ptr = ws->request, *write_ptr;
 
-#ifdef WANT_FULLLOG_NETWORKS
   struct http_data *cookie = io_getcookie( sock );
+
+  ws->request_start = stats_latency_start( );
+  if( cookie )
+    stats_issue_requester( cookie->ip );
+
+#ifdef WANT_FULLLOG_NETWORKS
   if( loglist_check_address( cookie->ip ) ) {
     ot_log *log = malloc( sizeof( ot_log ) );
     if( log ) {
@@ -630,8 +791,10 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
   if( ( *write_ptr == 'a' ) || ( *write_ptr == '?' ) )
     http_handle_announce( sock, ws, read_ptr );
 #ifdef WANT_FULLSCRAPE
-  else if( !memcmp( write_ptr, "scrape HTTP/", 12 ) )
-    http_handle_fullscrape( sock, ws );
+  else if( !memcmp( write_ptr, "scrape HTTP/", 12 ) ) {
+    const ot_fullscrape_query query = OT_FULLSCRAPE_QUERY_ALL;
+    http_handle_fullscrape( sock, ws, TASK_FULLSCRAPE, &query );
+  }
 #endif
   /* This is the hardcore match for scrape */
   else if( !memcmp( write_ptr, "sc", 2 ) )
@@ -679,4 +842,4 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
   return ws->reply_size;
 }
 
-const char *g_version_http_c = "$Source: /home/cvsroot/opentracker/ot_http.c,v $: $Revision: 1.53 $\n";
+const char *g_version_http_c = "$Source: /home/cvsroot/opentracker/ot_http.c,v $: $Revision: 1.67 $\n";
@@ -9,7 +9,9 @@
 typedef enum {
   STRUCT_HTTP_FLAG_WAITINGFORTASK = 1,
   STRUCT_HTTP_FLAG_GZIP           = 2,
-  STRUCT_HTTP_FLAG_BZIP2          = 4
+  STRUCT_HTTP_FLAG_BZIP2          = 4,
+  STRUCT_HTTP_FLAG_STREAMING      = 8,
+  STRUCT_HTTP_FLAG_OPENMETRICS    = 16
 } STRUCT_HTTP_FLAG;
 
 struct http_data {
@@ -17,11 +19,16 @@ struct http_data {
   io_batch         batch;
   ot_ip6           ip;
   STRUCT_HTTP_FLAG flag;
+  int              fullscrape_mode;
+  struct ot_fullscrape_snapshot *snapshot;
+  int              iovec_entries;
+  struct iovec    *iovector;
 };
 
 ssize_t http_handle_request( const int64 s, struct ot_workstruct *ws );
-ssize_t http_sendiovecdata( const int64 s, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector );
+ssize_t http_sendiovecdata( const int64 s, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector, int is_partial );
 ssize_t http_issue_error( const int64 s, struct ot_workstruct *ws, int code );
+void    http_release_iovec( struct http_data *cookie );
 
 extern char   *g_stats_path;
 extern ssize_t g_stats_path_len;
@@ -7,7 +7,11 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/uio.h>
 
 /* Libowfat */
@@ -15,12 +19,120 @@
 /* Opentracker */
 #include "ot_iovec.h"
 
+/* Buffers of exactly OT_IOVEC_POOL_CHUNK_SIZE bytes, which is what full
+   scrapes ask for, come from one region mapped and faulted in at start up
+   and go back to it when the answer is sent. Any other size, or a pool
+   that ran dry, is mapped as before. */
+unsigned int g_iovec_pool_chunks;
+unsigned int g_iovec_pool_hugepages;
+
+#define OT_IOVEC_POOL_HUGEPAGE_SIZE ( 2 * 1024 * 1024 )
+
+static struct {
+  pthread_mutex_t    mutex;
+  char              *region;
+  size_t             region_size;
+  void             **free_chunks;
+  size_t             free_count;
+  size_t             chunk_count;
+  const char        *hugepages;
+  unsigned long long taken, returned, exhausted;
+} g_iovec_pool = { .mutex = PTHREAD_MUTEX_INITIALIZER, .hugepages = "off" };
+
+void iovec_pool_init( void ) {
+  size_t i, size = (size_t)g_iovec_pool_chunks * OT_IOVEC_POOL_CHUNK_SIZE;
+  char *region = MAP_FAILED;
+
+  if( !size ) return;
+  if( g_iovec_pool_hugepages )
+    size = ( size + OT_IOVEC_POOL_HUGEPAGE_SIZE - 1 ) & ~(size_t)( OT_IOVEC_POOL_HUGEPAGE_SIZE - 1 );
+
+#ifdef MAP_HUGETLB
+  /* Reserved huge pages first, transparent ones if none are configured */
+  if( g_iovec_pool_hugepages )
+    if( ( region = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, 0 ) ) != MAP_FAILED )
+      g_iovec_pool.hugepages = "reserved";
+#endif
+  if( region == MAP_FAILED ) {
+    if( ( region = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0 ) ) == MAP_FAILED ) {
+      fprintf( stderr, "Warning: Could not map %zu bytes for the iovec pool, buffers will be mapped on demand.\n", size );
+      return;
+    }
+#ifdef MADV_HUGEPAGE
+    if( g_iovec_pool_hugepages && !madvise( region, size, MADV_HUGEPAGE ) )
+      g_iovec_pool.hugepages = "transparent";
+#endif
+  }
+
+  if( !( g_iovec_pool.free_chunks = malloc( g_iovec_pool_chunks * sizeof(void*) ) ) ) {
+    munmap( region, size );
+    return;
+  }
+
+  /* Fault the pages in now, not while a worker builds an answer */
+  memset( region, 0, size );
+
+  g_iovec_pool.region      = region;
+  g_iovec_pool.region_size = size;
+  g_iovec_pool.chunk_count = g_iovec_pool_chunks;
+  for( i=0; i<g_iovec_pool_chunks; ++i )
+    g_iovec_pool.free_chunks[i] = region + ( g_iovec_pool_chunks - 1 - i ) * OT_IOVEC_POOL_CHUNK_SIZE;
+  g_iovec_pool.free_count  = g_iovec_pool_chunks;
+}
+
+static int iovec_pooled( const void *ptr ) {
+  return (const char*)ptr >= g_iovec_pool.region && (const char*)ptr < g_iovec_pool.region + g_iovec_pool.region_size;
+}
+
+static void *iovec_alloc( size_t size ) {
+  void *ptr = NULL;
+
+  if( size == OT_IOVEC_POOL_CHUNK_SIZE && g_iovec_pool.chunk_count ) {
+    pthread_mutex_lock( &g_iovec_pool.mutex );
+    if( g_iovec_pool.free_count ) {
+      ptr = g_iovec_pool.free_chunks[ --g_iovec_pool.free_count ];
+      ++g_iovec_pool.taken;
+    } else
+      ++g_iovec_pool.exhausted;
+    pthread_mutex_unlock( &g_iovec_pool.mutex );
+    if( ptr )
+      return ptr;
+  }
+
+  ptr = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0 );
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static void iovec_release( void *ptr, size_t size ) {
+  if( !iovec_pooled( ptr ) ) {
+    munmap( ptr, size );
+    return;
+  }
+  pthread_mutex_lock( &g_iovec_pool.mutex );
+  g_iovec_pool.free_chunks[ g_iovec_pool.free_count++ ] = ptr;
+  ++g_iovec_pool.returned;
+  pthread_mutex_unlock( &g_iovec_pool.mutex );
+}
+
+size_t iovec_pool_return_stats( char *reply ) {
+  char *r = reply;
+
+  pthread_mutex_lock( &g_iovec_pool.mutex );
+  r += sprintf( r, "iovec pool: %zu chunks of %d kB, %zu free, huge pages %s\n",
+    g_iovec_pool.chunk_count, OT_IOVEC_POOL_CHUNK_SIZE / 1024, g_iovec_pool.free_count, g_iovec_pool.hugepages );
+  r += sprintf( r, "%llu taken, %llu returned, %llu mapped while exhausted\n",
+    g_iovec_pool.taken, g_iovec_pool.returned, g_iovec_pool.exhausted );
+  pthread_mutex_unlock( &g_iovec_pool.mutex );
+
+  return r - reply;
+}
+
 void *iovec_increase( int *iovec_entries, struct iovec **iovector, size_t new_alloc ) {
   void *new_ptr = realloc( *iovector, (1 + *iovec_entries ) * sizeof( struct iovec ) );
   if( !new_ptr )
     return NULL;
   *iovector = new_ptr;
-  new_ptr = mmap( NULL, new_alloc, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0 );
+  new_ptr = iovec_alloc( new_alloc );
   if( !new_ptr )
     return NULL;
   ((*iovector)[*iovec_entries]).iov_base = new_ptr;
@@ -32,7 +144,7 @@ void *iovec_increase( int *iovec_entries, struct iovec **iovector, size_t new_al
 void iovec_free( int *iovec_entries, struct iovec **iovector ) {
   int i;
   for( i=0; i<*iovec_entries; ++i )
-    munmap( ((*iovector)[i]).iov_base, ((*iovector)[i]).iov_len );
+    iovec_release( ((*iovector)[i]).iov_base, ((*iovector)[i]).iov_len );
   *iovec_entries = 0;
 }
 
@@ -48,7 +160,8 @@ void  iovec_fixlast( int *iovec_entries, struct iovec **iovector, void *last_ptr
   old_pages = 1 + old_alloc / page_size;
   new_pages = 1 + new_alloc / page_size;
 
-  if( old_pages != new_pages )
+  /* Pooled chunks keep their tail, it is reused with the chunk */
+  if( old_pages != new_pages && !iovec_pooled( base ) )
     munmap( base + new_pages * page_size, old_alloc - new_pages * page_size );
   ((*iovector)[*iovec_entries - 1 ]).iov_len = new_alloc;
 }
@@ -73,4 +186,4 @@ size_t iovec_length( int *iovec_entries, struct iovec **iovector ) {
   return length;
 }
 
-const char *g_version_iovec_c = "$Source: /home/cvsroot/opentracker/ot_iovec.c,v $: $Revision: 1.6 $\n";
+const char *g_version_iovec_c = "$Source: /home/cvsroot/opentracker/ot_iovec.c,v $: $Revision: 1.7 $\n";
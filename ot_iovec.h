@@ -8,6 +8,14 @@
 
 #include <sys/uio.h>
 
+#define OT_IOVEC_POOL_CHUNK_SIZE ( 512 * 1024 )
+
+extern unsigned int g_iovec_pool_chunks;
+extern unsigned int g_iovec_pool_hugepages;
+
+void   iovec_pool_init( void );
+size_t iovec_pool_return_stats( char *reply );
+
 void  *iovec_increase( int *iovec_entries, struct iovec **iovector, size_t new_alloc );
 void   iovec_fixlast( int *iovec_entries, struct iovec **iovector, void *last_ptr );
 void   iovec_free( int *iovec_entries, struct iovec **iovector );
@@ -224,10 +224,12 @@ static void * livesync_worker( void * args ) {
   ot_ip6 in_ip; uint16_t in_port;
 
   (void)args;
+  mutex_bucket_set_class( LOCK_CLASS_SYNC );
   
   /* Initialize our "thread local storage" */
   ws.inbuf   = ws.request = malloc( LIVESYNC_INCOMING_BUFFSIZE );
   ws.outbuf  = ws.reply   = 0;
+  ws.traced  = 0;
   
   memcpy( in_ip, V4mappedprefix, sizeof( V4mappedprefix ) );
 
@@ -262,4 +264,4 @@ static void * livesync_worker( void * args ) {
 }
 
 #endif
-const char *g_version_livesync_c = "$Source: /home/cvsroot/opentracker/ot_livesync.c,v $: $Revision: 1.18 $\n";
+const char *g_version_livesync_c = "$Source: /home/cvsroot/opentracker/ot_livesync.c,v $: $Revision: 1.20 $\n";
@@ -7,8 +7,11 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/mman.h>
 #include <sys/uio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 /* Libowfat */
 #include "byte.h"
@@ -19,6 +22,8 @@
 #include "trackerlogic.h"
 #include "ot_mutex.h"
 #include "ot_stats.h"
+#include "ot_iovec.h"
+#include "ot_usdt.h"
 
 /* #define MTX_DBG( STRING ) fprintf( stderr, STRING ) */
 #define MTX_DBG( STRING )
@@ -33,9 +38,33 @@ static int bucket_locklist_count = 0;
 static pthread_mutex_t bucket_mutex;
 static pthread_cond_t bucket_being_unlocked;
 
-/* Self pipe from opentracker.c */
+/* How many mutex_bucket_lock calls had to wait for their bucket, bumped
+   under bucket_mutex, read without it by the cleaners pacing themselves */
+static size_t bucket_stalls;
+
+/* Self pipe from opentracker.c, an eventfd on Linux */
 extern int g_self_pipe[2];
 
+const char *g_lock_class_names[LOCK_CLASS_COUNT] = { "request", "clean", "fullscrape", "persist", "stats", "sync" };
+
+#ifdef WANT_LOCK_STATS
+/* Lock times per bucket, only touched under bucket_mutex. Waiting counts
+   from entering mutex_bucket_lock, holding from getting the bucket. The
+   arrays next to bucket_locklist remember when and by whom each held
+   bucket was taken. */
+typedef struct {
+  uint64_t waits;
+  uint64_t wait_ns;
+  uint64_t hold_ns[LOCK_CLASS_COUNT];
+} ot_bucket_lock_stats;
+
+static ot_bucket_lock_stats bucket_lock_stats[OT_BUCKET_COUNT];
+static uint64_t             bucket_locklist_since[ OT_MAX_THREADS ];
+static uint64_t             bucket_locklist_wait[ OT_MAX_THREADS ];
+static ot_lock_class        bucket_locklist_class[ OT_MAX_THREADS ];
+static __thread ot_lock_class bucket_lock_class_mine;
+#endif
+
 static int bucket_check( int bucket ) {
   /* C should come with auto-i ;) */
   int i;
@@ -71,32 +100,103 @@ static void bucket_remove( int bucket ) {
     return;
   }
 
-  for( ; i < bucket_locklist_count - 1; ++i )
+  for( ; i < bucket_locklist_count - 1; ++i ) {
     bucket_locklist[ i ] = bucket_locklist[ i + 1 ];
+#ifdef WANT_LOCK_STATS
+    bucket_locklist_since[ i ] = bucket_locklist_since[ i + 1 ];
+    bucket_locklist_wait[ i ]  = bucket_locklist_wait[ i + 1 ];
+    bucket_locklist_class[ i ] = bucket_locklist_class[ i + 1 ];
+#endif
+  }
 
   --bucket_locklist_count;
 }
 
+#ifdef WANT_LOCK_STATS
+/* Called with bucket_mutex held, right after bucket_push */
+static void bucket_lock_taken( int bucket, uint64_t start, int waited ) {
+  int      i   = bucket_locklist_count - 1;
+  uint64_t now = stats_latency_start( );
+
+  bucket_locklist_since[ i ] = now;
+  bucket_locklist_wait[ i ]  = now - start;
+  bucket_locklist_class[ i ] = bucket_lock_class_mine;
+  bucket_lock_stats[ bucket ].waits   += waited;
+  bucket_lock_stats[ bucket ].wait_ns += now - start;
+}
+
+/* Called with bucket_mutex held, right before bucket_remove */
+static void bucket_lock_released( int bucket, uint64_t now, ot_lock_class *lock_class, uint64_t *wait_ns, uint64_t *hold_ns ) {
+  int i = 0;
+
+  while( ( i < bucket_locklist_count ) && ( bucket_locklist[ i ] != bucket ) )
+    ++i;
+  if( i == bucket_locklist_count )
+    return;
+
+  *lock_class = bucket_locklist_class[ i ];
+  *wait_ns    = bucket_locklist_wait[ i ];
+  *hold_ns    = now - bucket_locklist_since[ i ];
+  bucket_lock_stats[ bucket ].hold_ns[ *lock_class ] += *hold_ns;
+}
+#endif
+
+void mutex_bucket_set_class( ot_lock_class lock_class ) {
+#ifdef WANT_LOCK_STATS
+  bucket_lock_class_mine = lock_class;
+#else
+  (void)lock_class;
+#endif
+}
+
 /* Can block */
 ot_vector *mutex_bucket_lock( int bucket ) {
+#ifdef WANT_LOCK_STATS
+  uint64_t start  = stats_latency_start( );
+#endif
+  int      waited = 0;
+  OT_USDT1( bucket_lock_enter, bucket );
   pthread_mutex_lock( &bucket_mutex );
-  while( bucket_check( bucket ) )
+  while( bucket_check( bucket ) ) {
     pthread_cond_wait( &bucket_being_unlocked, &bucket_mutex );
+    waited = 1;
+  }
+  if( waited )
+    __atomic_store_n( &bucket_stalls, bucket_stalls + 1, __ATOMIC_RELAXED );
   bucket_push( bucket );
+#ifdef WANT_LOCK_STATS
+  bucket_lock_taken( bucket, start, waited );
+#endif
   pthread_mutex_unlock( &bucket_mutex );
+  OT_USDT1( bucket_lock_acquire, bucket );
   return all_torrents + bucket;
 }
 
+size_t mutex_bucket_stalls( void ) {
+  return __atomic_load_n( &bucket_stalls, __ATOMIC_RELAXED );
+}
+
 ot_vector *mutex_bucket_lock_by_hash( ot_hash hash ) {
   return mutex_bucket_lock( uint32_read_big( (char*)hash ) >> OT_BUCKET_COUNT_SHIFT );
 }
 
 void mutex_bucket_unlock( int bucket, int delta_torrentcount ) {
+#ifdef WANT_LOCK_STATS
+  uint64_t      now        = stats_latency_start( ), wait_ns = 0, hold_ns = 0;
+  ot_lock_class lock_class = LOCK_CLASS_REQUEST;
+#endif
   pthread_mutex_lock( &bucket_mutex );
+#ifdef WANT_LOCK_STATS
+  bucket_lock_released( bucket, now, &lock_class, &wait_ns, &hold_ns );
+#endif
   bucket_remove( bucket );
   g_torrent_count += delta_torrentcount;
   pthread_cond_broadcast( &bucket_being_unlocked );
   pthread_mutex_unlock( &bucket_mutex );
+  OT_USDT1( bucket_lock_release, bucket );
+#ifdef WANT_LOCK_STATS
+  stats_issue_lock( lock_class, wait_ns, hold_ns );
+#endif
 }
 
 void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount ) {
@@ -111,60 +211,270 @@ size_t mutex_get_torrent_count( ) {
   return torrent_count;
 }
 
+#ifdef WANT_LOCK_STATS
+typedef struct { int bucket; uint64_t wait_ns; uint64_t hold_ns; } ot_bucket_rank;
+
+static int bucket_rank_by_wait( const void *a, const void *b ) {
+  uint64_t wait_a = ((const ot_bucket_rank*)a)->wait_ns, wait_b = ((const ot_bucket_rank*)b)->wait_ns;
+  return ( wait_a < wait_b ) - ( wait_a > wait_b );
+}
+
+static int bucket_rank_by_hold( const void *a, const void *b ) {
+  uint64_t hold_a = ((const ot_bucket_rank*)a)->hold_ns, hold_b = ((const ot_bucket_rank*)b)->hold_ns;
+  return ( hold_a < hold_b ) - ( hold_a > hold_b );
+}
+
+static char *bucket_lock_stats_table( char *r, const char *title, ot_bucket_lock_stats *stats, ot_bucket_rank *ranks, int amount ) {
+  int i, c;
+
+  r += sprintf( r, "%s\n%-8s %10s %12s", title, "bucket", "waits", "wait ms" );
+  for( c=0; c<LOCK_CLASS_COUNT; ++c )
+    r += sprintf( r, " %12s", g_lock_class_names[c] );
+  r += sprintf( r, "\n" );
+
+  for( i=0; i<amount; ++i ) {
+    ot_bucket_lock_stats *s = stats + ranks[i].bucket;
+    r += sprintf( r, "%-8d %10llu %12.3f", ranks[i].bucket, (unsigned long long)s->waits, s->wait_ns / 1000000.0 );
+    for( c=0; c<LOCK_CLASS_COUNT; ++c )
+      r += sprintf( r, " %12.3f", s->hold_ns[c] / 1000000.0 );
+    r += sprintf( r, "\n" );
+  }
+  return r;
+}
+
+/* Buckets waited for longest and held longest since start, hold times in
+   ms by the class of the holder */
+size_t mutex_bucket_return_lock_stats( char *reply, int amount ) {
+  ot_bucket_lock_stats *stats = malloc( sizeof( bucket_lock_stats ) );
+  ot_bucket_rank       *ranks = malloc( OT_BUCKET_COUNT * sizeof( ot_bucket_rank ) );
+  char                 *r     = reply;
+  int                   bucket, c;
+
+  if( !stats || !ranks )
+    goto bailout;
+
+  pthread_mutex_lock( &bucket_mutex );
+  memcpy( stats, bucket_lock_stats, sizeof( bucket_lock_stats ) );
+  pthread_mutex_unlock( &bucket_mutex );
+
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
+    ranks[bucket].bucket  = bucket;
+    ranks[bucket].wait_ns = stats[bucket].wait_ns;
+    ranks[bucket].hold_ns = 0;
+    for( c=0; c<LOCK_CLASS_COUNT; ++c )
+      ranks[bucket].hold_ns += stats[bucket].hold_ns[c];
+  }
+
+  if( amount > OT_BUCKET_COUNT )
+    amount = OT_BUCKET_COUNT;
+  qsort( ranks, OT_BUCKET_COUNT, sizeof( ot_bucket_rank ), bucket_rank_by_wait );
+  r = bucket_lock_stats_table( r, "Buckets waited for longest, hold ms by holder:", stats, ranks, amount );
+  qsort( ranks, OT_BUCKET_COUNT, sizeof( ot_bucket_rank ), bucket_rank_by_hold );
+  r = bucket_lock_stats_table( r, "\nBuckets held longest, hold ms by holder:", stats, ranks, amount );
+
+bailout:
+  free( ranks );
+  free( stats );
+  return r - reply;
+}
+#else
+size_t mutex_bucket_return_lock_stats( char *reply, int amount ) {
+  (void)amount;
+  return sprintf( reply, "Lock stats not compiled in, build with WANT_LOCK_STATS.\n" );
+}
+#endif
+
 /* TaskQueue Magic */
 
+/* Pending tasks wait in one fifo per task class, so a worker takes the
+   next task of its class without looking at anyone else's and only a
+   worker of that class is woken. Running tasks are found by taskid and
+   a socket finds its task for cancellation through a second hash. Done
+   tasks wait in the result fifo for the main thread. Every operation
+   is a few pointer moves under tasklist_mutex.
+
+   A worker may hand over parts of its answer before it is done. The
+   task then sits in the result fifo while still running, carrying the
+   buffers the main thread has not picked up yet. */
+#define OT_TASK_CLASSES   16
+#define OT_TASK_HASH_BITS 10
+#define OT_TASK_HASH_SIZE ( 1 << OT_TASK_HASH_BITS )
+#define OT_TASK_HASH(key) ( (size_t)(key) & ( OT_TASK_HASH_SIZE - 1 ) )
+
 struct ot_task {
   ot_taskid       taskid;
   ot_tasktype     tasktype;
+  uint64_t        taskarg[OT_TASK_ARG_SIZE / sizeof( uint64_t )];
   int64           sock;
   int             iovec_entries;
   struct iovec   *iovec;
+  int             cancelled;
+  int             queued;
+  size_t          inflight;
+  uint64_t        queued_at;
   struct ot_task *next;
+  struct ot_task *next_byid;
+  struct ot_task *next_bysock;
+};
+
+struct ot_taskqueue {
+  struct ot_task  *head;
+  struct ot_task **tail;
 };
 
-static ot_taskid next_free_taskid = 1;
-static struct ot_task *tasklist;
-static pthread_mutex_t tasklist_mutex;
-static pthread_cond_t tasklist_being_filled;
+/* Per class bookkeeping, only touched under tasklist_mutex */
+struct ot_taskclass {
+  ot_taskhandler      handler;
+  unsigned int        workers;
+  unsigned int        busy;
+  pthread_t          *threads;
+  size_t              depth;
+  size_t              depth_max;
+  unsigned long long  started;
+  unsigned long long  cancelled;
+  uint64_t            wait_total;
+  uint64_t            wait_max;
+};
 
-int mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype ) {
-  struct ot_task ** tmptask, * task;
+static ot_taskid           next_free_taskid = 1;
+static struct ot_taskqueue task_queues[OT_TASK_CLASSES];
+static struct ot_taskclass task_classes[OT_TASK_CLASSES];
+static pthread_cond_t      task_queue_filled[OT_TASK_CLASSES];
+static struct ot_taskqueue result_queue;
+static struct ot_task     *tasks_byid[OT_TASK_HASH_SIZE];
+static struct ot_task     *tasks_bysock[OT_TASK_HASH_SIZE];
+static int                 result_notified;
+static pthread_cond_t      task_stream_drained;
+static pthread_mutex_t     tasklist_mutex;
+
+static void taskqueue_push( struct ot_taskqueue *queue, struct ot_task *task ) {
+  task->next = NULL;
+  *queue->tail = task;
+  queue->tail = &task->next;
+}
 
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "pushtask locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "pushtask locked.\n" );
+static struct ot_task *taskqueue_shift( struct ot_taskqueue *queue ) {
+  struct ot_task *task = queue->head;
+  if( task && !( queue->head = task->next ) )
+    queue->tail = &queue->head;
+  return task;
+}
 
-  task = malloc(sizeof( struct ot_task));
-  if( !task ) {
-    MTX_DBG( "pushtask fail unlocks.\n" );
-    pthread_mutex_unlock( &tasklist_mutex );
-    MTX_DBG( "pushtask fail unlocked.\n" );
-    return -1;
-  }
+static struct ot_task **task_find_byid( ot_taskid taskid ) {
+  struct ot_task **task = tasks_byid + OT_TASK_HASH( taskid );
+  while( *task && (*task)->taskid != taskid )
+    task = &(*task)->next_byid;
+  return task;
+}
+
+static struct ot_task **task_find_bysock( int64 sock ) {
+  struct ot_task **task = tasks_bysock + OT_TASK_HASH( sock );
+  while( *task && (*task)->sock != sock )
+    task = &(*task)->next_bysock;
+  return task;
+}
+
+static void task_unlink_bysock( struct ot_task *task ) {
+  struct ot_task **link = tasks_bysock + OT_TASK_HASH( task->sock );
+  while( *link && *link != task )
+    link = &(*link)->next_bysock;
+  if( *link )
+    *link = task->next_bysock;
+}
+
+static uint64_t task_now_usec( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void task_free_iovec( int iovec_entries, struct iovec *iovec ) {
+  iovec_free( &iovec_entries, &iovec );
+  free( iovec );
+}
+
+static void task_free( struct ot_task *task ) {
+  task_free_iovec( task->iovec_entries, task->iovec );
+  free( task );
+}
+
+/* Call with tasklist_mutex held. Adds a worker's buffers to the ones
+   waiting for the main thread, returns 1 if the main thread needs a
+   wake up */
+static int task_queue_result( struct ot_task *task, int iovec_entries, struct iovec *iovec ) {
+  if( !task->iovec_entries ) {
+    free( task->iovec );
+    task->iovec         = iovec;
+    task->iovec_entries = iovec_entries;
+  } else if( iovec_entries ) {
+    struct iovec *joined = realloc( task->iovec, ( task->iovec_entries + iovec_entries ) * sizeof( struct iovec ) );
+    if( joined ) {
+      memcpy( joined + task->iovec_entries, iovec, iovec_entries * sizeof( struct iovec ) );
+      task->iovec          = joined;
+      task->iovec_entries += iovec_entries;
+      free( iovec );
+    } else
+      task_free_iovec( iovec_entries, iovec );
+  } else
+    free( iovec );
+
+  if( task->queued )
+    return 0;
+  task->queued = 1;
+  taskqueue_push( &result_queue, task );
+
+  /* Wake the main thread only once until it saw the queue run dry */
+  if( result_notified )
+    return 0;
+  return result_notified = 1;
+}
 
-  /* Skip to end of list */
-  tmptask = &tasklist;
-  while( *tmptask )
-    tmptask = &(*tmptask)->next;
-  *tmptask = task;
+static void task_notify_main( void ) {
+  const uint64_t one = 1;
+  if( write( g_self_pipe[1], &one, sizeof( one ) ) < 0 ) {}
+}
+
+int mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype, const void *taskarg, size_t taskarg_size ) {
+  const int task_class = ( tasktype & TASK_CLASS_MASK ) >> 8;
+  struct ot_task *task;
+
+  if( taskarg_size > OT_TASK_ARG_SIZE || !( task = malloc( sizeof( struct ot_task ) ) ) )
+    return -1;
 
   task->taskid        = 0;
   task->tasktype      = tasktype;
+  byte_zero( task->taskarg, sizeof( task->taskarg ) );
+  if( taskarg_size )
+    memcpy( task->taskarg, taskarg, taskarg_size );
   task->sock          = sock;
   task->iovec_entries = 0;
   task->iovec         = NULL;
-  task->next          = 0;
+  task->cancelled     = 0;
+  task->queued        = 0;
+  task->inflight      = 0;
+  task->queued_at     = task_now_usec( );
+
+  /* Want exclusive access to tasklist */
+  MTX_DBG( "pushtask locks.\n" );
+  pthread_mutex_lock( &tasklist_mutex );
+  MTX_DBG( "pushtask locked.\n" );
+
+  task->next_bysock = tasks_bysock[OT_TASK_HASH( sock )];
+  tasks_bysock[OT_TASK_HASH( sock )] = task;
+  taskqueue_push( task_queues + task_class, task );
+  if( ++task_classes[task_class].depth > task_classes[task_class].depth_max )
+    task_classes[task_class].depth_max = task_classes[task_class].depth;
 
-  /* Inform waiting workers and release lock */
-  MTX_DBG( "pushtask broadcasts.\n" );
-  pthread_cond_broadcast( &tasklist_being_filled );
-  MTX_DBG( "pushtask broadcasted, mutex unlocks.\n" );
+  /* Inform one waiting worker of this class and release lock */
+  pthread_cond_signal( task_queue_filled + task_class );
+  MTX_DBG( "pushtask end mutex unlocks.\n" );
   pthread_mutex_unlock( &tasklist_mutex );
   MTX_DBG( "pushtask end mutex unlocked.\n" );
   return 0;
 }
 
+/* The task may be waiting, running or done. We only mark it, whoever
+   holds it next throws it away. */
 void mutex_workqueue_canceltask( int64 sock ) {
   struct ot_task ** task;
 
@@ -173,21 +483,12 @@ void mutex_workqueue_canceltask( int64 sock ) {
   pthread_mutex_lock( &tasklist_mutex );
   MTX_DBG( "canceltask locked.\n" );
 
-  task = &tasklist;
-  while( *task && ( (*task)->sock != sock ) )
-    *task = (*task)->next;
-
-  if( *task && ( (*task)->sock == sock ) ) {
-    struct iovec *iovec = (*task)->iovec;
-    struct ot_task *ptask = *task;
-    int i;
-
-    /* Free task's iovec */
-    for( i=0; i<(*task)->iovec_entries; ++i )
-      munmap( iovec[i].iov_base, iovec[i].iov_len );
-
-    *task = (*task)->next;
-    free( ptask );
+  task = task_find_bysock( sock );
+  if( *task ) {
+    (*task)->cancelled = 1;
+    *task = (*task)->next_bysock;
+    /* A streaming worker may wait for the connection we just lost */
+    pthread_cond_broadcast( &task_stream_drained );
   }
 
   /* Release lock */
@@ -196,7 +497,9 @@ void mutex_workqueue_canceltask( int64 sock ) {
   MTX_DBG( "canceltask unlocked.\n" );
 }
 
-ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype ) {
+ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype, void *taskarg ) {
+  const int task_class = ( *tasktype & TASK_CLASS_MASK ) >> 8;
+  struct ot_taskclass *tc = task_classes + task_class;
   struct ot_task * task;
   ot_taskid taskid = 0;
 
@@ -206,22 +509,35 @@ ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype ) {
   MTX_DBG( "poptask mutex locked.\n" );
 
   while( !taskid ) {
-    /* Skip to the first unassigned task this worker wants to do */
-    task = tasklist;
-    while( task && ( ( ( TASK_CLASS_MASK & task->tasktype ) != *tasktype ) || task->taskid ) )
-      task = task->next;
-
-    /* If we found an outstanding task, assign a taskid to it
-       and leave the loop */
-    if( task ) {
-      task->taskid = taskid = ++next_free_taskid;
-      *tasktype = task->tasktype;
-    } else {
+    uint64_t waited;
+
+    if( !( task = taskqueue_shift( task_queues + task_class ) ) ) {
       /* Wait until the next task is being fed */
       MTX_DBG( "poptask cond waits.\n" );
-      pthread_cond_wait( &tasklist_being_filled, &tasklist_mutex );
+      pthread_cond_wait( task_queue_filled + task_class, &tasklist_mutex );
       MTX_DBG( "poptask cond waited.\n" );
+      continue;
+    }
+
+    --tc->depth;
+    if( task->cancelled ) {
+      ++tc->cancelled;
+      task_free( task );
+      continue;
     }
+
+    waited = task_now_usec( ) - task->queued_at;
+    tc->wait_total += waited;
+    if( waited > tc->wait_max ) tc->wait_max = waited;
+    ++tc->started;
+    ++tc->busy;
+
+    task->taskid = taskid = next_free_taskid++;
+    if( !next_free_taskid ) next_free_taskid = 1;
+    task->next_byid = tasks_byid[OT_TASK_HASH( taskid )];
+    tasks_byid[OT_TASK_HASH( taskid )] = task;
+    *tasktype = task->tasktype;
+    memcpy( taskarg, task->taskarg, sizeof( task->taskarg ) );
   }
 
   /* Release lock */
@@ -240,13 +556,13 @@ void mutex_workqueue_pushsuccess( ot_taskid taskid ) {
   pthread_mutex_lock( &tasklist_mutex );
   MTX_DBG( "pushsuccess locked.\n" );
 
-  task = &tasklist;
-  while( *task && ( (*task)->taskid != taskid ) )
-    *task = (*task)->next;
-
-  if( *task && ( (*task)->taskid == taskid ) ) {
+  task = task_find_byid( taskid );
+  if( *task ) {
     struct ot_task *ptask = *task;
-    *task = (*task)->next;
+    *task = ptask->next_byid;
+    --task_classes[( ptask->tasktype & TASK_CLASS_MASK ) >> 8].busy;
+    if( !ptask->cancelled )
+      task_unlink_bysock( ptask );
     free( ptask );
   }
 
@@ -256,23 +572,81 @@ void mutex_workqueue_pushsuccess( ot_taskid taskid ) {
   MTX_DBG( "pushsuccess unlocked.\n" );
 }
 
+/* Hands over the first buffers of an answer still being made. Blocks
+   while the connection has more than OT_TASK_STREAM_WINDOW buffers it
+   has not written yet, so a slow client slows down its worker instead of
+   piling up memory. The buffers are ours in any case. Returns -1 when
+   nobody waits for the answer anymore and the worker should give up. */
+int mutex_workqueue_pushchunk( ot_taskid taskid, int iovec_entries, struct iovec *iovec ) {
+  struct ot_task *task;
+  int notify, res;
+
+  /* Want exclusive access to tasklist */
+  MTX_DBG( "pushchunk locks.\n" );
+  pthread_mutex_lock( &tasklist_mutex );
+  MTX_DBG( "pushchunk locked.\n" );
+
+  task = *task_find_byid( taskid );
+  if( !task || task->cancelled ) {
+    pthread_mutex_unlock( &tasklist_mutex );
+    task_free_iovec( iovec_entries, iovec );
+    return -1;
+  }
+
+  task->inflight += iovec_entries;
+  notify = task_queue_result( task, iovec_entries, iovec );
+  pthread_mutex_unlock( &tasklist_mutex );
+
+  if( notify )
+    task_notify_main( );
+
+  /* The task is ours until we push its result, it can not go away */
+  pthread_mutex_lock( &tasklist_mutex );
+  while( !task->cancelled && task->inflight > OT_TASK_STREAM_WINDOW )
+    pthread_cond_wait( &task_stream_drained, &tasklist_mutex );
+  res = task->cancelled ? -1 : 0;
+
+  /* Release lock */
+  MTX_DBG( "pushchunk unlocks.\n" );
+  pthread_mutex_unlock( &tasklist_mutex );
+  MTX_DBG( "pushchunk unlocked.\n" );
+  return res;
+}
+
+/* The main thread wrote everything it picked up for this connection */
+void mutex_workqueue_streamdrained( int64 sock ) {
+  struct ot_task *task;
+
+  pthread_mutex_lock( &tasklist_mutex );
+  if( ( task = *task_find_bysock( sock ) ) ) {
+    task->inflight = task->iovec_entries;
+    pthread_cond_broadcast( &task_stream_drained );
+  }
+  pthread_mutex_unlock( &tasklist_mutex );
+}
+
 int mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iovec *iovec ) {
-  struct ot_task * task;
-  const char byte = 'o';
+  struct ot_task ** task, *ptask;
+  int notify = 0;
 
   /* Want exclusive access to tasklist */
   MTX_DBG( "pushresult locks.\n" );
   pthread_mutex_lock( &tasklist_mutex );
   MTX_DBG( "pushresult locked.\n" );
 
-  task = tasklist;
-  while( task && ( task->taskid != taskid ) )
-    task = task->next;
-
-  if( task ) {
-    task->iovec_entries = iovec_entries;
-    task->iovec         = iovec;
-    task->tasktype      = TASK_DONE;
+  task = task_find_byid( taskid );
+  if( ( ptask = *task ) ) {
+    *task = ptask->next_byid;
+    --task_classes[( ptask->tasktype & TASK_CLASS_MASK ) >> 8].busy;
+    ptask->tasktype = TASK_DONE;
+    if( ptask->cancelled ) {
+      /* Nobody waits for this one, the worker frees the iovec. If streamed
+         buffers still wait in the result fifo, popresult frees the task. */
+      if( !ptask->queued )
+        task_free( ptask );
+      ptask = NULL;
+    } else
+      notify = task_queue_result( ptask, iovec_entries, iovec );
   }
 
   /* Release lock */
@@ -280,14 +654,15 @@ int mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iove
   pthread_mutex_unlock( &tasklist_mutex );
   MTX_DBG( "pushresult unlocked.\n" );
 
-  io_trywrite( g_self_pipe[1], &byte, 1 );
+  if( notify )
+    task_notify_main( );
 
   /* Indicate whether the worker has to throw away results */
-  return task ? 0 : -1;
+  return ptask ? 0 : -1;
 }
 
-int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec ) {
-  struct ot_task ** task;
+int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec, int *more ) {
+  struct ot_task * task;
   int64 sock = -1;
 
   /* Want exclusive access to tasklist */
@@ -295,21 +670,34 @@ int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec ) {
   pthread_mutex_lock( &tasklist_mutex );
   MTX_DBG( "popresult locked.\n" );
 
-  task = &tasklist;
-  while( *task && ( (*task)->tasktype != TASK_DONE ) )
-    task = &(*task)->next;
-
-  if( *task && ( (*task)->tasktype == TASK_DONE ) ) {
-    struct ot_task *ptask = *task;
-
-    *iovec_entries = (*task)->iovec_entries;
-    *iovec         = (*task)->iovec;
-    sock           = (*task)->sock;
-
-    *task = (*task)->next;
-    free( ptask );
+  while( ( task = taskqueue_shift( &result_queue ) ) ) {
+    task->queued = 0;
+    if( !task->cancelled )
+      break;
+    /* Buffers for a connection that is gone, a running task stays with
+       its worker */
+    task_free_iovec( task->iovec_entries, task->iovec );
+    task->iovec_entries = 0;
+    task->iovec         = NULL;
+    if( task->tasktype == TASK_DONE )
+      free( task );
   }
 
+  if( task ) {
+    *iovec_entries      = task->iovec_entries;
+    *iovec              = task->iovec;
+    *more               = task->tasktype != TASK_DONE;
+    sock                = task->sock;
+    task->iovec_entries = 0;
+    task->iovec         = NULL;
+    if( !*more ) {
+      task_unlink_bysock( task );
+      free( task );
+    }
+  } else
+    /* Queue ran dry, the next result needs to wake us again */
+    result_notified = 0;
+
   /* Release lock */
   MTX_DBG( "popresult unlocks.\n" );
   pthread_mutex_unlock( &tasklist_mutex );
@@ -317,20 +705,143 @@ int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec ) {
   return sock;
 }
 
+/* Worker pools, one per task class, all feeding from the queues above */
+static const char *task_class_names[OT_TASK_CLASSES] = { NULL, "stats", "fullscrape", "dmem" };
+
+static void * mutex_workqueue_worker( void * args ) {
+  const ot_tasktype    task_class = (ot_tasktype)(uintptr_t)args;
+  const ot_taskhandler handler    = task_classes[task_class >> 8].handler;
+  int iovec_entries;
+  struct iovec *iovector;
+
+  mutex_bucket_set_class( task_class == TASK_STATS ? LOCK_CLASS_STATS : LOCK_CLASS_FULLSCRAPE );
+
+  while( 1 ) {
+    ot_tasktype tasktype = task_class;
+    uint64_t    taskarg[OT_TASK_ARG_SIZE / sizeof( uint64_t )];
+    ot_taskid   taskid   = mutex_workqueue_poptask( &tasktype, taskarg );
+    handler( &iovec_entries, &iovector, tasktype, taskarg, taskid );
+    if( mutex_workqueue_pushresult( taskid, iovec_entries, iovector ) )
+      task_free_iovec( iovec_entries, iovector );
+  }
+  return NULL;
+}
+
+void mutex_workqueue_setworkers( ot_tasktype task_class, unsigned int workers ) {
+  if( workers > OT_TASK_MAX_WORKERS )
+    workers = OT_TASK_MAX_WORKERS;
+  task_classes[( task_class & TASK_CLASS_MASK ) >> 8].workers = workers;
+}
+
+void mutex_workqueue_startworkers( ot_tasktype task_class, ot_taskhandler handler ) {
+  struct ot_taskclass *tc = task_classes + ( ( task_class & TASK_CLASS_MASK ) >> 8 );
+  unsigned int i;
+
+  if( !tc->workers )
+    tc->workers = 1;
+  tc->handler = handler;
+  if( !( tc->threads = malloc( tc->workers * sizeof(pthread_t) ) ) ) {
+    fprintf( stderr, "Could not allocate %s workers.\n", task_class_names[( task_class & TASK_CLASS_MASK ) >> 8] );
+    return;
+  }
+  for( i=0; i<tc->workers; ++i )
+    pthread_create( tc->threads + i, NULL, mutex_workqueue_worker, (void*)(uintptr_t)( task_class & TASK_CLASS_MASK ) );
+}
+
+void mutex_workqueue_stopworkers( ot_tasktype task_class ) {
+  struct ot_taskclass *tc = task_classes + ( ( task_class & TASK_CLASS_MASK ) >> 8 );
+  unsigned int i;
+
+  for( i=0; tc->threads && i<tc->workers; ++i )
+    pthread_cancel( tc->threads[i] );
+  free( tc->threads );
+  tc->threads = NULL;
+}
+
+size_t mutex_workqueue_return_stats( char *reply ) {
+  struct ot_taskclass snapshot[OT_TASK_CLASSES];
+  char *r = reply;
+  int i;
+
+  pthread_mutex_lock( &tasklist_mutex );
+  memcpy( snapshot, task_classes, sizeof( snapshot ) );
+  pthread_mutex_unlock( &tasklist_mutex );
+
+  for( i=0; i<OT_TASK_CLASSES; ++i ) {
+    struct ot_taskclass *tc = snapshot + i;
+    if( !tc->threads )
+      continue;
+    r += sprintf( r, "%-10s %2u workers, %2u busy, %6zu queued (max %zu), %llu started, %llu cancelled, wait avg %llu ms max %llu ms\n",
+                  task_class_names[i] ? task_class_names[i] : "unknown", tc->workers, tc->busy, tc->depth, tc->depth_max, tc->started, tc->cancelled,
+                  tc->started ? (unsigned long long)( tc->wait_total / tc->started / 1000 ) : 0, (unsigned long long)( tc->wait_max / 1000 ) );
+  }
+  return r - reply;
+}
+
+/* The same numbers as OpenMetrics families, labelled by task class */
+size_t mutex_workqueue_return_metrics( char *reply ) {
+  struct ot_taskclass snapshot[OT_TASK_CLASSES];
+  static const char *families[][3] = {
+    { "opentracker_task_workers", "gauge", "Worker threads per task class." },
+    { "opentracker_task_busy", "gauge", "Workers busy with a task." },
+    { "opentracker_task_queue_depth", "gauge", "Tasks waiting for a worker." },
+    { "opentracker_task_queue_depth_max", "gauge", "Most tasks ever waiting for a worker." },
+    { "opentracker_tasks_started", "counter", "Tasks taken by a worker." },
+    { "opentracker_tasks_cancelled", "counter", "Tasks dropped because their client went away." },
+    { "opentracker_task_wait_seconds", "counter", "Time tasks spent waiting for a worker." } };
+  char *r = reply;
+  size_t f;
+  int i;
+
+  pthread_mutex_lock( &tasklist_mutex );
+  memcpy( snapshot, task_classes, sizeof( snapshot ) );
+  pthread_mutex_unlock( &tasklist_mutex );
+
+  for( f=0; f<sizeof(families)/sizeof(*families); ++f ) {
+    int counter = families[f][1][0] == 'c';
+    r += sprintf( r, "# TYPE %s %s\n# HELP %s %s\n", families[f][0], families[f][1], families[f][0], families[f][2] );
+    for( i=0; i<OT_TASK_CLASSES; ++i ) {
+      struct ot_taskclass *tc = snapshot + i;
+      if( !tc->threads || !task_class_names[i] )
+        continue;
+      r += sprintf( r, "%s%s{class=\"%s\"} ", families[f][0], counter ? "_total" : "", task_class_names[i] );
+      switch( f ) {
+        case 0: r += sprintf( r, "%u\n", tc->workers ); break;
+        case 1: r += sprintf( r, "%u\n", tc->busy ); break;
+        case 2: r += sprintf( r, "%zu\n", tc->depth ); break;
+        case 3: r += sprintf( r, "%zu\n", tc->depth_max ); break;
+        case 4: r += sprintf( r, "%llu\n", tc->started ); break;
+        case 5: r += sprintf( r, "%llu\n", tc->cancelled ); break;
+        case 6: r += sprintf( r, "%.6f\n", tc->wait_total / 1000000.0 ); break;
+      }
+    }
+  }
+  return r - reply;
+}
+
 void mutex_init( ) {
+  int i;
   pthread_mutex_init(&tasklist_mutex, NULL);
-  pthread_cond_init (&tasklist_being_filled, NULL);
+  for( i=0; i<OT_TASK_CLASSES; ++i ) {
+    pthread_cond_init (task_queue_filled + i, NULL);
+    task_queues[i].tail = &task_queues[i].head;
+  }
+  result_queue.tail = &result_queue.head;
+  pthread_cond_init (&task_stream_drained, NULL);
   pthread_mutex_init(&bucket_mutex, NULL);
   pthread_cond_init (&bucket_being_unlocked, NULL);
   byte_zero( all_torrents, sizeof( all_torrents ) );
 }
 
 void mutex_deinit( ) {
+  int i;
   pthread_mutex_destroy(&bucket_mutex);
   pthread_cond_destroy(&bucket_being_unlocked);
   pthread_mutex_destroy(&tasklist_mutex);
-  pthread_cond_destroy(&tasklist_being_filled);
+  pthread_cond_destroy(&task_stream_drained);
+  for( i=0; i<OT_TASK_CLASSES; ++i )
+    pthread_cond_destroy(task_queue_filled + i);
   byte_zero( all_torrents, sizeof( all_torrents ) );
 }
 
-const char *g_version_mutex_c = "$Source: /home/cvsroot/opentracker/ot_mutex.c,v $: $Revision: 1.23 $\n";
+const char *g_version_mutex_c = "$Source: /home/cvsroot/opentracker/ot_mutex.c,v $: $Revision: 1.34 $\n";
@@ -19,6 +19,29 @@ void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount );
 
 size_t mutex_get_torrent_count();
 
+/* Number of bucket lock requests that had to wait for another holder,
+   ever increasing */
+size_t mutex_bucket_stalls( void );
+
+/* Who holds bucket locks. With WANT_LOCK_STATS, wait and hold times are
+   kept per class and per bucket, threads that are not request handlers
+   tell their class once when they start. */
+typedef enum {
+  LOCK_CLASS_REQUEST,
+  LOCK_CLASS_CLEAN,
+  LOCK_CLASS_FULLSCRAPE,
+  LOCK_CLASS_PERSIST,
+  LOCK_CLASS_STATS,
+  LOCK_CLASS_SYNC,
+
+  LOCK_CLASS_COUNT
+} ot_lock_class;
+
+extern const char *g_lock_class_names[LOCK_CLASS_COUNT];
+
+void   mutex_bucket_set_class( ot_lock_class lock_class );
+size_t mutex_bucket_return_lock_stats( char *reply, int amount );
+
 typedef enum {
   TASK_STATS_CONNS                 = 0x0001,
   TASK_STATS_TCP                   = 0x0002,
@@ -33,6 +56,14 @@ typedef enum {
   TASK_STATS_SYNCS                 = 0x000b,
   TASK_STATS_COMPLETED             = 0x000c,
   TASK_STATS_NUMWANTS              = 0x000d,
+  TASK_STATS_UDP_WORKERS           = 0x000e,
+  TASK_STATS_TASKS                 = 0x000f,
+  TASK_STATS_FULLSCRAPE_CACHE      = 0x0010,
+  TASK_STATS_IOVEC_POOL            = 0x0011,
+  TASK_STATS_LATENCY               = 0x0012,
+  TASK_STATS_LOCKS                 = 0x0013,
+  TASK_STATS_SHAPE                 = 0x0014,
+  TASK_STATS_CLEAN                 = 0x0015,
 
   TASK_STATS                       = 0x0100, /* Mask */
   TASK_STATS_TORRENTS              = 0x0101,
@@ -43,12 +74,17 @@ typedef enum {
   TASK_STATS_EVERYTHING            = 0x0106,
   TASK_STATS_FULLLOG               = 0x0107,
   TASK_STATS_WOODPECKERS           = 0x0108,
+  TASK_STATS_METRICS               = 0x0109,
+  TASK_STATS_COSTS                 = 0x010a,
+  TASK_STATS_TRACES                = 0x010b,
   
   TASK_FULLSCRAPE                  = 0x0200, /* Default mode */
   TASK_FULLSCRAPE_TPB_BINARY       = 0x0201,
   TASK_FULLSCRAPE_TPB_ASCII        = 0x0202,
   TASK_FULLSCRAPE_TPB_URLENCODED   = 0x0203,
   TASK_FULLSCRAPE_TRACKERSTATE     = 0x0204,
+  TASK_FULLSCRAPE_DELTA            = 0x0205,
+  TASK_FULLSCRAPE_COLUMNAR         = 0x0206,
 
   TASK_DMEM                        = 0x0300,
 
@@ -63,12 +99,30 @@ typedef enum {
 } ot_tasktype;
 
 typedef unsigned long ot_taskid;
+typedef void (*ot_taskhandler)( int *iovec_entries, struct iovec **iovector, ot_tasktype tasktype, const void *taskarg, ot_taskid taskid );
+
+/* Tasks carry up to this many bytes of parameters, copied along */
+#define OT_TASK_ARG_SIZE 32
+
+/* Upper bound for workers per task class, each may hold a bucket lock */
+#define OT_TASK_MAX_WORKERS 8
+
+/* Buffers a streamed answer may have queued up before its worker waits */
+#define OT_TASK_STREAM_WINDOW 4
 
-int       mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype );
+int       mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype, const void *taskarg, size_t taskarg_size );
 void      mutex_workqueue_canceltask( int64 sock );
 void      mutex_workqueue_pushsuccess( ot_taskid taskid );
-ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype );
+ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype, void *taskarg );
+int       mutex_workqueue_pushchunk( ot_taskid taskid, int iovec_entries, struct iovec *iovector );
 int       mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iovec *iovector );
-int64     mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovector );
+int64     mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovector, int *more );
+void      mutex_workqueue_streamdrained( int64 sock );
+
+void      mutex_workqueue_setworkers( ot_tasktype task_class, unsigned int workers );
+void      mutex_workqueue_startworkers( ot_tasktype task_class, ot_taskhandler handler );
+void      mutex_workqueue_stopworkers( ot_tasktype task_class );
+size_t    mutex_workqueue_return_stats( char *reply );
+size_t    mutex_workqueue_return_metrics( char *reply );
 
 #endif
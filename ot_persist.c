@@ -35,6 +35,8 @@
 #include "ot_mutex.h"
 #include "ot_accesslist.h"
 #include "ot_persist.h"
+#include "ot_stats.h"
+#include "ot_usdt.h"
 
 #ifdef WANT_PERSISTENCE
 
@@ -121,10 +123,13 @@ static int persist_add_peer(ot_hash *hash, ot_peerlist *peer_list, ot_peer *peer
   /* If we hadn't had a match, create peer there */
   if( !exactmatch ) {
     torrent->peer_list->peer_count++;
+    torrent->peer_list->modified = g_now_seconds;
+    stats_issue_peers( 1, ( OT_PEERFLAG(peer) & PEER_FLAG_SEEDING ) ? 1 : 0 );
     if( OT_PEERFLAG(peer) & PEER_FLAG_COMPLETED )
       torrent->peer_list->down_count++;
     if( OT_PEERFLAG(peer) & PEER_FLAG_SEEDING )
       torrent->peer_list->seed_count++;
+    stats_top_update( torrent );
   } else {
     LOG_ERR("Repeat peer in a same torrent\n");
     assert(0);
@@ -379,12 +384,14 @@ static int persist_dump_make() {
   char tmpfile[256];
 
   snprintf(tmpfile, 256, "temp-%u.odb", (unsigned int)g_now_seconds);
+  OT_USDT0( persist_dump_start );
 
   LOG_ERR("Start write odb file:%s\n", tmpfile);
 
   fp = fopen(tmpfile, "w");
   if (!fp) {
     LOG_ERR("%s: fopen odb file:%s failed: %s\n", __FUNCTION__, tmpfile, strerror(errno));
+    OT_USDT1( persist_dump_done, -1 );
     return -1;
   }
 
@@ -427,12 +434,14 @@ static int persist_dump_make() {
 
   dump_dirty = 0;
   dump_lastsave = g_now_seconds;
+  OT_USDT1( persist_dump_done, 0 );
   return 0;
 
 werr:
   LOG_ERR("%s: persist dump odb file:%s failed: %s\n", __FUNCTION__, tmpfile, strerror(errno));
   fclose(fp);
   unlink(tmpfile);
+  OT_USDT1( persist_dump_done, -1 );
   return -1;
 }
 
@@ -451,6 +460,7 @@ int persist_set_mode(char *value) {
 static void * persist_worker( void * args ) {
   size_t i = 0;
   (void)args;
+  mutex_bucket_set_class( LOCK_CLASS_PERSIST );
 
   while (1) {
     if (g_persistmode == PMODE_DUMP) {
@@ -490,4 +500,4 @@ void persist_deinit( ) {
 
 #endif
 
-const char *g_version_persist_c = "$Source: ot_persist.c Added by FengGu <flygoast@126.com>,v $: $Revision: 0.01 $\n";
+const char *g_version_persist_c = "$Source: ot_persist.c Added by FengGu <flygoast@126.com>,v $: $Revision: 0.05 $\n";
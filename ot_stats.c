@@ -14,6 +14,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <math.h>
 #ifdef WANT_SYSLOGS
 #include <syslog.h>
 #endif
@@ -30,6 +31,9 @@
 #include "ot_iovec.h"
 #include "ot_stats.h"
 #include "ot_accesslist.h"
+#include "ot_udp.h"
+#include "ot_fullscrape.h"
+#include "ot_clean.h"
 
 #ifndef NO_FULLSCRAPE_LOGGING
 #define LOG_TO_STDERR( ... ) fprintf( stderr, __VA_ARGS__ )
@@ -38,31 +42,400 @@
 #endif
 
 /* Forward declaration */
-static void stats_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode );
+static void stats_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode, const void *taskarg, ot_taskid taskid );
 #define OT_STATS_TMPSIZE 8192
 
-/* Clumsy counters... to be rethought */
-static unsigned long long ot_overall_tcp_connections = 0;
-static unsigned long long ot_overall_udp_connections = 0;
-static unsigned long long ot_overall_tcp_successfulannounces = 0;
-static unsigned long long ot_overall_udp_successfulannounces = 0;
-static unsigned long long ot_overall_tcp_successfulscrapes = 0;
-static unsigned long long ot_overall_udp_successfulscrapes = 0;
-static unsigned long long ot_overall_udp_connectionidmissmatches = 0;
-static unsigned long long ot_overall_tcp_connects = 0;
-static unsigned long long ot_overall_udp_connects = 0;
-static unsigned long long ot_overall_completed = 0;
-static unsigned long long ot_full_scrape_count = 0;
-static unsigned long long ot_full_scrape_request_count = 0;
-static unsigned long long ot_full_scrape_size = 0;
-static unsigned long long ot_failed_request_counts[CODE_HTTPERROR_COUNT];
+/* Latencies are counted in log buckets, each power of two of nanoseconds
+   split into 1<<OT_LATENCY_SUB_BITS steps, like HDR histograms do. This
+   keeps the error below 25% from a few ns up to about two minutes. */
+#define OT_LATENCY_SUB_BITS  2
+#define OT_LATENCY_MAX_BITS  36
+#define OT_LATENCY_BUCKETS   ( OT_LATENCY_MAX_BITS << OT_LATENCY_SUB_BITS )
+
+/* Event counters. Every thread that issues events gets its own slot, on
+   its own cache line, and is the only one writing to it. Readers sum up
+   all slots. When a thread exits, its counts move to the retired slot
+   and its slot is free for the next thread. Threads beyond the number of
+   slots share the overflow slot and count with atomic adds. */
+typedef struct {
+  unsigned long long overall_tcp_connections;
+  unsigned long long overall_udp_connections;
+  unsigned long long overall_tcp_successfulannounces;
+  unsigned long long overall_udp_successfulannounces;
+  unsigned long long overall_tcp_successfulscrapes;
+  unsigned long long overall_udp_successfulscrapes;
+  unsigned long long overall_udp_connectionidmissmatches;
+  unsigned long long overall_tcp_connects;
+  unsigned long long overall_udp_connects;
+  unsigned long long overall_completed;
+  unsigned long long full_scrape_count;
+  unsigned long long full_scrape_request_count;
+  unsigned long long full_scrape_size;
+  unsigned long long failed_request_counts[CODE_HTTPERROR_COUNT];
+  unsigned long long renewed[OT_PEER_TIMEOUT];
+  unsigned long long overall_sync_count;
+  unsigned long long overall_stall_count;
+  /* Peers and seeds added minus removed. A slot may go below zero, the
+     sum over all slots wraps back to the real totals. */
+  unsigned long long peers;
+  unsigned long long seeds;
+  unsigned long long latency[LATENCY_COUNT][OT_LATENCY_BUCKETS];
+  unsigned long long latency_sum[LATENCY_COUNT];
+#ifdef WANT_LOCK_STATS
+  unsigned long long lock_wait[LOCK_CLASS_COUNT][OT_LATENCY_BUCKETS];
+  unsigned long long lock_hold[LOCK_CLASS_COUNT][OT_LATENCY_BUCKETS];
+#endif
+} ot_stats_counters;
+
+/* Busy networks are counted in fixed size sketches instead of a tree over
+   all peers. A count-min sketch estimates announces per network, a /24
+   for ipv4 and a /48 for ipv6, a small table keeps the networks with the
+   highest estimates as candidates for the report and a HyperLogLog counts
+   distinct addresses. Each thread fills the sketches in its slot, readers
+   merge them. Counts are halved every OT_SKETCH_AGE_SECONDS by the
+   clock, whatever the cleaners' clean.cycle is, the HyperLogLog covers
+   the current and the previous run of that length.
+
+   The cost sketches count what each network makes us do, charged to the
+   network the requesting thread last set with stats_issue_requester. */
+#define OT_SKETCH_DEPTH      4
+#define OT_SKETCH_WIDTH      1024
+#define OT_SKETCH_HEAVY      128
+#define OT_SKETCH_HEAVY_INDEX 256   /* Open addressed, at most half full */
+#define OT_SKETCH_AGE_SECONDS 120
+#define OT_SKETCH_HLL_BITS   10
+#define OT_SKETCH_HLL_REGS   ( 1 << OT_SKETCH_HLL_BITS )
+
+typedef enum {
+  SKETCH_NETWORKS,
+#ifdef WANT_SPOT_WOODPECKER
+  SKETCH_WOODPECKERS,
+#endif
+  SKETCH_COST_ANNOUNCES,
+  SKETCH_COST_SCRAPES,
+  SKETCH_COST_FULLSCRAPES,
+  SKETCH_COST_ERRORS,
+  SKETCH_COST_BYTES,
+  SKETCH_COUNT
+} ot_sketch_kind;
+
+typedef struct { uint64_t network; uint32_t count; } ot_sketch_heavy;
+
+typedef struct {
+  unsigned int    epoch;
+  uint32_t        counts[OT_SKETCH_DEPTH][OT_SKETCH_WIDTH];
+  ot_sketch_heavy heavy[OT_SKETCH_HEAVY];
+  uint8_t         heavy_index[OT_SKETCH_HEAVY_INDEX]; /* Entry + 1, 0 is free */
+  int             heavy_count;
+  int             heavy_lowest_entry;
+  uint32_t        heavy_lowest;
+  uint8_t         registers[2][OT_SKETCH_HLL_REGS]; /* This and the previous run */
+} ot_network_sketch;
+
+#define OT_STATS_COUNTER_SLOTS 64
+#define OT_STATS_COUNTER_WORDS ( sizeof(ot_stats_counters) / sizeof(unsigned long long) )
+
+typedef struct {
+  ot_stats_counters counters;
+  ot_network_sketch sketches[SKETCH_COUNT];
+  int               in_use;
+  int               shared;
+} __attribute__((aligned(64))) ot_stats_slot;
+
+static ot_stats_slot     ot_counter_slots[OT_STATS_COUNTER_SLOTS];
+static ot_stats_slot     ot_counter_overflow = { .shared = 1 };
+static ot_stats_counters ot_counters_retired;
+static ot_network_sketch ot_sketches_retired[SKETCH_COUNT];
+static pthread_mutex_t   ot_counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t     ot_counters_key;
+static pthread_once_t    ot_counters_key_once = PTHREAD_ONCE_INIT;
+static __thread ot_stats_slot *ot_counters_mine;
+static __thread uint8_t        ot_requester[OT_IP_SIZE];      /* Like in ot_peer */
+static __thread int            ot_requester_known;
+
+#define STATS_ADD(S,F,N) do { \
+  if( (S)->shared ) __atomic_fetch_add( &(S)->counters.F, (N), __ATOMIC_RELAXED ); \
+  else __atomic_store_n( &(S)->counters.F, (S)->counters.F + (N), __ATOMIC_RELAXED ); } while(0)
+#define STATS_INC(S,F) STATS_ADD(S,F,1)
+
 static char *             ot_failed_request_names[] = { "302 Redirect", "400 Parse Error", "400 Invalid Parameter", "400 Invalid Parameter (compact=0)", "400 Not Modest", "403 Access Denied", "404 Not found", "500 Internal Server Error" };
-static unsigned long long ot_renewed[OT_PEER_TIMEOUT];
-static unsigned long long ot_overall_sync_count;
-static unsigned long long ot_overall_stall_count;
+
+static void stats_counters_add( ot_stats_counters *sum, ot_stats_counters *counters ) {
+  unsigned long long *d = (unsigned long long *)sum, *s = (unsigned long long *)counters;
+  size_t i;
+  for( i=0; i<OT_STATS_COUNTER_WORDS; ++i )
+    d[i] += __atomic_load_n( s + i, __ATOMIC_RELAXED );
+}
+
+static unsigned int stats_sketch_epoch( void ) {
+  return (unsigned int)( g_now_seconds / OT_SKETCH_AGE_SECONDS );
+}
+
+static uint64_t stats_sketch_mix( uint64_t x ) {
+  x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+  return x ^ ( x >> 33 );
+}
+
+/* The network of an address packed into the low bytes. With WANT_V6, v4
+   mapped addresses are tagged with the top bit and keep their /24 */
+static uint64_t stats_sketch_network( const uint8_t *ip ) {
+  uint64_t network = 0;
+  int      i, len = 3;
+#ifdef WANT_V6
+  int      mapped = ip6_isv4mapped( (const char *)ip );
+  if( mapped )
+    ip += 12;
+  else
+    len = 6;
+#endif
+  for( i=0; i<len; ++i )
+    network = ( network << 8 ) | ip[i];
+#ifdef WANT_V6
+  if( mapped )
+    network |= 1ULL << 63;
+#endif
+  return network;
+}
+
+static uint64_t stats_sketch_address_hash( const uint8_t *ip ) {
+  uint64_t a = 0, b = 0;
+#ifdef WANT_V6
+  memcpy( &a, ip, 8 );
+  memcpy( &b, ip + 8, 8 );
+#else
+  memcpy( &a, ip, 4 );
+#endif
+  return stats_sketch_mix( a ^ stats_sketch_mix( b + 0x9e3779b97f4a7c15ULL ) );
+}
+
+static uint32_t *stats_sketch_cell( ot_network_sketch *sketch, int row, uint64_t network_hash ) {
+  return sketch->counts[row] + ( ( network_hash >> ( row * 16 ) ) & ( OT_SKETCH_WIDTH - 1 ) );
+}
+
+static uint32_t stats_sketch_estimate( ot_network_sketch *sketch, uint64_t network ) {
+  uint64_t network_hash = stats_sketch_mix( network );
+  uint32_t estimate = UINT32_MAX, count;
+  int      row;
+  for( row=0; row<OT_SKETCH_DEPTH; ++row )
+    if( ( count = *stats_sketch_cell( sketch, row, network_hash ) ) < estimate )
+      estimate = count;
+  return estimate;
+}
+
+static void stats_sketch_find_lowest( ot_network_sketch *sketch ) {
+  int i;
+  sketch->heavy_lowest_entry = 0;
+  for( i=1; i<OT_SKETCH_HEAVY; ++i )
+    if( sketch->heavy[i].count < sketch->heavy[sketch->heavy_lowest_entry].count )
+      sketch->heavy_lowest_entry = i;
+  sketch->heavy_lowest = sketch->heavy[sketch->heavy_lowest_entry].count;
+}
+
+static unsigned int stats_sketch_heavy_home( uint64_t network ) {
+  return stats_sketch_mix( network ) >> 56;
+}
+
+/* Index slot holding the network, or the free slot it would go to */
+static unsigned int stats_sketch_heavy_slot( ot_network_sketch *sketch, uint64_t network ) {
+  unsigned int slot = stats_sketch_heavy_home( network );
+  while( sketch->heavy_index[slot] && sketch->heavy[sketch->heavy_index[slot] - 1].network != network )
+    slot = ( slot + 1 ) & ( OT_SKETCH_HEAVY_INDEX - 1 );
+  return slot;
+}
+
+/* Drops an entry from the index, moving later entries of the probe run
+   back so that no lookup stops early at the hole */
+static void stats_sketch_heavy_unindex( ot_network_sketch *sketch, int entry ) {
+  unsigned int hole = stats_sketch_heavy_slot( sketch, sketch->heavy[entry].network ), next = hole, home;
+
+  while( sketch->heavy_index[ next = ( next + 1 ) & ( OT_SKETCH_HEAVY_INDEX - 1 ) ] ) {
+    home = stats_sketch_heavy_home( sketch->heavy[sketch->heavy_index[next] - 1].network );
+    if( ( ( next - home ) & ( OT_SKETCH_HEAVY_INDEX - 1 ) ) >= ( ( next - hole ) & ( OT_SKETCH_HEAVY_INDEX - 1 ) ) ) {
+      sketch->heavy_index[hole] = sketch->heavy_index[next];
+      hole = next;
+    }
+  }
+  sketch->heavy_index[hole] = 0;
+}
+
+/* Keeps the network as a candidate if its estimate beats the lowest one.
+   Most networks do not, and return after the first compare. Held ones
+   are found through the index instead of scanning all candidates. */
+static void stats_sketch_offer( ot_network_sketch *sketch, uint64_t network, uint32_t estimate ) {
+  unsigned int slot;
+  int          i;
+
+  if( sketch->heavy_count == OT_SKETCH_HEAVY && estimate <= sketch->heavy_lowest )
+    return;
+
+  slot = stats_sketch_heavy_slot( sketch, network );
+  if( sketch->heavy_index[slot] )
+    i = sketch->heavy_index[slot] - 1;
+  else {
+    if( sketch->heavy_count < OT_SKETCH_HEAVY )
+      __atomic_store_n( &sketch->heavy_count, ( i = sketch->heavy_count ) + 1, __ATOMIC_RELEASE );
+    else {
+      stats_sketch_heavy_unindex( sketch, i = sketch->heavy_lowest_entry );
+      slot = stats_sketch_heavy_slot( sketch, network );
+    }
+    sketch->heavy[i].network  = network;
+    sketch->heavy_index[slot] = i + 1;
+  }
+  sketch->heavy[i].count = estimate;
+
+  if( sketch->heavy_count == OT_SKETCH_HEAVY && ( i == sketch->heavy_lowest_entry || sketch->heavy_lowest == 0 ) )
+    stats_sketch_find_lowest( sketch );
+}
+
+/* Halves all counts for every run since the sketch was last aged */
+static void stats_sketch_age( ot_network_sketch *sketch, unsigned int epoch ) {
+  unsigned int shift = epoch - sketch->epoch;
+  int          row, i;
+
+  if( !shift )
+    return;
+
+  for( row=0; row<OT_SKETCH_DEPTH; ++row )
+    for( i=0; i<OT_SKETCH_WIDTH; ++i )
+      __atomic_store_n( sketch->counts[row] + i, shift < 32 ? sketch->counts[row][i] >> shift : 0, __ATOMIC_RELAXED );
+  for( i=0; i<sketch->heavy_count; ++i )
+    sketch->heavy[i].count = shift < 32 ? sketch->heavy[i].count >> shift : 0;
+  sketch->heavy_lowest = shift < 32 ? sketch->heavy_lowest >> shift : 0;
+
+  if( shift == 1 )
+    memcpy( sketch->registers[1], sketch->registers[0], OT_SKETCH_HLL_REGS );
+  else
+    memset( sketch->registers[1], 0, OT_SKETCH_HLL_REGS );
+  memset( sketch->registers[0], 0, OT_SKETCH_HLL_REGS );
+
+  __atomic_store_n( &sketch->epoch, epoch, __ATOMIC_RELAXED );
+}
+
+static void stats_sketch_add( ot_network_sketch *sketch, const uint8_t *ip, uint32_t weight ) {
+  uint64_t network = stats_sketch_network( ip ), network_hash = stats_sketch_mix( network );
+  uint64_t address_hash = stats_sketch_address_hash( ip ), rest = address_hash << OT_SKETCH_HLL_BITS;
+  uint32_t estimate = UINT32_MAX, count;
+  uint8_t *reg = sketch->registers[0] + ( address_hash >> ( 64 - OT_SKETCH_HLL_BITS ) );
+  uint8_t  rank = rest ? __builtin_clzll( rest ) + 1 : 64 - OT_SKETCH_HLL_BITS + 1;
+  int      row;
+
+  stats_sketch_age( sketch, stats_sketch_epoch( ) );
+
+  for( row=0; row<OT_SKETCH_DEPTH; ++row ) {
+    uint32_t *cell = stats_sketch_cell( sketch, row, network_hash );
+    /* Byte counts saturate rather than wrap */
+    if( ( count = *cell + weight ) < weight )
+      count = UINT32_MAX;
+    __atomic_store_n( cell, count, __ATOMIC_RELAXED );
+    if( count < estimate )
+      estimate = count;
+  }
+  stats_sketch_offer( sketch, network, estimate );
+
+  if( rank > *reg )
+    __atomic_store_n( reg, rank, __ATOMIC_RELAXED );
+}
+
+static void stats_sketch_issue( ot_stats_slot *slot, ot_sketch_kind kind, const uint8_t *ip, uint32_t weight ) {
+  if( !slot->shared ) {
+    stats_sketch_add( slot->sketches + kind, ip, weight );
+    return;
+  }
+  pthread_mutex_lock( &ot_counters_mutex );
+  stats_sketch_add( slot->sketches + kind, ip, weight );
+  pthread_mutex_unlock( &ot_counters_mutex );
+}
+
+void stats_issue_requester( const ot_ip6 ip ) {
+  OT_SETIP( ot_requester, ip );
+  ot_requester_known = 1;
+}
+
+/* Charges the network of the current request, if this thread handles any */
+static void stats_sketch_charge( ot_stats_slot *slot, ot_sketch_kind kind, uint64_t weight ) {
+  if( ot_requester_known )
+    stats_sketch_issue( slot, kind, ot_requester, weight > UINT32_MAX ? UINT32_MAX : (uint32_t)weight );
+}
+
+/* Folds a retiring thread's sketch into the retired one, both are aged to
+   the current run first */
+static void stats_sketch_retire( ot_network_sketch *retired, ot_network_sketch *sketch ) {
+  unsigned int epoch = stats_sketch_epoch( );
+  int          row, i;
+
+  stats_sketch_age( retired, epoch );
+  stats_sketch_age( sketch, epoch );
+  for( row=0; row<OT_SKETCH_DEPTH; ++row )
+    for( i=0; i<OT_SKETCH_WIDTH; ++i )
+      retired->counts[row][i] += sketch->counts[row][i];
+  for( row=0; row<2; ++row )
+    for( i=0; i<OT_SKETCH_HLL_REGS; ++i )
+      if( sketch->registers[row][i] > retired->registers[row][i] )
+        retired->registers[row][i] = sketch->registers[row][i];
+  for( i=0; i<sketch->heavy_count; ++i )
+    stats_sketch_offer( retired, sketch->heavy[i].network, stats_sketch_estimate( retired, sketch->heavy[i].network ) );
+  memset( sketch, 0, sizeof(ot_network_sketch) );
+}
+
+static void stats_counters_retire( void *slot_ptr ) {
+  ot_stats_slot *slot = (ot_stats_slot *)slot_ptr;
+  int kind;
+  if( slot->shared ) return;
+  pthread_mutex_lock( &ot_counters_mutex );
+  stats_counters_add( &ot_counters_retired, &slot->counters );
+  memset( &slot->counters, 0, sizeof(ot_stats_counters) );
+  for( kind=0; kind<SKETCH_COUNT; ++kind )
+    stats_sketch_retire( ot_sketches_retired + kind, slot->sketches + kind );
+  slot->in_use = 0;
+  pthread_mutex_unlock( &ot_counters_mutex );
+}
+
+static void stats_counters_key_create( void ) {
+  pthread_key_create( &ot_counters_key, stats_counters_retire );
+}
+
+/* Threads may issue events before stats_init, udp workers are started
+   while the config file is parsed */
+static ot_stats_slot *stats_counters_mine( void ) {
+  ot_stats_slot *slot = ot_counters_mine;
+  int i;
+
+  if( slot )
+    return slot;
+
+  pthread_once( &ot_counters_key_once, stats_counters_key_create );
+  slot = &ot_counter_overflow;
+  pthread_mutex_lock( &ot_counters_mutex );
+  for( i=0; i<OT_STATS_COUNTER_SLOTS; ++i )
+    if( !ot_counter_slots[i].in_use ) {
+      slot = ot_counter_slots + i;
+      slot->in_use = 1;
+      break;
+    }
+  pthread_mutex_unlock( &ot_counters_mutex );
+
+  /* The key only exists to have the slot retired when the thread exits */
+  pthread_setspecific( ot_counters_key, slot );
+  return ot_counters_mine = slot;
+}
+
+static void stats_counters_sum( ot_stats_counters *sum ) {
+  int i;
+
+  memset( sum, 0, sizeof(ot_stats_counters) );
+  pthread_mutex_lock( &ot_counters_mutex );
+  stats_counters_add( sum, &ot_counters_retired );
+  for( i=0; i<OT_STATS_COUNTER_SLOTS; ++i )
+    if( ot_counter_slots[i].in_use )
+      stats_counters_add( sum, &ot_counter_slots[i].counters );
+  stats_counters_add( sum, &ot_counter_overflow.counters );
+  pthread_mutex_unlock( &ot_counters_mutex );
+}
 
 static time_t ot_start_time;
 
+#ifdef WANT_LOG_NETWORKS
 #define STATS_NETWORK_NODE_BITWIDTH       4
 #define STATS_NETWORK_NODE_COUNT         (1<<STATS_NETWORK_NODE_BITWIDTH)
 
@@ -71,14 +444,11 @@ static time_t ot_start_time;
 #define __SHFT(D)    ((D^STATS_NETWORK_NODE_BITWIDTH)&STATS_NETWORK_NODE_BITWIDTH)
 
 #define __LDR(P,D)   ((__BYTE((P),(D))>>__SHFT((D)))&__MSK)
-#define __STR(P,D,V)   __BYTE((P),(D))=(__BYTE((P),(D))&~(__MSK<<__SHFT((D))))|((V)<<__SHFT((D)))
 
 #ifdef WANT_V6
 #define STATS_NETWORK_NODE_MAXDEPTH  (68-STATS_NETWORK_NODE_BITWIDTH)
-#define STATS_NETWORK_NODE_LIMIT     (48-STATS_NETWORK_NODE_BITWIDTH)
 #else
 #define STATS_NETWORK_NODE_MAXDEPTH  (28-STATS_NETWORK_NODE_BITWIDTH)
-#define STATS_NETWORK_NODE_LIMIT     (24-STATS_NETWORK_NODE_BITWIDTH)
 #endif
 
 typedef union stats_network_node stats_network_node;
@@ -87,9 +457,7 @@ union stats_network_node {
   stats_network_node *children[STATS_NETWORK_NODE_COUNT];
 };
 
-#ifdef WANT_LOG_NETWORKS
 static stats_network_node *stats_network_counters_root;
-#endif
 
 static int stat_increase_network_count( stats_network_node **pnode, int depth, uintptr_t ip ) {
   int foo = __LDR(ip,depth);
@@ -109,173 +477,224 @@ static int stat_increase_network_count( stats_network_node **pnode, int depth, u
   node->counters[ foo ]++;
   return 0;
 }
+#endif
 
-static int stats_shift_down_network_count( stats_network_node **node, int depth, int shift ) {
-  int i, rest = 0;
-
-  if( !*node )
-    return 0;
+/* Adds a sketch into the merged one, whose epoch is the current run, and
+   collects its candidate networks */
+static void stats_sketch_merge( ot_network_sketch *merged, ot_network_sketch *sketch, uint64_t *candidates, size_t *candidate_count ) {
+  int shift = (int)( merged->epoch - __atomic_load_n( &sketch->epoch, __ATOMIC_RELAXED ) );
+  int row, i, heavy_count = __atomic_load_n( &sketch->heavy_count, __ATOMIC_ACQUIRE );
 
-  for( i=0; i<STATS_NETWORK_NODE_COUNT; ++i )
-    if( depth < STATS_NETWORK_NODE_MAXDEPTH )
-      rest += stats_shift_down_network_count( (*node)->children + i, depth+STATS_NETWORK_NODE_BITWIDTH, shift );
-    else
-      rest += (*node)->counters[i] >>= shift;
-
-  if( !rest ) {
-    free( *node );
-    *node = NULL;
-  }
+  /* The owner may have aged its sketch after the current run was read */
+  if( shift < 0 )
+    shift = 0;
+  if( shift > 31 )
+    return;
 
-  return rest;
+  for( row=0; row<OT_SKETCH_DEPTH; ++row )
+    for( i=0; i<OT_SKETCH_WIDTH; ++i )
+      merged->counts[row][i] += __atomic_load_n( sketch->counts[row] + i, __ATOMIC_RELAXED ) >> shift;
+  for( i=0; i<heavy_count; ++i )
+    candidates[(*candidate_count)++] = sketch->heavy[i].network;
+
+  /* Registers of older runs than the previous one are not counted */
+  for( row=0; row<2-shift; ++row )
+    for( i=0; i<OT_SKETCH_HLL_REGS; ++i ) {
+      uint8_t rank = __atomic_load_n( sketch->registers[row] + i, __ATOMIC_RELAXED );
+      if( rank > merged->registers[0][i] )
+        merged->registers[0][i] = rank;
+    }
 }
 
-static size_t stats_get_highscore_networks( stats_network_node *node, int depth, ot_ip6 node_value, size_t *scores, ot_ip6 *networks, int network_count, int limit ) {
-  size_t score = 0;
+/* Merges one kind of sketch from all slots, the caller holds the counters
+   mutex and has set the merged sketch's epoch */
+static void stats_sketch_merge_all( ot_network_sketch *merged, ot_sketch_kind kind, uint64_t *candidates, size_t *candidate_count ) {
   int i;
+  stats_sketch_merge( merged, ot_sketches_retired + kind, candidates, candidate_count );
+  for( i=0; i<OT_STATS_COUNTER_SLOTS; ++i )
+    if( ot_counter_slots[i].in_use )
+      stats_sketch_merge( merged, ot_counter_slots[i].sketches + kind, candidates, candidate_count );
+  stats_sketch_merge( merged, ot_counter_overflow.sketches + kind, candidates, candidate_count );
+}
 
-  if( !node ) return 0;
-
-  if( depth < limit ) {
-    for( i=0; i<STATS_NETWORK_NODE_COUNT; ++i )
-      if( node->children[i] ) {
-        __STR(node_value,depth,i);
-        score += stats_get_highscore_networks( node->children[i], depth+STATS_NETWORK_NODE_BITWIDTH, node_value, scores, networks, network_count, limit );
-      }
-    return score;
-  }
-
-  if( depth > limit && depth < STATS_NETWORK_NODE_MAXDEPTH ) {
-    for( i=0; i<STATS_NETWORK_NODE_COUNT; ++i )
-      if( node->children[i] )
-        score += stats_get_highscore_networks( node->children[i], depth+STATS_NETWORK_NODE_BITWIDTH, node_value, scores, networks, network_count, limit );
-    return score;
-  }
+static double stats_sketch_distinct( uint8_t *registers ) {
+  double sum = 0, m = OT_SKETCH_HLL_REGS, estimate;
+  int    i, zeros = 0;
 
-  if( depth > limit && depth == STATS_NETWORK_NODE_MAXDEPTH ) {
-    for( i=0; i<STATS_NETWORK_NODE_COUNT; ++i )
-      score += node->counters[i];
-    return score;
+  for( i=0; i<OT_SKETCH_HLL_REGS; ++i ) {
+    sum += 1.0 / (double)( 1ULL << registers[i] );
+    if( !registers[i] )
+      ++zeros;
   }
+  estimate = 0.7213 / ( 1 + 1.079 / m ) * m * m / sum;
+  /* Linear counting is more exact while many registers are unused */
+  if( estimate <= 2.5 * m && zeros )
+    estimate = m * log( m / zeros );
+  return estimate;
+}
 
-  /* if( depth == limit ) */
-  for( i=0; i<STATS_NETWORK_NODE_COUNT; ++i ) {
-    int j=1;
-    size_t node_score;
-
-    if( depth == STATS_NETWORK_NODE_MAXDEPTH )
-      node_score = node->counters[i];
-    else
-      node_score = stats_get_highscore_networks( node->children[i], depth+STATS_NETWORK_NODE_BITWIDTH, node_value, scores, networks, network_count, limit );
-
-    score += node_score;
-
-    if( node_score <= scores[0] ) continue;
-
-    __STR(node_value,depth,i);
-    while( j < network_count && node_score > scores[j] ) ++j;
-    --j;
-
-    memcpy( scores, scores + 1, j * sizeof( *scores ) );
-    memcpy( networks, networks + 1, j * sizeof( *networks ) );
-    scores[ j ] = node_score;
-    memcpy( networks + j, node_value, sizeof( *networks ) );
-  }
+static size_t stats_sketch_fmt_network( char *r, uint64_t network ) {
+  ot_ip6 ip;
+  int    i, len = 3, off = 0;
 
-  return score;
+  memset( ip, 0, sizeof( ip ) );
+#ifdef WANT_V6
+  if( network >> 63 ) {
+    memcpy( ip, V4mappedprefix, sizeof( V4mappedprefix ) );
+    off = 12;
+  } else
+    len = 6;
+#endif
+  for( i=len-1; i>=0; --i, network >>= 8 )
+    ip[off+i] = network & 255;
+#ifdef WANT_V6
+  return fmt_ip6c( r, ip );
+#else
+  return fmt_ip4( r, ip );
+#endif
 }
 
-static size_t stats_return_busy_networks( char * reply, stats_network_node *tree, int amount, int limit ) {
-  ot_ip6   networks[amount];
-  ot_ip6   node_value;
-  size_t   scores[amount];
-  int      i;
-  char   * r = reply;
+static int stats_sketch_compare_network( const void *a, const void *b ) {
+  uint64_t network_a = *(const uint64_t*)a, network_b = *(const uint64_t*)b;
+  return ( network_a > network_b ) - ( network_a < network_b );
+}
 
-  memset( scores, 0, sizeof( scores ) );
-  memset( networks, 0, sizeof( networks ) );
-  memset( node_value, 0, sizeof( node_value ) );
+static int stats_sketch_compare_count( const void *a, const void *b ) {
+  uint32_t count_a = ((const ot_sketch_heavy*)a)->count, count_b = ((const ot_sketch_heavy*)b)->count;
+  return ( count_a < count_b ) - ( count_a > count_b );
+}
 
-  stats_get_highscore_networks( tree, 0, node_value, scores, networks, amount, limit );
+/* Merges all threads' sketches, the cost depends on the number of slots,
+   not on the number of peers */
+static size_t stats_return_busy_networks( char * reply, ot_sketch_kind kind, int amount ) {
+  ot_network_sketch *merged     = calloc( 1, sizeof( ot_network_sketch ) );
+  uint64_t          *candidates = malloc( ( OT_STATS_COUNTER_SLOTS + 2 ) * OT_SKETCH_HEAVY * sizeof( uint64_t ) );
+  ot_sketch_heavy   *networks   = malloc( ( OT_STATS_COUNTER_SLOTS + 2 ) * OT_SKETCH_HEAVY * sizeof( ot_sketch_heavy ) );
+  size_t             candidate_count = 0, network_count = 0, i;
+  char              *r = reply;
+
+  if( !merged || !candidates || !networks )
+    goto bailout;
+
+  pthread_mutex_lock( &ot_counters_mutex );
+  merged->epoch = stats_sketch_epoch( );
+  stats_sketch_merge_all( merged, kind, candidates, &candidate_count );
+  pthread_mutex_unlock( &ot_counters_mutex );
+
+  /* The same network may be a candidate in several threads */
+  qsort( candidates, candidate_count, sizeof( uint64_t ), stats_sketch_compare_network );
+  for( i=0; i<candidate_count; ++i )
+    if( !i || candidates[i] != candidates[i-1] ) {
+      networks[network_count].network = candidates[i];
+      networks[network_count++].count = stats_sketch_estimate( merged, candidates[i] );
+    }
+  qsort( networks, network_count, sizeof( ot_sketch_heavy ), stats_sketch_compare_count );
 
-  r += sprintf( r, "Networks, limit /%d:\n", limit+STATS_NETWORK_NODE_BITWIDTH );
-  for( i=amount-1; i>=0; --i) {
-    if( scores[i] ) {
-      r += sprintf( r, "%08zd: ", scores[i] );
 #ifdef WANT_V6
-      r += fmt_ip6c( r, networks[i] );
+  r += sprintf( r, "Networks, limit /24 for ipv4, /48 for ipv6:\n" );
 #else
-      r += fmt_ip4( r, networks[i]);
+  r += sprintf( r, "Networks, limit /24:\n" );
 #endif
-      *r++ = '\n';
-    }
+  for( i=0; i<network_count && i<(size_t)amount; ++i ) {
+    if( !networks[i].count )
+      break;
+    r += sprintf( r, "%08u: ", networks[i].count );
+    r += stats_sketch_fmt_network( r, networks[i].network );
+    *r++ = '\n';
   }
-  *r++ = '\n';
+  r += sprintf( r, "\nDistinct addresses: %.0f\n", stats_sketch_distinct( merged->registers[0] ) );
 
+bailout:
+  free( networks );
+  free( candidates );
+  free( merged );
   return r - reply;
 }
 
-static size_t stats_slash24s_txt( char *reply, size_t amount ) {
-  stats_network_node *slash24s_network_counters_root = NULL;
-  char *r=reply;
-  int bucket;
-  size_t i;
+#define OT_COST_KINDS ( SKETCH_COST_BYTES - SKETCH_COST_ANNOUNCES + 1 )
+typedef struct {
+  uint64_t network;
+  uint64_t requests;
+  uint32_t counts[OT_COST_KINDS];
+} ot_network_cost;
+
+static int stats_cost_compare_requests( const void *a, const void *b ) {
+  uint64_t requests_a = ((const ot_network_cost*)a)->requests, requests_b = ((const ot_network_cost*)b)->requests;
+  return ( requests_a < requests_b ) - ( requests_a > requests_b );
+}
 
-  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
-    for( i=0; i<torrents_list->size; ++i ) {
-      ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[i] ).peer_list;
-      ot_vector   *bucket_list = &peer_list->peers;
-      int          num_buckets = 1;
+static int stats_cost_compare_bytes( const void *a, const void *b ) {
+  uint32_t bytes_a = ((const ot_network_cost*)a)->counts[SKETCH_COST_BYTES - SKETCH_COST_ANNOUNCES];
+  uint32_t bytes_b = ((const ot_network_cost*)b)->counts[SKETCH_COST_BYTES - SKETCH_COST_ANNOUNCES];
+  return ( bytes_a < bytes_b ) - ( bytes_a > bytes_b );
+}
 
-      if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
-        num_buckets = bucket_list->size;
-        bucket_list = (ot_vector *)bucket_list->data;
-      }
+static char *stats_cost_table( char *r, const char *title, ot_network_cost *costs, size_t cost_count, int amount ) {
+  size_t i;
 
-      while( num_buckets-- ) {
-        ot_peer *peers = (ot_peer*)bucket_list->data;
-        size_t   numpeers = bucket_list->size;
-        while( numpeers-- )
-          if( stat_increase_network_count( &slash24s_network_counters_root, 0, (uintptr_t)(peers++) ) )
-            goto bailout_unlock;
-        ++bucket_list;
-      }
-    }
-    mutex_bucket_unlock( bucket, 0 );
-    if( !g_opentracker_running )
-      goto bailout_error;
+  r += sprintf( r, "%s\n%12s %12s %12s %12s %14s  network\n", title, "announces", "scrapes", "fullscrapes", "errors", "bytes sent" );
+  for( i=0; i<cost_count && i<(size_t)amount; ++i ) {
+    uint32_t *counts = costs[i].counts;
+    if( !costs[i].requests && !counts[SKETCH_COST_BYTES - SKETCH_COST_ANNOUNCES] )
+      break;
+    r += sprintf( r, "%12u %12u %12u %12u %14u  ", counts[0], counts[1], counts[2], counts[3], counts[4] );
+    r += stats_sketch_fmt_network( r, costs[i].network );
+    *r++ = '\n';
   }
-
-  /* The tree is built. Now analyze */
-  r += stats_return_busy_networks( r, slash24s_network_counters_root, amount, STATS_NETWORK_NODE_MAXDEPTH );
-  r += stats_return_busy_networks( r, slash24s_network_counters_root, amount, STATS_NETWORK_NODE_LIMIT );
-  goto success;
-
-bailout_unlock:
-  mutex_bucket_unlock( bucket, 0 );
-bailout_error:
-  r = reply;
-success:
-  stats_shift_down_network_count( &slash24s_network_counters_root, 0, sizeof(int)*8-1 );
-
-  return r-reply;
+  return r;
 }
 
-#ifdef WANT_SPOT_WOODPECKER
-static stats_network_node *stats_woodpeckers_tree;
-static pthread_mutex_t g_woodpeckers_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-static size_t stats_return_woodpeckers( char * reply, int amount ) {
-  char * r = reply;
+/* What the busiest networks cost us, ranked once by requests and once by
+   bytes sent. Every network that is a candidate in any of the cost
+   sketches is estimated in all of them. */
+static size_t stats_return_costs( char * reply, int amount ) {
+  ot_network_sketch *merged     = calloc( OT_COST_KINDS, sizeof( ot_network_sketch ) );
+  uint64_t          *candidates = malloc( OT_COST_KINDS * ( OT_STATS_COUNTER_SLOTS + 2 ) * OT_SKETCH_HEAVY * sizeof( uint64_t ) );
+  ot_network_cost   *costs      = malloc( OT_COST_KINDS * ( OT_STATS_COUNTER_SLOTS + 2 ) * OT_SKETCH_HEAVY * sizeof( ot_network_cost ) );
+  size_t             candidate_count = 0, cost_count = 0, i;
+  unsigned int       epoch;
+  char              *r = reply;
+  int                kind;
+
+  if( !merged || !candidates || !costs )
+    goto bailout;
+
+  pthread_mutex_lock( &ot_counters_mutex );
+  epoch = stats_sketch_epoch( );
+  for( kind=0; kind<OT_COST_KINDS; ++kind ) {
+    merged[kind].epoch = epoch;
+    stats_sketch_merge_all( merged + kind, SKETCH_COST_ANNOUNCES + kind, candidates, &candidate_count );
+  }
+  pthread_mutex_unlock( &ot_counters_mutex );
+
+  qsort( candidates, candidate_count, sizeof( uint64_t ), stats_sketch_compare_network );
+  for( i=0; i<candidate_count; ++i )
+    if( !i || candidates[i] != candidates[i-1] ) {
+      ot_network_cost *cost = costs + cost_count++;
+      cost->network  = candidates[i];
+      cost->requests = 0;
+      for( kind=0; kind<OT_COST_KINDS; ++kind ) {
+        cost->counts[kind] = stats_sketch_estimate( merged + kind, candidates[i] );
+        if( kind != SKETCH_COST_BYTES - SKETCH_COST_ANNOUNCES )
+          cost->requests += cost->counts[kind];
+      }
+    }
 
-  pthread_mutex_lock( &g_woodpeckers_mutex );
-  r += stats_return_busy_networks( r, stats_woodpeckers_tree, amount, STATS_NETWORK_NODE_MAXDEPTH );
-  pthread_mutex_unlock( &g_woodpeckers_mutex );
-  return r-reply;
-}
+  qsort( costs, cost_count, sizeof( ot_network_cost ), stats_cost_compare_requests );
+#ifdef WANT_V6
+  r = stats_cost_table( r, "Networks by requests, limit /24 for ipv4, /48 for ipv6:", costs, cost_count, amount );
+#else
+  r = stats_cost_table( r, "Networks by requests, limit /24:", costs, cost_count, amount );
 #endif
+  qsort( costs, cost_count, sizeof( ot_network_cost ), stats_cost_compare_bytes );
+  r = stats_cost_table( r, "\nNetworks by bytes sent:", costs, cost_count, amount );
 
+bailout:
+  free( costs );
+  free( candidates );
+  free( merged );
+  return r - reply;
+}
 typedef struct {
   unsigned long long torrent_count;
   unsigned long long peer_count;
@@ -293,52 +712,240 @@ static int torrent_statter( ot_torrent *torrent, uintptr_t data ) {
 /* Converter function from memory to human readable hex strings */
 static char*to_hex(char*d,uint8_t*s){char*m="0123456789ABCDEF";char *t=d;char*e=d+40;while(d<e){*d++=m[*s>>4];*d++=m[*s++&15];}*d=0;return t;}
 
-typedef struct { size_t val; ot_torrent * torrent; } ot_record;
+/* Top torrents by peers and by seeds. Each table holds the hashes of the
+   torrents with the highest counts seen, kept up to date whenever a
+   torrent's counts change, so the top lists never walk the buckets.
+   Tables are split into OT_TOP_SHARDS shards by hash, each with its own
+   lock and its own OT_TOP_TRACKED entries, so the union of all shards
+   still contains the overall top OT_TOP_TRACKED. Bit n of peer_list->top
+   is set while table n holds that torrent, it is only touched under the
+   torrent's bucket lock. A bit may be left set after its entry was
+   replaced, the next change clears it. */
+#define OT_TOP_TRACKED 256
+#define OT_TOP_SHARDS  8
+#define OT_TOP_INDEX   512
+enum { OT_TOP_PEERS, OT_TOP_SEEDS, OT_TOP_COUNT };
+
+typedef struct { ot_hash hash; size_t val; } ot_record;
+
+typedef struct {
+  ot_hash  hash;
+  uint16_t heap_pos;
+  size_t   val;
+} ot_top_entry;
+
+/* Entries 0 to count-1 are in use. heap keeps their numbers ordered by
+   val with the lowest at heap[0], index finds them by hash and holds the
+   entry number plus one, 0 marking a free slot. */
+typedef struct {
+  pthread_mutex_t mutex;
+  ot_top_entry    entries[OT_TOP_TRACKED];
+  uint16_t        heap[OT_TOP_TRACKED];
+  uint16_t        index[OT_TOP_INDEX];
+  int             count;
+  size_t          lowest; /* Lowest count held once the shard is full, else 0 */
+} ot_top_table;
+
+static ot_top_table ot_top_tables[OT_TOP_COUNT][OT_TOP_SHARDS];
+
+/* Shards and index slots take different bytes of the hash, both of which
+   are independent from the bucket */
+static ot_top_table *stats_top_shard( int t, ot_hash const hash ) {
+  return &ot_top_tables[t][hash[19] % OT_TOP_SHARDS];
+}
+
+static unsigned int stats_top_home( ot_hash const hash ) {
+  return ( hash[12] | hash[13] << 8 ) & ( OT_TOP_INDEX - 1 );
+}
+
+/* Index slot holding the hash, or the free slot it would go to */
+static unsigned int stats_top_slot( ot_top_table *table, ot_hash const hash ) {
+  unsigned int slot = stats_top_home( hash );
+  while( table->index[slot] && memcmp( table->entries[table->index[slot] - 1].hash, hash, sizeof(ot_hash) ) )
+    slot = ( slot + 1 ) & ( OT_TOP_INDEX - 1 );
+  return slot;
+}
+
+/* Drops an entry from the index, moving later entries of the probe run
+   back so that no lookup stops early at the hole */
+static void stats_top_unindex( ot_top_table *table, int entry ) {
+  unsigned int hole = stats_top_slot( table, table->entries[entry].hash ), next = hole, home;
+
+  while( table->index[ next = ( next + 1 ) & ( OT_TOP_INDEX - 1 ) ] ) {
+    home = stats_top_home( table->entries[table->index[next] - 1].hash );
+    if( ( ( next - home ) & ( OT_TOP_INDEX - 1 ) ) >= ( ( next - hole ) & ( OT_TOP_INDEX - 1 ) ) ) {
+      table->index[hole] = table->index[next];
+      hole = next;
+    }
+  }
+  table->index[hole] = 0;
+}
+
+static void stats_top_heap_put( ot_top_table *table, int pos, int entry ) {
+  table->heap[pos] = entry;
+  table->entries[entry].heap_pos = pos;
+}
+
+/* Moves the entry at pos towards the root while it is lower than its
+   parent, returns where it ended up */
+static int stats_top_sift_up( ot_top_table *table, int pos ) {
+  int entry = table->heap[pos], parent;
+  while( pos && table->entries[table->heap[parent = ( pos - 1 ) / 2]].val > table->entries[entry].val ) {
+    stats_top_heap_put( table, pos, table->heap[parent] );
+    pos = parent;
+  }
+  stats_top_heap_put( table, pos, entry );
+  return pos;
+}
+
+static void stats_top_sift_down( ot_top_table *table, int pos ) {
+  int entry = table->heap[pos], child;
+  while( ( child = 2 * pos + 1 ) < table->count ) {
+    if( child + 1 < table->count && table->entries[table->heap[child + 1]].val < table->entries[table->heap[child]].val )
+      ++child;
+    if( table->entries[table->heap[child]].val >= table->entries[entry].val )
+      break;
+    stats_top_heap_put( table, pos, table->heap[child] );
+    pos = child;
+  }
+  stats_top_heap_put( table, pos, entry );
+}
+
+static void stats_top_drop( ot_top_table *table, int entry ) {
+  int pos = table->entries[entry].heap_pos, last;
+
+  stats_top_unindex( table, entry );
+
+  /* Close the gap in the heap with its last element */
+  last = table->heap[--table->count];
+  if( pos < table->count ) {
+    stats_top_heap_put( table, pos, last );
+    stats_top_sift_down( table, stats_top_sift_up( table, pos ) );
+  }
+
+  /* Keep entries dense, the last one takes over the dropped number */
+  if( entry < table->count ) {
+    table->entries[entry] = table->entries[table->count];
+    table->heap[table->entries[entry].heap_pos] = entry;
+    table->index[stats_top_slot( table, table->entries[entry].hash )] = entry + 1;
+  }
+}
+
+/* Returns 1 if the table holds the torrent afterwards */
+static int stats_top_table_set( ot_top_table *table, ot_hash const hash, size_t val ) {
+  unsigned int slot = stats_top_slot( table, hash );
+  int          entry, held = 1;
+  size_t       old;
+
+  if( table->index[slot] ) {
+    entry = table->index[slot] - 1;
+    if( !val ) {
+      stats_top_drop( table, entry );
+      held = 0;
+    } else {
+      old = table->entries[entry].val;
+      table->entries[entry].val = val;
+      if( val < old )
+        stats_top_sift_up( table, table->entries[entry].heap_pos );
+      else if( val > old )
+        stats_top_sift_down( table, table->entries[entry].heap_pos );
+      else
+        return 1;
+    }
+  } else {
+    if( !val )
+      return 0;
+    if( table->count < OT_TOP_TRACKED ) {
+      entry = table->count++;
+      table->entries[entry].val = val;
+      memcpy( table->entries[entry].hash, hash, sizeof(ot_hash) );
+      stats_top_heap_put( table, entry, entry );
+      stats_top_sift_up( table, entry );
+    } else if( val > table->entries[table->heap[0]].val ) {
+      /* Replace the lowest entry, which sits at the root */
+      stats_top_unindex( table, entry = table->heap[0] );
+      slot = stats_top_slot( table, hash );
+      table->entries[entry].val = val;
+      memcpy( table->entries[entry].hash, hash, sizeof(ot_hash) );
+      stats_top_sift_down( table, 0 );
+    } else
+      return 0;
+    table->index[slot] = entry + 1;
+  }
+
+  __atomic_store_n( &table->lowest, table->count == OT_TOP_TRACKED ? table->entries[table->heap[0]].val : 0, __ATOMIC_RELAXED );
+  return held;
+}
+
+static void stats_top_set( ot_torrent *torrent, size_t peers, size_t seeds ) {
+  ot_peerlist *peer_list = torrent->peer_list;
+  size_t       vals[OT_TOP_COUNT];
+  int          t, top = 0;
+
+  vals[OT_TOP_PEERS] = peers;
+  vals[OT_TOP_SEEDS] = seeds;
+
+  /* Most torrents are neither held nor high enough to enter, and only
+     take a shard's lock when they are */
+  for( t=0; t<OT_TOP_COUNT; ++t ) {
+    ot_top_table *table = stats_top_shard( t, torrent->hash );
+    if( !( peer_list->top & ( 1 << t ) ) && vals[t] <= __atomic_load_n( &table->lowest, __ATOMIC_RELAXED ) )
+      continue;
+    pthread_mutex_lock( &table->mutex );
+    if( stats_top_table_set( table, torrent->hash, vals[t] ) )
+      top |= 1 << t;
+    pthread_mutex_unlock( &table->mutex );
+  }
+  peer_list->top = top;
+}
+
+/* Called after a torrent's peer_count or seed_count changed, with the
+   bucket still locked */
+void stats_top_update( ot_torrent *torrent ) {
+  stats_top_set( torrent, torrent->peer_list->peer_count, torrent->peer_list->seed_count );
+}
+
+/* Called before a torrent is removed, with the bucket still locked */
+void stats_top_remove( ot_torrent *torrent ) {
+  if( torrent->peer_list->top )
+    stats_top_set( torrent, 0, 0 );
+}
+
+static int stats_top_compare( const void *a, const void *b ) {
+  size_t val_a = ((const ot_record*)a)->val, val_b = ((const ot_record*)b)->val;
+  return ( val_a < val_b ) - ( val_a > val_b );
+}
 
 /* Fetches stats from tracker */
 size_t stats_top_txt( char * reply, int amount ) {
-  size_t    j;
-  ot_record top100s[100], top100c[100];
-  char     *r  = reply, hex_out[42];
-  int       idx, bucket;
+  static const char *names[OT_TOP_COUNT] = { "peers", "seeds" };
+  ot_record *top = malloc( OT_TOP_SHARDS * OT_TOP_TRACKED * sizeof(ot_record) );
+  char      *r = reply, hex_out[42];
+  int        t, s, idx, count;
 
+  if( !top )
+    return 0;
   if( amount > 100 )
     amount = 100;
 
-  byte_zero( top100s, sizeof( top100s ) );
-  byte_zero( top100c, sizeof( top100c ) );
-
-  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
-    for( j=0; j<torrents_list->size; ++j ) {
-      ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[j] ).peer_list;
-      int idx = amount - 1; while( (idx >= 0) && ( peer_list->peer_count > top100c[idx].val ) ) --idx;
-      if ( idx++ != amount - 1 ) {
-        memmove( top100c + idx + 1, top100c + idx, ( amount - 1 - idx ) * sizeof( ot_record ) );
-        top100c[idx].val = peer_list->peer_count;
-        top100c[idx].torrent = (ot_torrent*)(torrents_list->data) + j;
-      }
-      idx = amount - 1; while( (idx >= 0) && ( peer_list->seed_count > top100s[idx].val ) ) --idx;
-      if ( idx++ != amount - 1 ) {
-        memmove( top100s + idx + 1, top100s + idx, ( amount - 1 - idx ) * sizeof( ot_record ) );
-        top100s[idx].val = peer_list->seed_count;
-        top100s[idx].torrent = (ot_torrent*)(torrents_list->data) + j;
+  for( t=0; t<OT_TOP_COUNT; ++t ) {
+    for( count=0, s=0; s<OT_TOP_SHARDS; ++s ) {
+      ot_top_table *table = &ot_top_tables[t][s];
+      pthread_mutex_lock( &table->mutex );
+      for( idx=0; idx<table->count; ++idx, ++count ) {
+        memcpy( top[count].hash, table->entries[idx].hash, sizeof(ot_hash) );
+        top[count].val = table->entries[idx].val;
       }
+      pthread_mutex_unlock( &table->mutex );
     }
-    mutex_bucket_unlock( bucket, 0 );
-    if( !g_opentracker_running )
-      return 0;
-  }
 
-  r += sprintf( r, "Top %d torrents by peers:\n", amount );
-  for( idx=0; idx<amount; ++idx )
-    if( top100c[idx].torrent )
-      r += sprintf( r, "\t%zd\t%s\n", top100c[idx].val, to_hex( hex_out, top100c[idx].torrent->hash) );
-  r += sprintf( r, "Top %d torrents by seeds:\n", amount );
-  for( idx=0; idx<amount; ++idx )
-    if( top100s[idx].torrent )
-      r += sprintf( r, "\t%zd\t%s\n", top100s[idx].val, to_hex( hex_out, top100s[idx].torrent->hash) );
+    qsort( top, count, sizeof(ot_record), stats_top_compare );
+    r += sprintf( r, "Top %d torrents by %s:\n", amount, names[t] );
+    for( idx=0; idx<amount && idx<count; ++idx )
+      r += sprintf( r, "\t%zd\t%s\n", top[idx].val, to_hex( hex_out, top[idx].hash ) );
+  }
 
+  free( top );
   return r - reply;
 }
 
@@ -347,78 +954,86 @@ static unsigned long events_per_time( unsigned long long events, time_t t ) {
 }
 
 static size_t stats_connections_mrtg( char * reply ) {
+  ot_stats_counters c;
   ot_time t = time( NULL ) - ot_start_time;
+  stats_counters_sum( &c );
   return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker connections, %lu conns/s :: %lu success/s.",
-                 ot_overall_tcp_connections+ot_overall_udp_connections,
-                 ot_overall_tcp_successfulannounces+ot_overall_udp_successfulannounces+ot_overall_udp_connects,
+                 c.overall_tcp_connections+c.overall_udp_connections,
+                 c.overall_tcp_successfulannounces+c.overall_udp_successfulannounces+c.overall_udp_connects,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( ot_overall_tcp_connections+ot_overall_udp_connections, t ),
-                 events_per_time( ot_overall_tcp_successfulannounces+ot_overall_udp_successfulannounces+ot_overall_udp_connects, t )
+                 events_per_time( c.overall_tcp_connections+c.overall_udp_connections, t ),
+                 events_per_time( c.overall_tcp_successfulannounces+c.overall_udp_successfulannounces+c.overall_udp_connects, t )
                  );
 }
 
 static size_t stats_udpconnections_mrtg( char * reply ) {
+  ot_stats_counters c;
   ot_time t = time( NULL ) - ot_start_time;
+  stats_counters_sum( &c );
   return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker udp4 stats, %lu conns/s :: %lu success/s.",
-                 ot_overall_udp_connections,
-                 ot_overall_udp_successfulannounces+ot_overall_udp_connects,
+                 c.overall_udp_connections,
+                 c.overall_udp_successfulannounces+c.overall_udp_connects,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( ot_overall_udp_connections, t ),
-                 events_per_time( ot_overall_udp_successfulannounces+ot_overall_udp_connects, t )
+                 events_per_time( c.overall_udp_connections, t ),
+                 events_per_time( c.overall_udp_successfulannounces+c.overall_udp_connects, t )
                  );
 }
 
 static size_t stats_tcpconnections_mrtg( char * reply ) {
+  ot_stats_counters c;
   time_t t = time( NULL ) - ot_start_time;
+  stats_counters_sum( &c );
   return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker tcp4 stats, %lu conns/s :: %lu success/s.",
-                 ot_overall_tcp_connections,
-                 ot_overall_tcp_successfulannounces,
+                 c.overall_tcp_connections,
+                 c.overall_tcp_successfulannounces,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( ot_overall_tcp_connections, t ),
-                 events_per_time( ot_overall_tcp_successfulannounces, t )
+                 events_per_time( c.overall_tcp_connections, t ),
+                 events_per_time( c.overall_tcp_successfulannounces, t )
                  );
 }
 
 static size_t stats_scrape_mrtg( char * reply ) {
+  ot_stats_counters c;
   time_t t = time( NULL ) - ot_start_time;
+  stats_counters_sum( &c );
   return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker scrape stats, %lu scrape/s (tcp and udp)",
-                 ot_overall_tcp_successfulscrapes,
-                 ot_overall_udp_successfulscrapes,
+                 c.overall_tcp_successfulscrapes,
+                 c.overall_udp_successfulscrapes,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( (ot_overall_tcp_successfulscrapes+ot_overall_udp_successfulscrapes), t )
+                 events_per_time( (c.overall_tcp_successfulscrapes+c.overall_udp_successfulscrapes), t )
                  );
 }
 
 static size_t stats_fullscrapes_mrtg( char * reply ) {
+  ot_stats_counters c;
   ot_time t = time( NULL ) - ot_start_time;
+  stats_counters_sum( &c );
   return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker full scrape stats, %lu conns/s :: %lu bytes/s.",
-                 ot_full_scrape_count * 1000,
-                 ot_full_scrape_size,
+                 c.full_scrape_count * 1000,
+                 c.full_scrape_size,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( ot_full_scrape_count, t ),
-                 events_per_time( ot_full_scrape_size, t )
+                 events_per_time( c.full_scrape_count, t ),
+                 events_per_time( c.full_scrape_size, t )
                  );
 }
 
 static size_t stats_peers_mrtg( char * reply ) {
-  torrent_stats stats = {0,0,0};
-
-  iterate_all_torrents( torrent_statter, (uintptr_t)&stats );
-
-  return sprintf( reply, "%llu\n%llu\nopentracker serving %llu torrents\nopentracker",
-                 stats.peer_count,
-                 stats.seed_count,
-                 stats.torrent_count
+  ot_stats_counters c;
+  stats_counters_sum( &c );
+  return sprintf( reply, "%llu\n%llu\nopentracker serving %zd torrents\nopentracker",
+                 c.peers,
+                 c.seeds,
+                 mutex_get_torrent_count()
                  );
 }
 
@@ -434,44 +1049,476 @@ static size_t stats_torrents_mrtg( char * reply )
 }
 
 static size_t stats_httperrors_txt ( char * reply ) {
+  ot_stats_counters c;
+  stats_counters_sum( &c );
   return sprintf( reply, "302 RED %llu\n400 ... %llu\n400 PAR %llu\n400 COM %llu\n403 IP  %llu\n404 INV %llu\n500 SRV %llu\n",
-                 ot_failed_request_counts[0], ot_failed_request_counts[1], ot_failed_request_counts[2],
-                 ot_failed_request_counts[3], ot_failed_request_counts[4], ot_failed_request_counts[5],
-                 ot_failed_request_counts[6] );
+                 c.failed_request_counts[0], c.failed_request_counts[1], c.failed_request_counts[2],
+                 c.failed_request_counts[3], c.failed_request_counts[4], c.failed_request_counts[5],
+                 c.failed_request_counts[6] );
 }
 
 static size_t stats_return_renew_bucket( char * reply ) {
+  ot_stats_counters c;
   char *r = reply;
   int i;
 
+  stats_counters_sum( &c );
   for( i=0; i<OT_PEER_TIMEOUT; ++i )
-    r+=sprintf(r,"%02i %llu\n", i, ot_renewed[i] );
+    r+=sprintf(r,"%02i %llu\n", i, c.renewed[i] );
   return r - reply;
 }
 
 static size_t stats_return_sync_mrtg( char * reply ) {
+	ot_stats_counters c;
 	ot_time t = time( NULL ) - ot_start_time;
+	stats_counters_sum( &c );
 	return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker connections, %lu conns/s :: %lu success/s.",
-                 ot_overall_sync_count,
+                 c.overall_sync_count,
                  0LL,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( ot_overall_tcp_connections+ot_overall_udp_connections, t ),
-                 events_per_time( ot_overall_tcp_successfulannounces+ot_overall_udp_successfulannounces+ot_overall_udp_connects, t )
+                 events_per_time( c.overall_tcp_connections+c.overall_udp_connections, t ),
+                 events_per_time( c.overall_tcp_successfulannounces+c.overall_udp_successfulannounces+c.overall_udp_connects, t )
                  );
 }
 
+uint64_t stats_latency_start( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t stats_latency_bucket( uint64_t ns ) {
+  size_t bits, bucket;
+
+  if( ns < ( 1 << OT_LATENCY_SUB_BITS ) )
+    return ns;
+  bits   = 63 - __builtin_clzll( ns );
+  bucket = ( ( bits - OT_LATENCY_SUB_BITS + 1 ) << OT_LATENCY_SUB_BITS ) + ( ( ns >> ( bits - OT_LATENCY_SUB_BITS ) ) & ( ( 1 << OT_LATENCY_SUB_BITS ) - 1 ) );
+  return bucket < OT_LATENCY_BUCKETS ? bucket : OT_LATENCY_BUCKETS - 1;
+}
+
+/* The largest value that falls into a bucket */
+static uint64_t stats_latency_bucket_top( size_t bucket ) {
+  size_t bits = ( bucket >> OT_LATENCY_SUB_BITS ) + OT_LATENCY_SUB_BITS - 1;
+
+  if( bucket < ( 1 << OT_LATENCY_SUB_BITS ) )
+    return bucket;
+  return ( ( (uint64_t)( bucket & ( ( 1 << OT_LATENCY_SUB_BITS ) - 1 ) ) + ( 1 << OT_LATENCY_SUB_BITS ) + 1 ) << ( bits - OT_LATENCY_SUB_BITS ) ) - 1;
+}
+
+static const char *ot_latency_names[LATENCY_COUNT] = { "tcp_announce", "tcp_scrape", "udp_connect", "udp_announce", "udp_scrape", "fullscrape", "stats" };
+static const double ot_latency_quantiles[] = { 0.5, 0.99, 0.999 };
+#define OT_LATENCY_QUANTILES ( sizeof(ot_latency_quantiles) / sizeof(*ot_latency_quantiles) )
+
+/* Fills in the top of the bucket each quantile falls into, returns the
+   number of samples */
+static unsigned long long stats_latency_quantiles( unsigned long long *histogram, uint64_t *values ) {
+  unsigned long long count = 0, seen = 0;
+  size_t q, bucket;
+
+  for( bucket=0; bucket<OT_LATENCY_BUCKETS; ++bucket )
+    count += histogram[bucket];
+  for( q=0, bucket=0; count && q<OT_LATENCY_QUANTILES; ++q ) {
+    unsigned long long rank = (unsigned long long)( ot_latency_quantiles[q] * count + 0.999999 );
+    while( seen + histogram[bucket] < rank )
+      seen += histogram[bucket++];
+    values[q] = stats_latency_bucket_top( bucket );
+  }
+  return count;
+}
+
+static size_t stats_return_latency( char * reply ) {
+  ot_stats_counters c;
+  uint64_t values[OT_LATENCY_QUANTILES];
+  unsigned long long count;
+  char *r = reply;
+  size_t q;
+  int kind;
+
+  stats_counters_sum( &c );
+  r += sprintf( r, "%-14s %12s %12s %12s %12s\n", "latency in us", "count", "p50", "p99", "p999" );
+  for( kind=0; kind<LATENCY_COUNT; ++kind ) {
+    count = stats_latency_quantiles( c.latency[kind], values );
+    r += sprintf( r, "%-14s %12llu", ot_latency_names[kind], count );
+    for( q=0; q<OT_LATENCY_QUANTILES; ++q )
+      if( count )
+        r += sprintf( r, " %12.1f", values[q] / 1000.0 );
+      else
+        r += sprintf( r, " %12s", "-" );
+    r += sprintf( r, "\n" );
+  }
+  return r - reply;
+}
+
+/* Bucket lock wait and hold times by class of the holder, followed by
+   the buckets with the longest waits and holds */
+static size_t stats_return_locks( char * reply ) {
+  char *r = reply;
+#ifdef WANT_LOCK_STATS
+  ot_stats_counters c;
+  uint64_t values[OT_LATENCY_QUANTILES];
+  unsigned long long count;
+  size_t q;
+  int lock_class, hold;
+
+  stats_counters_sum( &c );
+  r += sprintf( r, "%-16s %12s %12s %12s %12s\n", "bucket locks, us", "count", "p50", "p99", "p999" );
+  for( hold=0; hold<2; ++hold )
+    for( lock_class=0; lock_class<LOCK_CLASS_COUNT; ++lock_class ) {
+      count = stats_latency_quantiles( hold ? c.lock_hold[lock_class] : c.lock_wait[lock_class], values );
+      if( !count )
+        continue;
+      r += sprintf( r, "%-11s %-4s %12llu", g_lock_class_names[lock_class], hold ? "hold" : "wait", count );
+      for( q=0; q<OT_LATENCY_QUANTILES; ++q )
+        r += sprintf( r, " %12.1f", values[q] / 1000.0 );
+      r += sprintf( r, "\n" );
+    }
+  r += sprintf( r, "\n" );
+#endif
+  r += mutex_bucket_return_lock_stats( r, 16 );
+  return r - reply;
+}
+
+/* Sampled announces. One in g_trace_sample announces on each thread notes
+   when it passed each phase, see ot_trace_phase. Finished samples go to a
+   ring without a lock: writers claim a slot with an atomic add and mark
+   it complete with its sequence number, readers skip slots that change
+   while they copy them. */
+#define OT_TRACE_RING 256
+typedef struct {
+  uint64_t   seq;                        /* Claim number plus one, 0 while written */
+  time_t     when;
+  PROTO_FLAG proto;
+  uint64_t   phases[TRACE_PHASE_COUNT];
+} ot_trace_sample;
+
+unsigned int                 g_trace_sample = 1000;
+static ot_trace_sample       ot_trace_ring[OT_TRACE_RING];
+static uint64_t              ot_trace_claimed;
+static __thread unsigned int ot_trace_countdown;
+
+void stats_trace_begin( struct ot_workstruct *ws, PROTO_FLAG proto ) {
+  ws->traced = 0;
+  if( !g_trace_sample || ++ot_trace_countdown < g_trace_sample )
+    return;
+  ot_trace_countdown = 0;
+  memset( ws->trace, 0, sizeof( ws->trace ) );
+  ws->trace[TRACE_READ]   = ws->request_start;
+  ws->trace[TRACE_PARSED] = stats_latency_start( );
+  ws->trace_proto = proto;
+  ws->traced = 1;
+}
+
+void stats_trace_phase( struct ot_workstruct *ws, ot_trace_phase phase ) {
+  if( ws->traced )
+    ws->trace[phase] = stats_latency_start( );
+}
+
+void stats_trace_end( struct ot_workstruct *ws ) {
+  ot_trace_sample *sample;
+  uint64_t         claim;
+
+  if( !ws->traced )
+    return;
+  ws->trace[TRACE_WRITTEN] = stats_latency_start( );
+  ws->traced = 0;
+
+  claim  = __atomic_fetch_add( &ot_trace_claimed, 1, __ATOMIC_RELAXED );
+  sample = ot_trace_ring + claim % OT_TRACE_RING;
+  __atomic_store_n( &sample->seq, 0, __ATOMIC_RELAXED );
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+  sample->when  = g_now_seconds;
+  sample->proto = ws->trace_proto;
+  memcpy( sample->phases, ws->trace, sizeof( ws->trace ) );
+  __atomic_store_n( &sample->seq, claim + 1, __ATOMIC_RELEASE );
+}
+
+/* The samples in the ring, newest first, times since the request was read */
+static size_t stats_return_traces( char * reply ) {
+  static const char *phase_names[TRACE_PHASE_COUNT] = { "read", "parsed", "locked", "selected", "unlocked", "written" };
+  uint64_t claimed = __atomic_load_n( &ot_trace_claimed, __ATOMIC_ACQUIRE ), claim;
+  char    *r = reply;
+  int      phase;
+
+  r += sprintf( r, "Sampled announces, one in %u per thread, times in us since the request was read:\n%-5s %6s", g_trace_sample, "proto", "age" );
+  for( phase=TRACE_PARSED; phase<TRACE_PHASE_COUNT; ++phase )
+    r += sprintf( r, " %10s", phase_names[phase] );
+  r += sprintf( r, "\n" );
+
+  for( claim=claimed; claim && claim + OT_TRACE_RING > claimed; --claim ) {
+    ot_trace_sample *slot = ot_trace_ring + ( claim - 1 ) % OT_TRACE_RING, sample;
+    if( __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE ) != claim )
+      continue;
+    memcpy( &sample, slot, sizeof( sample ) );
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    if( __atomic_load_n( &slot->seq, __ATOMIC_RELAXED ) != claim )
+      continue;
+    r += sprintf( r, "%-5s %6llu", sample.proto == FLAG_UDP ? "udp" : "tcp", (unsigned long long)( g_now_seconds - sample.when ) );
+    for( phase=TRACE_PARSED; phase<TRACE_PHASE_COUNT; ++phase )
+      if( sample.phases[phase] )
+        r += sprintf( r, " %10.1f", ( sample.phases[phase] - sample.phases[TRACE_READ] ) / 1000.0 );
+      else
+        r += sprintf( r, " %10s", "-" );
+    r += sprintf( r, "\n" );
+  }
+  return r - reply;
+}
+
+/* Shape of the torrent store, gathered by the clean workers as they pass
+   over each bucket anyway and published when a cycle is complete. Each
+   cleaner shard fills its own pending shape, they are summed up when
+   publishing. Counts are kept in power of two classes: class 0 holds 0,
+   class n holds values from 2^(n-1) to 2^n-1. */
+#define OT_SHAPE_CLASSES 24
+typedef struct {
+  time_t             finished;
+  unsigned long long walked;          /* Buckets looked at */
+  unsigned long long torrents;
+  unsigned long long peers;
+  unsigned long long bucketed;        /* Torrents with bucketed peer lists */
+  unsigned long long peer_vectors;
+  size_t             bucket_min, bucket_max;
+  unsigned long long buckets[OT_SHAPE_CLASSES];  /* Buckets by torrents held */
+  unsigned long long swarms[OT_SHAPE_CLASSES];   /* Torrents by peers */
+  unsigned long long slack[OT_SHAPE_CLASSES];    /* Peer vectors by unused slots */
+  unsigned long long torrent_bytes, torrent_slack;
+  unsigned long long peerlist_bytes;
+  unsigned long long peer_bytes, peer_slack;
+  unsigned long long peer_bucket_bytes;          /* ot_vector arrays of bucketed lists */
+} ot_shape;
+
+static ot_shape ot_shape_pending[OT_CLEAN_MAX_THREADS];
+static ot_shape ot_shape_published;
+static pthread_mutex_t ot_shape_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int stats_shape_class( size_t value ) {
+  int shape_class = 0;
+  while( value && shape_class < OT_SHAPE_CLASSES - 1 ) {
+    value >>= 1;
+    ++shape_class;
+  }
+  return shape_class;
+}
+
+/* Called by clean worker shard with the bucket still locked */
+void stats_shape_bucket( int shard, ot_vector *torrents_list ) {
+  ot_shape   *s = ot_shape_pending + shard;
+  ot_torrent *torrents = (ot_torrent*)torrents_list->data;
+  size_t      i;
+
+  ++s->buckets[ stats_shape_class( torrents_list->size ) ];
+  if( !s->walked++ || torrents_list->size < s->bucket_min ) s->bucket_min = torrents_list->size;
+  if( torrents_list->size > s->bucket_max ) s->bucket_max = torrents_list->size;
+  s->torrents      += torrents_list->size;
+  s->torrent_bytes += torrents_list->space * sizeof( ot_torrent );
+  s->torrent_slack += ( torrents_list->space - torrents_list->size ) * sizeof( ot_torrent );
+
+  for( i=0; i<torrents_list->size; ++i ) {
+    ot_peerlist *peer_list   = torrents[i].peer_list;
+    ot_vector   *bucket_list = &peer_list->peers;
+    size_t       num_buckets = 1;
+
+    s->peers          += peer_list->peer_count;
+    s->peerlist_bytes += sizeof( ot_peerlist );
+    ++s->swarms[ stats_shape_class( peer_list->peer_count ) ];
+
+    if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
+      num_buckets  = bucket_list->size;
+      bucket_list  = (ot_vector *)bucket_list->data;
+      s->peer_bucket_bytes += num_buckets * sizeof( ot_vector );
+      ++s->bucketed;
+    }
+
+    while( num_buckets-- ) {
+      size_t unused = bucket_list->space - bucket_list->size;
+      ++s->peer_vectors;
+      ++s->slack[ stats_shape_class( unused ) ];
+      s->peer_bytes += bucket_list->space * sizeof( ot_peer );
+      s->peer_slack += unused * sizeof( ot_peer );
+      ++bucket_list;
+    }
+  }
+}
+
+static void stats_shape_merge( ot_shape *sum, const ot_shape *s ) {
+  int shape_class;
+  if( !s->walked )
+    return;
+  if( !sum->walked || s->bucket_min < sum->bucket_min ) sum->bucket_min = s->bucket_min;
+  if( s->bucket_max > sum->bucket_max ) sum->bucket_max = s->bucket_max;
+  sum->walked            += s->walked;
+  sum->torrents          += s->torrents;
+  sum->peers             += s->peers;
+  sum->bucketed          += s->bucketed;
+  sum->peer_vectors      += s->peer_vectors;
+  sum->torrent_bytes     += s->torrent_bytes;
+  sum->torrent_slack     += s->torrent_slack;
+  sum->peerlist_bytes    += s->peerlist_bytes;
+  sum->peer_bytes        += s->peer_bytes;
+  sum->peer_slack        += s->peer_slack;
+  sum->peer_bucket_bytes += s->peer_bucket_bytes;
+  for( shape_class=0; shape_class<OT_SHAPE_CLASSES; ++shape_class ) {
+    sum->buckets[shape_class] += s->buckets[shape_class];
+    sum->swarms[shape_class]  += s->swarms[shape_class];
+    sum->slack[shape_class]   += s->slack[shape_class];
+  }
+}
+
+/* Called by the last clean worker shard to finish its part of a cycle,
+   while all others wait for the next one to start */
+void stats_shape_publish( int shards ) {
+  ot_shape sum;
+  int      shard;
+
+  memset( &sum, 0, sizeof( ot_shape ) );
+  for( shard=0; shard<shards; ++shard )
+    stats_shape_merge( &sum, ot_shape_pending + shard );
+  memset( ot_shape_pending, 0, sizeof( ot_shape_pending ) );
+  sum.finished = time( NULL );
+
+  pthread_mutex_lock( &ot_shape_mutex );
+  memcpy( &ot_shape_published, &sum, sizeof( ot_shape ) );
+  pthread_mutex_unlock( &ot_shape_mutex );
+}
+
+static char *stats_shape_histogram( char *r, const char *title, const unsigned long long *histogram ) {
+  int shape_class;
+  r += sprintf( r, "\n%-16s %12s\n", title, "count" );
+  for( shape_class=0; shape_class<OT_SHAPE_CLASSES; ++shape_class ) {
+    char range[32];
+    if( !histogram[shape_class] )
+      continue;
+    if( shape_class < 2 )
+      sprintf( range, "%d", shape_class );
+    else if( shape_class == OT_SHAPE_CLASSES - 1 )
+      sprintf( range, "%llu+", 1ULL << ( shape_class - 1 ) );
+    else
+      sprintf( range, "%llu-%llu", 1ULL << ( shape_class - 1 ), ( 1ULL << shape_class ) - 1 );
+    r += sprintf( r, "%-16s %12llu\n", range, histogram[shape_class] );
+  }
+  return r;
+}
+
+static size_t stats_return_shape( char * reply ) {
+  ot_shape s;
+  char *r = reply;
+
+  pthread_mutex_lock( &ot_shape_mutex );
+  memcpy( &s, &ot_shape_published, sizeof( ot_shape ) );
+  pthread_mutex_unlock( &ot_shape_mutex );
+
+  if( !s.finished )
+    return sprintf( r, "No clean pass has completed yet, the first one takes about %u seconds.\n", g_clean_cycle );
+
+  r += sprintf( r, "As of the clean pass finished %llu seconds ago:\n", (unsigned long long)( time( NULL ) - s.finished ) );
+  r += sprintf( r, "%llu torrents with %llu peers in %d buckets, %zu to %zu torrents per bucket\n",
+                s.torrents, s.peers, OT_BUCKET_COUNT, s.bucket_min, s.bucket_max );
+  r += sprintf( r, "%llu torrents with bucketed peer lists, %llu peer vectors\n\n", s.bucketed, s.peer_vectors );
+
+  r += sprintf( r, "%-20s %14s %14s\n", "bytes", "allocated", "unused" );
+  r += sprintf( r, "%-20s %14llu %14llu\n", "torrent vectors", s.torrent_bytes, s.torrent_slack );
+  r += sprintf( r, "%-20s %14llu %14s\n",   "peer lists", s.peerlist_bytes, "-" );
+  r += sprintf( r, "%-20s %14llu %14llu\n", "peer vectors", s.peer_bytes, s.peer_slack );
+  r += sprintf( r, "%-20s %14llu %14s\n",   "peer bucket arrays", s.peer_bucket_bytes, "-" );
+  r += sprintf( r, "%-20s %14llu %14llu\n", "total",
+                s.torrent_bytes + s.peerlist_bytes + s.peer_bytes + s.peer_bucket_bytes, s.torrent_slack + s.peer_slack );
+
+  r = stats_shape_histogram( r, "torrents/bucket", s.buckets );
+  r = stats_shape_histogram( r, "peers/torrent", s.swarms );
+  r = stats_shape_histogram( r, "unused peer slots", s.slack );
+  return r - reply;
+}
+
+static char *stats_metric_family( char *r, const char *name, const char *type, const char *help ) {
+  return r + sprintf( r, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help );
+}
+
+/* OpenMetrics text for monitoring systems polling us every few seconds.
+   Only reads the summed counters, including the peer totals, and the
+   torrent count maintained by the bucket locks. It never walks the
+   torrents. */
+static size_t stats_return_metrics( char * reply ) {
+  ot_stats_counters c;
+  uint64_t values[OT_LATENCY_QUANTILES];
+  unsigned long long count;
+  char *r = reply;
+  size_t q;
+  int i;
+
+  stats_counters_sum( &c );
+
+  r = stats_metric_family( r, "opentracker_uptime_seconds", "gauge", "Seconds since the tracker started." );
+  r += sprintf( r, "opentracker_uptime_seconds %llu\n", (unsigned long long)( time( NULL ) - ot_start_time ) );
+  r = stats_metric_family( r, "opentracker_torrents", "gauge", "Torrents tracked." );
+  r += sprintf( r, "opentracker_torrents %zu\n", mutex_get_torrent_count( ) );
+  r = stats_metric_family( r, "opentracker_peers", "gauge", "Peers on all torrents." );
+  r += sprintf( r, "opentracker_peers %llu\n", c.peers );
+  r = stats_metric_family( r, "opentracker_seeds", "gauge", "Seeding peers on all torrents." );
+  r += sprintf( r, "opentracker_seeds %llu\n", c.seeds );
+
+  r = stats_metric_family( r, "opentracker_connections", "counter", "Requests accepted." );
+  r += sprintf( r, "opentracker_connections_total{proto=\"tcp\"} %llu\n", c.overall_tcp_connections );
+  r += sprintf( r, "opentracker_connections_total{proto=\"udp\"} %llu\n", c.overall_udp_connections );
+  r = stats_metric_family( r, "opentracker_announces", "counter", "Announces answered." );
+  r += sprintf( r, "opentracker_announces_total{proto=\"tcp\"} %llu\n", c.overall_tcp_successfulannounces );
+  r += sprintf( r, "opentracker_announces_total{proto=\"udp\"} %llu\n", c.overall_udp_successfulannounces );
+  r = stats_metric_family( r, "opentracker_scrapes", "counter", "Scrapes answered." );
+  r += sprintf( r, "opentracker_scrapes_total{proto=\"tcp\"} %llu\n", c.overall_tcp_successfulscrapes );
+  r += sprintf( r, "opentracker_scrapes_total{proto=\"udp\"} %llu\n", c.overall_udp_successfulscrapes );
+  r = stats_metric_family( r, "opentracker_udp_connects", "counter", "UDP connection ids handed out." );
+  r += sprintf( r, "opentracker_udp_connects_total %llu\n", c.overall_udp_connects );
+  r = stats_metric_family( r, "opentracker_udp_connection_id_mismatches", "counter", "UDP requests with an invalid connection id." );
+  r += sprintf( r, "opentracker_udp_connection_id_mismatches_total %llu\n", c.overall_udp_connectionidmissmatches );
+  r = stats_metric_family( r, "opentracker_completed", "counter", "Downloads reported completed." );
+  r += sprintf( r, "opentracker_completed_total %llu\n", c.overall_completed );
+
+  r = stats_metric_family( r, "opentracker_fullscrape_requests", "counter", "Full scrapes requested." );
+  r += sprintf( r, "opentracker_fullscrape_requests_total %llu\n", c.full_scrape_request_count );
+  r = stats_metric_family( r, "opentracker_fullscrapes", "counter", "Full scrapes sent." );
+  r += sprintf( r, "opentracker_fullscrapes_total %llu\n", c.full_scrape_count );
+  r = stats_metric_family( r, "opentracker_fullscrape_bytes", "counter", "Bytes of full scrapes sent." );
+  r += sprintf( r, "opentracker_fullscrape_bytes_total %llu\n", c.full_scrape_size );
+
+  r = stats_metric_family( r, "opentracker_http_errors", "counter", "HTTP requests answered with an error." );
+  for( i=0; i<CODE_HTTPERROR_COUNT; ++i )
+    r += sprintf( r, "opentracker_http_errors_total{code=\"%.3s\",reason=\"%s\"} %llu\n",
+                  ot_failed_request_names[i], ot_failed_request_names[i] + 4, c.failed_request_counts[i] );
+  r = stats_metric_family( r, "opentracker_peer_renewals", "counter", "Peers announcing again, by minutes since their last announce." );
+  for( i=0; i<OT_PEER_TIMEOUT; ++i )
+    r += sprintf( r, "opentracker_peer_renewals_total{minutes=\"%d\"} %llu\n", i, c.renewed[i] );
+  r = stats_metric_family( r, "opentracker_livesync_peers", "counter", "Peers received by live sync." );
+  r += sprintf( r, "opentracker_livesync_peers_total %llu\n", c.overall_sync_count );
+  r = stats_metric_family( r, "opentracker_bucket_stalls", "counter", "Waits for a torrent bucket locked by another thread." );
+  r += sprintf( r, "opentracker_bucket_stalls_total %llu\n", c.overall_stall_count );
+
+  r = stats_metric_family( r, "opentracker_request_latency_seconds", "summary", "Time from parsing a request to handing off its answer." );
+  for( i=0; i<LATENCY_COUNT; ++i ) {
+    count = stats_latency_quantiles( c.latency[i], values );
+    for( q=0; count && q<OT_LATENCY_QUANTILES; ++q )
+      r += sprintf( r, "opentracker_request_latency_seconds{request=\"%s\",quantile=\"%g\"} %.9f\n", ot_latency_names[i], ot_latency_quantiles[q], values[q] / 1e9 );
+    r += sprintf( r, "opentracker_request_latency_seconds_sum{request=\"%s\"} %.9f\n", ot_latency_names[i], c.latency_sum[i] / 1e9 );
+    r += sprintf( r, "opentracker_request_latency_seconds_count{request=\"%s\"} %llu\n", ot_latency_names[i], count );
+  }
+
+  r += mutex_workqueue_return_metrics( r );
+  r += sprintf( r, "# EOF\n" );
+  return r - reply;
+}
+
 static size_t stats_return_completed_mrtg( char * reply ) {
+  ot_stats_counters c;
   ot_time t = time( NULL ) - ot_start_time;
 
+  stats_counters_sum( &c );
   return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker, %lu completed/h.",
-                 ot_overall_completed,
+                 c.overall_completed,
                  0LL,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( ot_overall_completed, t / 3600 )
+                 events_per_time( c.overall_completed, t / 3600 )
                  );
 }
 
@@ -519,10 +1566,12 @@ static void stats_return_fulllog( int *iovec_entries, struct iovec **iovector, c
 #endif
 
 static size_t stats_return_everything( char * reply ) {
+  ot_stats_counters c;
   torrent_stats stats = {0,0,0};
   int i;
   char * r = reply;
 
+  stats_counters_sum( &c );
   iterate_all_torrents( torrent_statter, (uintptr_t)&stats );
 
   r += sprintf( r, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n" );
@@ -536,22 +1585,22 @@ static size_t stats_return_everything( char * reply ) {
   r += sprintf( r, "  </torrents>\n" );
   r += sprintf( r, "  <peers>\n    <count>%llu</count>\n  </peers>\n", stats.peer_count );
   r += sprintf( r, "  <seeds>\n    <count>%llu</count>\n  </seeds>\n", stats.seed_count );
-  r += sprintf( r, "  <completed>\n    <count>%llu</count>\n  </completed>\n", ot_overall_completed );
+  r += sprintf( r, "  <completed>\n    <count>%llu</count>\n  </completed>\n", c.overall_completed );
   r += sprintf( r, "  <connections>\n" );
-  r += sprintf( r, "    <tcp>\n      <accept>%llu</accept>\n      <announce>%llu</announce>\n      <scrape>%llu</scrape>\n    </tcp>\n", ot_overall_tcp_connections, ot_overall_tcp_successfulannounces, ot_overall_udp_successfulscrapes );
-  r += sprintf( r, "    <udp>\n      <overall>%llu</overall>\n      <connect>%llu</connect>\n      <announce>%llu</announce>\n      <scrape>%llu</scrape>\n      <missmatch>%llu</missmatch>\n    </udp>\n", ot_overall_udp_connections, ot_overall_udp_connects, ot_overall_udp_successfulannounces, ot_overall_udp_successfulscrapes, ot_overall_udp_connectionidmissmatches );
-  r += sprintf( r, "    <livesync>\n      <count>%llu</count>\n    </livesync>\n", ot_overall_sync_count );
+  r += sprintf( r, "    <tcp>\n      <accept>%llu</accept>\n      <announce>%llu</announce>\n      <scrape>%llu</scrape>\n    </tcp>\n", c.overall_tcp_connections, c.overall_tcp_successfulannounces, c.overall_udp_successfulscrapes );
+  r += sprintf( r, "    <udp>\n      <overall>%llu</overall>\n      <connect>%llu</connect>\n      <announce>%llu</announce>\n      <scrape>%llu</scrape>\n      <missmatch>%llu</missmatch>\n    </udp>\n", c.overall_udp_connections, c.overall_udp_connects, c.overall_udp_successfulannounces, c.overall_udp_successfulscrapes, c.overall_udp_connectionidmissmatches );
+  r += sprintf( r, "    <livesync>\n      <count>%llu</count>\n    </livesync>\n", c.overall_sync_count );
   r += sprintf( r, "  </connections>\n" );
   r += sprintf( r, "  <debug>\n" );
   r += sprintf( r, "    <renew>\n" );
   for( i=0; i<OT_PEER_TIMEOUT; ++i )
-    r += sprintf( r, "      <count interval=\"%02i\">%llu</count>\n", i, ot_renewed[i] );
+    r += sprintf( r, "      <count interval=\"%02i\">%llu</count>\n", i, c.renewed[i] );
   r += sprintf( r, "    </renew>\n" );
   r += sprintf( r, "    <http_error>\n" );
   for( i=0; i<CODE_HTTPERROR_COUNT; ++i )
-    r += sprintf( r, "      <count code=\"%s\">%llu</count>\n", ot_failed_request_names[i], ot_failed_request_counts[i] );
+    r += sprintf( r, "      <count code=\"%s\">%llu</count>\n", ot_failed_request_names[i], c.failed_request_counts[i] );
   r += sprintf( r, "    </http_error>\n" );
-  r += sprintf( r, "    <mutex_stall>\n      <count>%llu</count>\n    </mutex_stall>\n", ot_overall_stall_count );
+  r += sprintf( r, "    <mutex_stall>\n      <count>%llu</count>\n    </mutex_stall>\n", c.overall_stall_count );
   r += sprintf( r, "  </debug>\n" );
   r += sprintf( r, "</stats>" );
   return r - reply;
@@ -560,15 +1609,15 @@ static size_t stats_return_everything( char * reply ) {
 extern const char
 *g_version_opentracker_c, *g_version_accesslist_c, *g_version_clean_c, *g_version_fullscrape_c, *g_version_http_c,
 *g_version_iovec_c, *g_version_mutex_c, *g_version_stats_c, *g_version_udp_c, *g_version_vector_c,
-*g_version_scan_urlencoded_query_c, *g_version_trackerlogic_c, *g_version_livesync_c, *g_version_rijndael_c,
-*g_version_persist_c;
+*g_version_scan_urlencoded_query_c, *g_version_trackerlogic_c, *g_version_livesync_c,
+*g_version_persist_c, *g_version_connid_c, *g_version_uring_c;
 
 size_t stats_return_tracker_version( char *reply ) {
-  return sprintf( reply, "%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s",
+  return sprintf( reply, "%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s",
                  g_version_opentracker_c, g_version_accesslist_c, g_version_clean_c, g_version_fullscrape_c, g_version_http_c,
                  g_version_iovec_c, g_version_mutex_c, g_version_stats_c, g_version_udp_c, g_version_vector_c,
-                 g_version_scan_urlencoded_query_c, g_version_trackerlogic_c, g_version_livesync_c, g_version_rijndael_c,
-                 g_version_persist_c);
+                 g_version_scan_urlencoded_query_c, g_version_trackerlogic_c, g_version_livesync_c,
+                 g_version_persist_c, g_version_connid_c, g_version_uring_c );
 }
 
 size_t return_stats_for_tracker( char *reply, int mode, int format ) {
@@ -594,6 +1643,24 @@ size_t return_stats_for_tracker( char *reply, int mode, int format ) {
       return stats_return_renew_bucket( reply );
     case TASK_STATS_SYNCS:
       return stats_return_sync_mrtg( reply );
+    case TASK_STATS_UDP_WORKERS:
+      return udp_return_worker_stats( reply );
+    case TASK_STATS_TASKS:
+      return mutex_workqueue_return_stats( reply );
+    case TASK_STATS_IOVEC_POOL:
+      return iovec_pool_return_stats( reply );
+    case TASK_STATS_LATENCY:
+      return stats_return_latency( reply );
+    case TASK_STATS_LOCKS:
+      return stats_return_locks( reply );
+    case TASK_STATS_SHAPE:
+      return stats_return_shape( reply );
+    case TASK_STATS_CLEAN:
+      return clean_return_stats( reply );
+#ifdef WANT_FULLSCRAPE
+    case TASK_STATS_FULLSCRAPE_CACHE:
+      return fullscrape_cache_return_stats( reply );
+#endif
 #ifdef WANT_LOG_NUMWANT
     case TASK_STATS_NUMWANTS:
       return stats_return_numwants( reply );
@@ -603,9 +1670,11 @@ size_t return_stats_for_tracker( char *reply, int mode, int format ) {
   }
 }
 
-static void stats_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode ) {
+static void stats_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode, const void *taskarg, ot_taskid taskid ) {
+  uint64_t started = stats_latency_start( );
   char *r;
 
+  (void)taskarg; (void)taskid;
   *iovec_entries = 0;
   *iovector      = NULL;
   if( !( r = iovec_increase( iovec_entries, iovector, OT_STATS_TMPSIZE ) ) )
@@ -614,15 +1683,27 @@ static void stats_make( int *iovec_entries, struct iovec **iovector, ot_tasktype
   switch( mode & TASK_TASK_MASK ) {
     case TASK_STATS_TORRENTS:    r += stats_torrents_mrtg( r );             break;
     case TASK_STATS_PEERS:       r += stats_peers_mrtg( r );                break;
-    case TASK_STATS_SLASH24S:    r += stats_slash24s_txt( r, 128 );         break;
+    case TASK_STATS_SLASH24S:    r += stats_return_busy_networks( r, SKETCH_NETWORKS, 128 ); break;
     case TASK_STATS_TOP10:       r += stats_top_txt( r, 10 );               break;
     case TASK_STATS_TOP100:
                                  r = iovec_fix_increase_or_free( iovec_entries, iovector, r, 4 * OT_STATS_TMPSIZE );
                                  if( !r ) return;
                                  r += stats_top_txt( r, 100 );              break;
     case TASK_STATS_EVERYTHING:  r += stats_return_everything( r );         break;
+    case TASK_STATS_TRACES:
+                                 r = iovec_fix_increase_or_free( iovec_entries, iovector, r, 4 * OT_STATS_TMPSIZE );
+                                 if( !r ) return;
+                                 r += stats_return_traces( r );             break;
+    case TASK_STATS_COSTS:
+                                 r = iovec_fix_increase_or_free( iovec_entries, iovector, r, 4 * OT_STATS_TMPSIZE );
+                                 if( !r ) return;
+                                 r += stats_return_costs( r, 64 );          break;
+    case TASK_STATS_METRICS:
+                                 r = iovec_fix_increase_or_free( iovec_entries, iovector, r, 4 * OT_STATS_TMPSIZE );
+                                 if( !r ) return;
+                                 r += stats_return_metrics( r );            break;
 #ifdef WANT_SPOT_WOODPECKER
-    case TASK_STATS_WOODPECKERS: r += stats_return_woodpeckers( r, 128 );   break;
+    case TASK_STATS_WOODPECKERS: r += stats_return_busy_networks( r, SKETCH_WOODPECKERS, 128 ); break;
 #endif
 #ifdef WANT_FULLLOG_NETWORKS
     case TASK_STATS_FULLLOG:      stats_return_fulllog( iovec_entries, iovector, r );
@@ -633,21 +1714,26 @@ static void stats_make( int *iovec_entries, struct iovec **iovector, ot_tasktype
       return;
   }
   iovec_fixlast( iovec_entries, iovector, r );
+  stats_issue_latency( LATENCY_STATS, started );
 }
 
 void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event_data ) {
+  ot_stats_slot *c = stats_counters_mine( );
+
   switch( event ) {
     case EVENT_ACCEPT:
-      if( proto == FLAG_TCP ) ot_overall_tcp_connections++; else ot_overall_udp_connections++;
+      if( proto == FLAG_TCP ) STATS_INC( c, overall_tcp_connections ); else STATS_INC( c, overall_udp_connections );
 #ifdef WANT_LOG_NETWORKS
       stat_increase_network_count( &stats_network_counters_root, 0, event_data );
 #endif
       break;
     case EVENT_ANNOUNCE:
-      if( proto == FLAG_TCP ) ot_overall_tcp_successfulannounces++; else ot_overall_udp_successfulannounces++;
+      if( proto == FLAG_TCP ) STATS_INC( c, overall_tcp_successfulannounces ); else STATS_INC( c, overall_udp_successfulannounces );
+      stats_sketch_issue( c, SKETCH_NETWORKS, (const uint8_t *)event_data, 1 );
+      stats_sketch_charge( c, SKETCH_COST_ANNOUNCES, 1 );
       break;
     case EVENT_CONNECT:
-      if( proto == FLAG_TCP ) ot_overall_tcp_connects++; else ot_overall_udp_connects++;
+      if( proto == FLAG_TCP ) STATS_INC( c, overall_tcp_connects ); else STATS_INC( c, overall_udp_connects );
       break;
     case EVENT_COMPLETED:
 #ifdef WANT_SYSLOGS
@@ -677,13 +1763,14 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
         syslog( LOG_INFO, "time=%s event=completed info_hash=%s peer_id=%s ip=%s", timestring, hash_hex, peerid_hex, ip_readable );
       }
 #endif
-      ot_overall_completed++;
+      STATS_INC( c, overall_completed );
       break;
     case EVENT_SCRAPE:
-      if( proto == FLAG_TCP ) ot_overall_tcp_successfulscrapes++; else ot_overall_udp_successfulscrapes++;
+      if( proto == FLAG_TCP ) STATS_INC( c, overall_tcp_successfulscrapes ); else STATS_INC( c, overall_udp_successfulscrapes );
+      stats_sketch_charge( c, SKETCH_COST_SCRAPES, 1 );
     case EVENT_FULLSCRAPE:
-      ot_full_scrape_count++;
-      ot_full_scrape_size += event_data;
+      STATS_INC( c, full_scrape_count );
+      STATS_ADD( c, full_scrape_size, event_data );
       break;
     case EVENT_FULLSCRAPE_REQUEST:
     {
@@ -693,7 +1780,8 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
       off += fmt_ip6c( _debug+off, *ip );
       off += snprintf( _debug+off, sizeof(_debug)-off, " - FULL SCRAPE\n" );
       write( 2, _debug, off );
-      ot_full_scrape_request_count++;
+      STATS_INC( c, full_scrape_request_count );
+      stats_sketch_charge( c, SKETCH_COST_FULLSCRAPES, 1 );
     }
       break;
     case EVENT_FULLSCRAPE_REQUEST_GZIP:
@@ -704,71 +1792,83 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
       off += fmt_ip6c(_debug+off, *ip );
       off += snprintf( _debug+off, sizeof(_debug)-off, " - FULL SCRAPE\n" );
       write( 2, _debug, off );
-      ot_full_scrape_request_count++;
+      STATS_INC( c, full_scrape_request_count );
+      stats_sketch_charge( c, SKETCH_COST_FULLSCRAPES, 1 );
     }
       break;
     case EVENT_FAILED:
-      ot_failed_request_counts[event_data]++;
+      STATS_INC( c, failed_request_counts[event_data] );
+      stats_sketch_charge( c, SKETCH_COST_ERRORS, 1 );
+      break;
+    case EVENT_SENT:
+      stats_sketch_charge( c, SKETCH_COST_BYTES, event_data );
       break;
     case EVENT_RENEW:
-      ot_renewed[event_data]++;
+      STATS_INC( c, renewed[event_data] );
       break;
     case EVENT_SYNC:
-      ot_overall_sync_count+=event_data;
+      STATS_ADD( c, overall_sync_count, event_data );
 	    break;
     case EVENT_BUCKET_LOCKED:
-      ot_overall_stall_count++;
+      STATS_INC( c, overall_stall_count );
       break;
 #ifdef WANT_SPOT_WOODPECKER
     case EVENT_WOODPECKER:
-      pthread_mutex_lock( &g_woodpeckers_mutex );
-      stat_increase_network_count( &stats_woodpeckers_tree, 0, event_data );
-      pthread_mutex_unlock( &g_woodpeckers_mutex );
+      stats_sketch_issue( c, SKETCH_WOODPECKERS, (const uint8_t *)event_data, 1 );
       break;
 #endif
     case EVENT_CONNID_MISSMATCH:
-      ++ot_overall_udp_connectionidmissmatches;
+      STATS_INC( c, overall_udp_connectionidmissmatches );
+      stats_sketch_charge( c, SKETCH_COST_ERRORS, 1 );
     default:
       break;
   }
 }
 
-void stats_cleanup() {
-#ifdef WANT_SPOT_WOODPECKER
-  pthread_mutex_lock( &g_woodpeckers_mutex );
-  stats_shift_down_network_count( &stats_woodpeckers_tree, 0, 1 );
-  pthread_mutex_unlock( &g_woodpeckers_mutex );
-#endif
+/* Called wherever a peer list's peer_count or seed_count changes, with
+   the bucket still locked */
+void stats_issue_peers( ssize_t peers, ssize_t seeds ) {
+  ot_stats_slot *c = stats_counters_mine( );
+  if( peers ) STATS_ADD( c, peers, (unsigned long long)peers );
+  if( seeds ) STATS_ADD( c, seeds, (unsigned long long)seeds );
 }
 
-static void * stats_worker( void * args ) {
-  int iovec_entries;
-  struct iovec *iovector;
-
-  (void) args;
+#ifdef WANT_LOCK_STATS
+void stats_issue_lock( int lock_class, uint64_t wait_ns, uint64_t hold_ns ) {
+  ot_stats_slot *c = stats_counters_mine( );
+  size_t wait_bucket = stats_latency_bucket( wait_ns ), hold_bucket = stats_latency_bucket( hold_ns );
+  STATS_INC( c, lock_wait[lock_class][wait_bucket] );
+  STATS_INC( c, lock_hold[lock_class][hold_bucket] );
+}
+#endif
 
-  while( 1 ) {
-    ot_tasktype tasktype = TASK_STATS;
-    ot_taskid   taskid   = mutex_workqueue_poptask( &tasktype );
-    stats_make( &iovec_entries, &iovector, tasktype );
-    if( mutex_workqueue_pushresult( taskid, iovec_entries, iovector ) )
-      iovec_free( &iovec_entries, &iovector );
-  }
-  return NULL;
+void stats_issue_latency( ot_latency_kind kind, uint64_t start ) {
+  ot_stats_slot *c = stats_counters_mine( );
+  uint64_t ns = stats_latency_start( ) - start;
+  size_t bucket = stats_latency_bucket( ns );
+  STATS_INC( c, latency[kind][bucket] );
+  STATS_ADD( c, latency_sum[kind], ns );
 }
 
 void stats_deliver( int64 sock, int tasktype ) {
-  mutex_workqueue_pushtask( sock, tasktype );
+  mutex_workqueue_pushtask( sock, tasktype, NULL, 0 );
 }
 
-static pthread_t thread_id;
 void stats_init( ) {
+  int t, s;
+  for( t=0; t<OT_TOP_COUNT; ++t )
+    for( s=0; s<OT_TOP_SHARDS; ++s )
+      pthread_mutex_init( &ot_top_tables[t][s].mutex, NULL );
   ot_start_time = g_now_seconds;
-  pthread_create( &thread_id, NULL, stats_worker, NULL );
+  mutex_workqueue_startworkers( TASK_STATS, stats_make );
 }
 
 void stats_deinit( ) {
-  pthread_cancel( thread_id );
+  int t, s;
+  mutex_workqueue_stopworkers( TASK_STATS );
+  for( t=0; t<OT_TOP_COUNT; ++t )
+    for( s=0; s<OT_TOP_SHARDS; ++s )
+      pthread_mutex_destroy( &ot_top_tables[t][s].mutex );
 }
 
-const char *g_version_stats_c = "$Source: /home/cvsroot/opentracker/ot_stats.c,v $: $Revision: 1.72 $\n";
+const char *g_version_stats_c = "$Source: /home/cvsroot/opentracker/ot_stats.c,v $: $Revision: 1.88 $\n";
@@ -21,7 +21,8 @@ typedef enum {
   EVENT_FAILED,
   EVENT_BUCKET_LOCKED,
   EVENT_WOODPECKER,
-  EVENT_CONNID_MISSMATCH
+  EVENT_CONNID_MISSMATCH,
+  EVENT_SENT          /* Bytes answered to the current requester */
 } ot_status_event;
 
 enum {
@@ -37,12 +38,38 @@ enum {
   CODE_HTTPERROR_COUNT
 };
 
+/* Requests we keep latency histograms for */
+typedef enum {
+  LATENCY_TCP_ANNOUNCE,
+  LATENCY_TCP_SCRAPE,
+  LATENCY_UDP_CONNECT,
+  LATENCY_UDP_ANNOUNCE,
+  LATENCY_UDP_SCRAPE,
+  LATENCY_FULLSCRAPE,
+  LATENCY_STATS,
+
+  LATENCY_COUNT
+} ot_latency_kind;
+
 void   stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event_data );
+void   stats_issue_requester( const ot_ip6 ip );
+void   stats_issue_peers( ssize_t peers, ssize_t seeds );
+void   stats_top_update( ot_torrent *torrent );
+void   stats_top_remove( ot_torrent *torrent );
+uint64_t stats_latency_start( void );
+void   stats_issue_latency( ot_latency_kind kind, uint64_t start );
+void   stats_issue_lock( int lock_class, uint64_t wait_ns, uint64_t hold_ns );
+void   stats_trace_begin( struct ot_workstruct *ws, PROTO_FLAG proto );
+void   stats_trace_phase( struct ot_workstruct *ws, ot_trace_phase phase );
+void   stats_trace_end( struct ot_workstruct *ws );
+void   stats_shape_bucket( int shard, ot_vector *torrents_list );
+void   stats_shape_publish( int shards );
 void   stats_deliver( int64 sock, int tasktype );
-void   stats_cleanup();
 size_t return_stats_for_tracker( char *reply, int mode, int format );
 size_t stats_return_tracker_version( char *reply );
 void   stats_init( );
 void   stats_deinit( );
 
+extern unsigned int g_trace_sample;
+
 #endif
@@ -3,11 +3,18 @@
 
    $id$ */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 /* System */
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
+#include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <stdio.h>
 
 /* Libowfat */
@@ -18,102 +25,82 @@
 #include "trackerlogic.h"
 #include "ot_udp.h"
 #include "ot_stats.h"
-#include "ot_rijndael.h"
+#include "ot_connid.h"
+#include "ot_usdt.h"
 
-static const uint8_t g_static_connid[8] = { 0x23, 0x42, 0x05, 0x17, 0xde, 0x41, 0x50, 0xff };
-static uint32_t g_rijndael_round_key[44] = {0};
-static uint32_t g_key_of_the_hour[2] = {0};
-static ot_time  g_hour_of_the_key;
+static int g_connid_ready;
 
-static void udp_generate_rijndael_round_key() {
-  uint8_t key[16];
-  key[0] = random(); key[1] = random(); key[2] = random(); key[3] = random();
-  rijndaelKeySetupEnc128( g_rijndael_round_key, key );
+/* UDP implementation according to http://xbtt.sourceforge.net/udp_tracker_protocol.html */
+int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
+  ot_ip6      remoteip;
+  uint32_t    scopeid;
+  uint16_t    remoteport;
+  size_t      byte_count, reply_size;
 
-  g_key_of_the_hour[0] = random();
-  g_hour_of_the_key = g_now_minutes;
-}
+  byte_count = socket_recv6( serversocket, ws->inbuf, G_INBUF_SIZE, remoteip, &remoteport, &scopeid );
+  if( !byte_count ) return 0;
 
-/* Generate current and previous connection id for ip */
-static void udp_make_connectionid( uint32_t connid[2], const ot_ip6 remoteip, int age ) {
-  uint32_t plain[4], crypt[4];
-  int i;
-  if( g_now_minutes + 60 > g_hour_of_the_key ) {
-    g_hour_of_the_key = g_now_minutes;
-    g_key_of_the_hour[1] = g_key_of_the_hour[0];
-    g_key_of_the_hour[0] = random();
+  if( ( reply_size = udp_handle_packet( ws, byte_count, remoteip, remoteport ) ) ) {
+    stats_issue_event( EVENT_SENT, FLAG_UDP, reply_size );
+    socket_send6( serversocket, ws->outbuf, reply_size, remoteip, remoteport, 0 );
+    stats_trace_end( ws );
   }
-
-  memcpy( plain, remoteip, sizeof( plain ) );
-  for( i=0; i<4; ++i ) plain[i] ^= g_key_of_the_hour[age];
-  rijndaelEncrypt128( g_rijndael_round_key, (uint8_t*)remoteip, (uint8_t*)crypt );
-  connid[0] = crypt[0] ^ crypt[1];
-  connid[1] = crypt[2] ^ crypt[3];
+  return 1;
 }
 
-/* UDP implementation according to http://xbtt.sourceforge.net/udp_tracker_protocol.html */
-int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
-  ot_ip6      remoteip;
+size_t udp_handle_packet( struct ot_workstruct *ws, size_t byte_count, const ot_ip6 remoteip, uint16_t remoteport ) {
   uint32_t   *inpacket = (uint32_t*)ws->inbuf;
   uint32_t   *outpacket = (uint32_t*)ws->outbuf;
-  uint32_t    numwant, left, event, scopeid;
+  uint32_t    numwant, left, event;
   uint32_t    connid[2];
-  uint16_t    port, remoteport;
-  size_t      byte_count, scrape_count;
-
-  byte_count = socket_recv6( serversocket, ws->inbuf, G_INBUF_SIZE, remoteip, &remoteport, &scopeid );
-  if( !byte_count ) return 0;
+  uint16_t    port;
+  size_t      scrape_count;
 
+  ws->request_start = stats_latency_start( );
+  stats_issue_requester( remoteip );
   stats_issue_event( EVENT_ACCEPT, FLAG_UDP, (uintptr_t)remoteip );
   stats_issue_event( EVENT_READ, FLAG_UDP, byte_count );
 
   /* Minimum udp tracker packet size, also catches error */
   if( byte_count < 16 )
-    return 1;
-
-  /* Generate the connection id we give out and expect to and from
-     the requesting ip address, this prevents udp spoofing */
-  udp_make_connectionid( connid, remoteip, 0 );
+    return 0;
 
   /* Initialise hash pointer */
   ws->hash = NULL;
   ws->peer_id = NULL;
 
-  /* If action is not a ntohl(a) == a == 0, then we
-     expect the derived connection id in first 64 bit */
-  if( inpacket[2] && ( inpacket[0] != connid[0] || inpacket[1] != connid[1] ) ) {
-    /* If connection id does not match, try the one that was
-       valid in the previous hour. Only if this also does not
-       match, return an error packet */
-    udp_make_connectionid( connid, remoteip, 1 );
-    if( inpacket[0] != connid[0] || inpacket[1] != connid[1] ) {
-      const size_t s = sizeof( "Connection ID missmatch." );
-      outpacket[0] = 3; outpacket[1] = inpacket[3];
-      memcpy( &outpacket[2], "Connection ID missmatch.", s );
-      socket_send6( serversocket, ws->outbuf, 8 + s, remoteip, remoteport, 0 );
-      stats_issue_event( EVENT_CONNID_MISSMATCH, FLAG_UDP, 8 + s );
-      return 1;
-    }
+  /* If action is not a ntohl(a) == a == 0, then we expect the derived
+     connection id in first 64 bit. It must have been made for the
+     requesting address in this or the previous epoch, this prevents
+     udp spoofing. Otherwise return an error packet */
+  if( inpacket[2] && !connid_verify( inpacket, remoteip, remoteport ) ) {
+    const size_t s = sizeof( "Connection ID missmatch." );
+    outpacket[0] = 3; outpacket[1] = inpacket[3];
+    memcpy( &outpacket[2], "Connection ID missmatch.", s );
+    stats_issue_event( EVENT_CONNID_MISSMATCH, FLAG_UDP, 8 + s );
+    return 8 + s;
   }
 
+  OT_USDT2( udp_request, ntohl( inpacket[2] ), byte_count );
   switch( ntohl( inpacket[2] ) ) {
     case 0: /* This is a connect action */
       /* look for udp bittorrent magic id */
       if( (ntohl(inpacket[0]) != 0x00000417) || (ntohl(inpacket[1]) != 0x27101980) )
-        return 1;
+        return 0;
 
+      connid_make( connid, remoteip, remoteport );
       outpacket[0] = 0;
       outpacket[1] = inpacket[3];
       outpacket[2] = connid[0];
       outpacket[3] = connid[1];
 
-      socket_send6( serversocket, ws->outbuf, 16, remoteip, remoteport, 0 );
       stats_issue_event( EVENT_CONNECT, FLAG_UDP, 16 );
-      break;
+      stats_issue_latency( LATENCY_UDP_CONNECT, ws->request_start );
+      return 16;
     case 1: /* This is an announce action */
       /* Minimum udp announce packet size */
       if( byte_count < 98 )
-        return 1;
+        return 0;
 
       /* We do only want to know, if it is zero */
       left  = inpacket[64/4] | inpacket[68/4];
@@ -141,6 +128,8 @@ int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
       outpacket[0] = htonl( 1 );    /* announce action */
       outpacket[1] = inpacket[12/4];
 
+      stats_trace_begin( ws, FLAG_UDP );
+
       if( OT_PEERFLAG( &ws->peer ) & PEER_FLAG_STOPPED ) { /* Peer is gone. */
         ws->reply      = ws->outbuf;
         ws->reply_size = remove_peer_from_torrent( FLAG_UDP, ws );
@@ -149,9 +138,9 @@ int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
         ws->reply_size = 8 + add_peer_to_torrent_and_return_peers( FLAG_UDP, ws, numwant );
       }
 
-      socket_send6( serversocket, ws->outbuf, ws->reply_size, remoteip, remoteport, 0 );
-      stats_issue_event( EVENT_ANNOUNCE, FLAG_UDP, ws->reply_size );
-      break;
+      stats_issue_event( EVENT_ANNOUNCE, FLAG_UDP, (uintptr_t)&ws->peer );
+      stats_issue_latency( LATENCY_UDP_ANNOUNCE, ws->request_start );
+      return ws->reply_size;
 
     case 2: /* This is a scrape action */
       outpacket[0] = htonl( 2 );    /* scrape action */
@@ -160,18 +149,84 @@ int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
       for( scrape_count = 0; ( scrape_count * 20 < byte_count - 16) && ( scrape_count <= 74 ); scrape_count++ )
         return_udp_scrape_for_torrent( *(ot_hash*)( ((char*)inpacket) + 16 + 20 * scrape_count ), ((char*)outpacket) + 8 + 12 * scrape_count );
 
-      socket_send6( serversocket, ws->outbuf, 8 + 12 * scrape_count, remoteip, remoteport, 0 );
       stats_issue_event( EVENT_SCRAPE, FLAG_UDP, scrape_count );
-      break;
+      stats_issue_latency( LATENCY_UDP_SCRAPE, ws->request_start );
+      return 8 + 12 * scrape_count;
   }
-  return 1;
+  return 0;
+}
+
+/* Each udp worker owns its socket and counts the packets it handled.
+   Counters are only written by the owning thread, read relaxed by the
+   stats worker and padded to a cache line so workers do not bounce them
+   between cores. */
+typedef struct ot_udp_worker ot_udp_worker;
+struct ot_udp_worker {
+  int64          sock;
+  int            cpu;
+  unsigned long long packets;
+  ot_udp_worker *next;
+  char           _pad[64];
+};
+
+static ot_udp_worker  *g_udp_worker_list;
+static ot_udp_worker **g_udp_worker_tail = &g_udp_worker_list;
+static unsigned int    g_udp_worker_count;
+
+/* Opens another socket on the address sock is bound to. With SO_REUSEPORT
+   the kernel spreads incoming packets across all sockets of the group, so
+   each worker blocks on its own receive queue. */
+static int64 udp_clone_socket( int64 sock ) {
+#ifdef SO_REUSEPORT
+  ot_ip6   ip;
+  uint16_t port;
+  uint32_t scope_id;
+  int64    clone;
+
+  if( socket_local6( sock, ip, &port, &scope_id ) == -1 )
+    return sock;
+  if( ( clone = socket_udp6( ) ) == -1 )
+    return sock;
+  if( socket_bind6_reuse( clone, ip, port, scope_id ) == -1 ) {
+    close( clone );
+    return sock;
+  }
+  if( !io_fd( clone ) ) {
+    close( clone );
+    return sock;
+  }
+  io_setcookie( clone, (void*)FLAG_UDP );
+  io_block( clone );
+  return clone;
+#else
+  return sock;
+#endif
+}
+
+/* Pin worker to its cpu and ask the kernel to prefer this socket for
+   packets whose rx queue is serviced by the same cpu */
+static void udp_pin_worker( ot_udp_worker *worker ) {
+#ifdef __linux__
+  cpu_set_t cpuset;
+  CPU_ZERO( &cpuset );
+  CPU_SET( worker->cpu, &cpuset );
+  pthread_setaffinity_np( pthread_self(), sizeof(cpuset), &cpuset );
+#ifdef SO_INCOMING_CPU
+  setsockopt( worker->sock, SOL_SOCKET, SO_INCOMING_CPU, &worker->cpu, sizeof(worker->cpu) );
+#endif
+#else
+  (void)worker;
+#endif
 }
 
 static void* udp_worker( void * args ) {
-  int64 sock = (int64)args;
+  ot_udp_worker *worker = (ot_udp_worker*)args;
   struct ot_workstruct ws;
   memset( &ws, 0, sizeof(ws) );
 
+  if( worker->cpu >= 0 )
+    udp_pin_worker( worker );
+
   ws.inbuf=malloc(G_INBUF_SIZE);
   ws.outbuf=malloc(G_OUTBUF_SIZE);
 #ifdef    _DEBUG_HTTPERROR
@@ -179,7 +234,8 @@ static void* udp_worker( void * args ) {
 #endif
 
   while( g_opentracker_running )
-    handle_udp6( sock, &ws );
+    if( handle_udp6( worker->sock, &ws ) )
+      __atomic_store_n( &worker->packets, worker->packets + 1, __ATOMIC_RELAXED );
 
   free( ws.inbuf );
   free( ws.outbuf );
@@ -189,15 +245,58 @@ static void* udp_worker( void * args ) {
   return NULL;
 }
 
-void udp_init( int64 sock, unsigned int worker_count ) {
+void udp_init( int64 sock, unsigned int worker_count, int first_cpu ) {
   pthread_t thread_id;
-  if( !g_rijndael_round_key[0] )
-    udp_generate_rijndael_round_key();
+  long      cpu_count = sysconf( _SC_NPROCESSORS_ONLN );
+  unsigned int i;
+  static int warned_shared;
+
+  if( !g_connid_ready ) {
+    connid_init( );
+    g_connid_ready = 1;
+  }
 #ifdef _DEBUG
   fprintf( stderr, "installing %d workers on udp socket %ld\n", worker_count, (unsigned long)sock );
 #endif
-  while( worker_count-- )
-    pthread_create( &thread_id, NULL, udp_worker, (void *)sock );
+  if( cpu_count < 1 ) cpu_count = 1;
+
+  for( i=0; i<worker_count; ++i ) {
+    ot_udp_worker *worker = malloc( sizeof(ot_udp_worker) );
+    if( !worker )
+      exerr( "Could not allocate udp worker." );
+    memset( worker, 0, sizeof(ot_udp_worker) );
+
+    /* First worker takes the socket we were handed, the rest open their own */
+    worker->sock = i ? udp_clone_socket( sock ) : sock;
+    if( i && worker->sock == sock && !warned_shared ) {
+      fprintf( stderr, "Warning: Can't open another SO_REUSEPORT socket for udp workers, some share the first worker's socket.\n" );
+      warned_shared = 1;
+    }
+    worker->cpu  = first_cpu < 0 ? -1 : (int)( ( first_cpu + g_udp_worker_count ) % cpu_count );
+    *g_udp_worker_tail = worker;
+    g_udp_worker_tail = &worker->next;
+    ++g_udp_worker_count;
+
+    pthread_create( &thread_id, NULL, udp_worker, (void *)worker );
+  }
+}
+
+size_t udp_return_worker_stats( char *reply ) {
+  ot_udp_worker *worker;
+  unsigned long long total = 0, packets;
+  char *r = reply;
+  int   i = 0;
+
+  for( worker = g_udp_worker_list; worker; worker = worker->next )
+    total += __atomic_load_n( &worker->packets, __ATOMIC_RELAXED );
+
+  r += sprintf( r, "%u udp workers, %llu packets\n", g_udp_worker_count, total );
+  for( worker = g_udp_worker_list; worker && r - reply < 4096; worker = worker->next ) {
+    packets = __atomic_load_n( &worker->packets, __ATOMIC_RELAXED );
+    r += sprintf( r, "%03d sock %3lld cpu %3d: %12llu packets (%3llu%%)\n", i++, (long long)worker->sock, worker->cpu, packets,
+                  total ? ( 100 * packets ) / total : 0 );
+  }
+  return r - reply;
 }
 
-const char *g_version_udp_c = "$Source: /home/cvsroot/opentracker/ot_udp.c,v $: $Revision: 1.30 $\n";
+const char *g_version_udp_c = "$Source: /home/cvsroot/opentracker/ot_udp.c,v $: $Revision: 1.36 $\n";
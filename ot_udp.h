@@ -6,7 +6,15 @@
 #ifndef __OT_UDP_H__
 #define __OT_UDP_H__
 
-void udp_init( int64 sock, unsigned int worker_count );
-int  handle_udp6( int64 serversocket, struct ot_workstruct *ws );
+/* Installs worker_count blocking workers, each on its own SO_REUSEPORT
+   socket bound to the address of sock. If first_cpu is not negative,
+   workers are pinned to consecutive cpus starting there. */
+void   udp_init( int64 sock, unsigned int worker_count, int first_cpu );
+int    handle_udp6( int64 serversocket, struct ot_workstruct *ws );
+
+/* Handles a request of byte_count bytes in ws->inbuf, leaves the answer
+   in ws->outbuf and returns its size, or 0 if nothing is to be sent */
+size_t udp_handle_packet( struct ot_workstruct *ws, size_t byte_count, const ot_ip6 remoteip, uint16_t remoteport );
+size_t udp_return_worker_stats( char *reply );
 
 #endif
@@ -0,0 +1,220 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifdef WANT_IO_URING
+
+/* System */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Opentracker */
+#include "ot_uring.h"
+
+/* A bare io_uring, driven from the main thread only. We talk to the kernel
+   through the raw system calls, so there is no dependency beyond the
+   kernel headers. Receive buffers live in a registered buffer ring, the
+   kernel picks one when data arrives, so idle connections do not pin
+   memory. */
+
+static struct {
+  int                  fd;
+
+  unsigned int        *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int         sq_entries, sq_local_tail, sq_submitted;
+
+  unsigned int        *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *br;
+  unsigned int         br_entries, br_tail;
+  char                *buffers;
+  size_t               buffer_size;
+
+  /* Completions moved out of the ring while waiting for submission slots,
+     handed out before those still in the ring */
+  struct io_uring_cqe *backlog;
+  unsigned int         backlog_head, backlog_tail, backlog_size;
+} g_ring = { .fd = -1 };
+
+int uring_init( unsigned int entries, unsigned int buffer_count, size_t buffer_size ) {
+  struct io_uring_params   p;
+  struct io_uring_buf_reg  reg;
+  size_t   sq_size = 0, cq_size = 0;
+  char    *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+  unsigned int i;
+
+  g_ring.sqes    = MAP_FAILED;
+  g_ring.br      = MAP_FAILED;
+  g_ring.buffers = NULL;
+
+  memset( &p, 0, sizeof(p) );
+  p.flags = IORING_SETUP_CLAMP;
+  if( ( g_ring.fd = syscall( __NR_io_uring_setup, entries, &p ) ) < 0 )
+    return -1;
+
+  /* We rely on the kernel queueing completions instead of dropping them and
+     on a stable submission, both are older than buffer rings anyway */
+  if( !( p.features & IORING_FEAT_NODROP ) || !( p.features & IORING_FEAT_SUBMIT_STABLE ) )
+    goto fail;
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+    if( cq_size > sq_size ) sq_size = cq_size;
+    cq_size = sq_size;
+  }
+
+  sq_ptr = mmap( NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, g_ring.fd, IORING_OFF_SQ_RING );
+  if( sq_ptr == MAP_FAILED ) goto fail;
+  if( p.features & IORING_FEAT_SINGLE_MMAP )
+    cq_ptr = sq_ptr;
+  else {
+    cq_ptr = mmap( NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, g_ring.fd, IORING_OFF_CQ_RING );
+    if( cq_ptr == MAP_FAILED ) goto fail;
+  }
+  g_ring.sqes = mmap( NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, g_ring.fd, IORING_OFF_SQES );
+  if( g_ring.sqes == MAP_FAILED ) goto fail;
+
+  g_ring.sq_head    = (unsigned int*)( sq_ptr + p.sq_off.head );
+  g_ring.sq_tail    = (unsigned int*)( sq_ptr + p.sq_off.tail );
+  g_ring.sq_mask    = (unsigned int*)( sq_ptr + p.sq_off.ring_mask );
+  g_ring.sq_array   = (unsigned int*)( sq_ptr + p.sq_off.array );
+  g_ring.sq_entries = p.sq_entries;
+  g_ring.sq_local_tail = g_ring.sq_submitted = *g_ring.sq_tail;
+
+  g_ring.cq_head    = (unsigned int*)( cq_ptr + p.cq_off.head );
+  g_ring.cq_tail    = (unsigned int*)( cq_ptr + p.cq_off.tail );
+  g_ring.cq_mask    = (unsigned int*)( cq_ptr + p.cq_off.ring_mask );
+  g_ring.cqes       = (struct io_uring_cqe*)( cq_ptr + p.cq_off.cqes );
+
+  /* The buffer ring must be a power of two and page aligned */
+  for( g_ring.br_entries = 1; g_ring.br_entries < buffer_count; g_ring.br_entries <<= 1 );
+  if( g_ring.br_entries > 32768 ) g_ring.br_entries = 32768;
+  g_ring.br = mmap( NULL, g_ring.br_entries * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if( g_ring.br == MAP_FAILED ) goto fail;
+  g_ring.buffer_size = buffer_size;
+  if( !( g_ring.buffers = malloc( g_ring.br_entries * buffer_size ) ) ) goto fail;
+
+  memset( &reg, 0, sizeof(reg) );
+  reg.ring_addr    = (uint64_t)(uintptr_t)g_ring.br;
+  reg.ring_entries = g_ring.br_entries;
+  reg.bgid         = OT_URING_BUFFER_GROUP;
+  if( syscall( __NR_io_uring_register, g_ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 )
+    goto fail;
+
+  for( i = 0; i < g_ring.br_entries; ++i )
+    uring_buffer_release( i );
+
+  return 0;
+
+fail:
+  free( g_ring.buffers );
+  g_ring.buffers = NULL;
+  if( g_ring.br != MAP_FAILED )
+    munmap( g_ring.br, g_ring.br_entries * sizeof(struct io_uring_buf) );
+  if( g_ring.sqes != MAP_FAILED )
+    munmap( g_ring.sqes, p.sq_entries * sizeof(struct io_uring_sqe) );
+  if( cq_ptr != MAP_FAILED && cq_ptr != sq_ptr )
+    munmap( cq_ptr, cq_size );
+  if( sq_ptr != MAP_FAILED )
+    munmap( sq_ptr, sq_size );
+  close( g_ring.fd );
+  g_ring.fd = -1;
+  return -1;
+}
+
+/* Moves all completions out of the ring, so the kernel can post the ones
+   it holds back and accepts submissions again */
+static void uring_stash_cqes( void ) {
+  unsigned int head = *g_ring.cq_head, tail = __atomic_load_n( g_ring.cq_tail, __ATOMIC_ACQUIRE );
+
+  if( head == tail )
+    return;
+  if( g_ring.backlog_tail + ( tail - head ) > g_ring.backlog_size ) {
+    unsigned int new_size = g_ring.backlog_size ? 2 * g_ring.backlog_size : 256;
+    struct io_uring_cqe *new_backlog;
+    while( new_size < g_ring.backlog_tail + ( tail - head ) ) new_size *= 2;
+    if( !( new_backlog = realloc( g_ring.backlog, new_size * sizeof(struct io_uring_cqe) ) ) )
+      return;
+    g_ring.backlog      = new_backlog;
+    g_ring.backlog_size = new_size;
+  }
+  while( head != tail )
+    g_ring.backlog[g_ring.backlog_tail++] = g_ring.cqes[ head++ & *g_ring.cq_mask ];
+  __atomic_store_n( g_ring.cq_head, head, __ATOMIC_RELEASE );
+}
+
+struct io_uring_sqe *uring_get_sqe( void ) {
+  struct io_uring_sqe *sqe;
+  unsigned int idx;
+
+  /* With a full completion ring, the kernel refuses submissions with
+     EBUSY until it could post what it holds back, so make room there */
+  while( g_ring.sq_local_tail - __atomic_load_n( g_ring.sq_head, __ATOMIC_ACQUIRE ) >= g_ring.sq_entries ) {
+    uring_enter( 0 );
+    if( g_ring.sq_local_tail - __atomic_load_n( g_ring.sq_head, __ATOMIC_ACQUIRE ) >= g_ring.sq_entries )
+      uring_stash_cqes( );
+  }
+
+  idx = g_ring.sq_local_tail & *g_ring.sq_mask;
+  sqe = g_ring.sqes + idx;
+  memset( sqe, 0, sizeof(*sqe) );
+  g_ring.sq_array[idx] = idx;
+  ++g_ring.sq_local_tail;
+  return sqe;
+}
+
+void uring_enter( int wait ) {
+  unsigned int to_submit = g_ring.sq_local_tail - g_ring.sq_submitted;
+  int res;
+
+  __atomic_store_n( g_ring.sq_tail, g_ring.sq_local_tail, __ATOMIC_RELEASE );
+  res = syscall( __NR_io_uring_enter, g_ring.fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+  if( res > 0 )
+    g_ring.sq_submitted += res;
+  /* On EINTR or EBUSY the entries stay queued for the next call, the
+     caller handling completions or uring_get_sqe stashing them lets the
+     kernel take them */
+}
+
+struct io_uring_cqe *uring_peek_cqe( void ) {
+  unsigned int head = *g_ring.cq_head;
+  if( g_ring.backlog_head != g_ring.backlog_tail )
+    return g_ring.backlog + g_ring.backlog_head;
+  if( head == __atomic_load_n( g_ring.cq_tail, __ATOMIC_ACQUIRE ) )
+    return NULL;
+  return g_ring.cqes + ( head & *g_ring.cq_mask );
+}
+
+void uring_cqe_seen( void ) {
+  if( g_ring.backlog_head != g_ring.backlog_tail ) {
+    if( ++g_ring.backlog_head == g_ring.backlog_tail )
+      g_ring.backlog_head = g_ring.backlog_tail = 0;
+    return;
+  }
+  __atomic_store_n( g_ring.cq_head, *g_ring.cq_head + 1, __ATOMIC_RELEASE );
+}
+
+char *uring_buffer( unsigned int bid ) {
+  return g_ring.buffers + bid * g_ring.buffer_size;
+}
+
+void uring_buffer_release( unsigned int bid ) {
+  struct io_uring_buf *buf = &g_ring.br->bufs[ g_ring.br_tail & ( g_ring.br_entries - 1 ) ];
+  buf->addr = (uint64_t)(uintptr_t)uring_buffer( bid );
+  buf->len  = g_ring.buffer_size;
+  buf->bid  = bid;
+  __atomic_store_n( &g_ring.br->tail, (uint16_t)++g_ring.br_tail, __ATOMIC_RELEASE );
+}
+
+#endif
+
+const char *g_version_uring_c = "$Source: /home/cvsroot/opentracker/ot_uring.c,v $: $Revision: 1.1 $\n";
@@ -0,0 +1,42 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_URING_H__
+#define __OT_URING_H__
+
+#ifdef WANT_IO_URING
+
+#include <linux/io_uring.h>
+
+/* Buffer group the receive buffers are registered as */
+#define OT_URING_BUFFER_GROUP 0
+
+/* Sets up the ring for the calling thread and registers buffer_count receive
+   buffers of buffer_size bytes each. Returns 0 on success, -1 if the kernel
+   does not support what we need, in which case the caller should stay with
+   the io_wait loop. */
+int  uring_init( unsigned int entries, unsigned int buffer_count, size_t buffer_size );
+
+/* Returns a zeroed submission entry. If the submission queue is full, the
+   pending entries are handed to the kernel first, moving completions out
+   of a full completion ring if the kernel refuses them. Those are still
+   returned by uring_peek_cqe, before any newer ones. */
+struct io_uring_sqe *uring_get_sqe( void );
+
+/* Submits all pending entries and, if wait is set, sleeps until at least
+   one completion is available */
+void uring_enter( int wait );
+
+/* Returns the oldest unseen completion or NULL, uring_cqe_seen releases it */
+struct io_uring_cqe *uring_peek_cqe( void );
+void uring_cqe_seen( void );
+
+/* Receive buffers selected by the kernel must be handed back after use */
+char *uring_buffer( unsigned int bid );
+void  uring_buffer_release( unsigned int bid );
+
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef __OT_USDT_H__
+#define __OT_USDT_H__
+
+/* Static tracepoints for perf, bpftrace and friends. With WANT_USDT each
+   probe is a single nop plus a note in the systemtap sdt format telling
+   the tools where the nop is and where to find the probe's arguments, so
+   nothing needs to be installed or linked and nothing runs unless a tool
+   attaches:
+
+     bpftrace -e 'usdt:./opentracker:bucket_lock_acquire { @[arg0] = count(); }'
+
+   Probes take up to four arguments, each passed as a long. Without
+   WANT_USDT, or where we do not know how to emit the note, they are
+   compiled out. */
+
+#if defined( WANT_USDT ) && defined( __ELF__ ) && defined( __GNUC__ ) && \
+    ( defined( __x86_64__ ) || defined( __i386__ ) || defined( __aarch64__ ) )
+
+#ifdef __LP64__
+#define OT_USDT_ADDR ".8byte"
+#else
+#define OT_USDT_ADDR ".4byte"
+#endif
+
+/* The note holds the nop's address, no base address and no semaphore,
+   then provider, probe name and the argument locations, "-8@%rdi" being
+   a signed long in rdi */
+#define OT_USDT_NOTE( name, args )                      \
+  "990: nop\n"                                          \
+  ".pushsection .note.stapsdt,\"\",\"note\"\n"          \
+  ".balign 4\n"                                         \
+  ".4byte 992f-991f, 994f-993f, 3\n"                    \
+  "991: .asciz \"stapsdt\"\n"                           \
+  "992: .balign 4\n"                                    \
+  "993: " OT_USDT_ADDR " 990b\n"                        \
+  OT_USDT_ADDR " 0\n"                                   \
+  OT_USDT_ADDR " 0\n"                                   \
+  ".asciz \"opentracker\"\n"                            \
+  ".asciz \"" #name "\"\n"                              \
+  ".asciz \"" args "\"\n"                               \
+  "994: .balign 4\n"                                    \
+  ".popsection\n"
+
+#define OT_USDT_FMT(n)     "%n[_s" #n "]@%[_a" #n "]"
+#define OT_USDT_ARG(n,x)   [_s##n] "n" ( (int)sizeof( long ) ), [_a##n] "nor" ( (long)(x) )
+
+#define OT_USDT0(name) \
+  __asm__ __volatile__ ( OT_USDT_NOTE( name, "" ) )
+#define OT_USDT1(name,a) \
+  __asm__ __volatile__ ( OT_USDT_NOTE( name, OT_USDT_FMT(1) ) :: OT_USDT_ARG(1,a) )
+#define OT_USDT2(name,a,b) \
+  __asm__ __volatile__ ( OT_USDT_NOTE( name, OT_USDT_FMT(1) " " OT_USDT_FMT(2) ) :: OT_USDT_ARG(1,a), OT_USDT_ARG(2,b) )
+#define OT_USDT3(name,a,b,c) \
+  __asm__ __volatile__ ( OT_USDT_NOTE( name, OT_USDT_FMT(1) " " OT_USDT_FMT(2) " " OT_USDT_FMT(3) ) \
+                         :: OT_USDT_ARG(1,a), OT_USDT_ARG(2,b), OT_USDT_ARG(3,c) )
+#define OT_USDT4(name,a,b,c,d) \
+  __asm__ __volatile__ ( OT_USDT_NOTE( name, OT_USDT_FMT(1) " " OT_USDT_FMT(2) " " OT_USDT_FMT(3) " " OT_USDT_FMT(4) ) \
+                         :: OT_USDT_ARG(1,a), OT_USDT_ARG(2,b), OT_USDT_ARG(3,c), OT_USDT_ARG(4,d) )
+
+#else
+
+#define OT_USDT0(name)             do {} while( 0 )
+#define OT_USDT1(name,a)           do {} while( 0 )
+#define OT_USDT2(name,a,b)         do {} while( 0 )
+#define OT_USDT3(name,a,b,c)       do {} while( 0 )
+#define OT_USDT4(name,a,b,c,d)     do {} while( 0 )
+
+#endif
+
+#endif
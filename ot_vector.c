@@ -12,6 +12,7 @@
 /* Opentracker */
 #include "trackerlogic.h"
 #include "ot_vector.h"
+#include "ot_usdt.h"
 
 /* Libowfat */
 #include "uint32.h"
@@ -185,6 +186,8 @@ void vector_redistribute_buckets( ot_peerlist * peer_list ) {
   if( num_buckets_new == num_buckets_old )
     return;
 
+  OT_USDT3( redistribute_buckets, peer_list->peer_count, num_buckets_old, num_buckets_new );
+
   /* Assume near perfect distribution */
   bucket_list_new = malloc( num_buckets_new * sizeof( ot_vector ) );
   if( !bucket_list_new) return;
@@ -263,4 +266,4 @@ void vector_fixup_peers( ot_vector * vector ) {
     vector->data = realloc( vector->data, vector->space * sizeof( ot_peer ) );
 }
 
-const char *g_version_vector_c = "$Source: /home/cvsroot/opentracker/ot_vector.c,v $: $Revision: 1.19 $\n";
+const char *g_version_vector_c = "$Source: /home/cvsroot/opentracker/ot_vector.c,v $: $Revision: 1.20 $\n";
@@ -90,6 +90,18 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
   (void) event_data;
 }
 
+#ifdef WANT_LOCK_STATS
+uint64_t stats_latency_start( void ) {
+  return 0;
+}
+
+void stats_issue_lock( int lock_class, uint64_t wait_ns, uint64_t hold_ns ) {
+  (void) lock_class;
+  (void) wait_ns;
+  (void) hold_ns;
+}
+#endif
+
 void livesync_bind_mcast( ot_ip6 ip, uint16_t port) {
   char tmpip[4] = {0,0,0,0};
   char *v4ip;
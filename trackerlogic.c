@@ -29,6 +29,8 @@
 #include "ot_fullscrape.h"
 #include "ot_livesync.h"
 #include "ot_persist.h"
+#include "ot_iovec.h"
+#include "ot_usdt.h"
 
 int urlencode(const char *src, int len, char *ret, int size) {
   int i;
@@ -64,6 +66,7 @@ int urlencode(const char *src, int len, char *ret, int size) {
 size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply, PROTO_FLAG proto );
 
 void free_peerlist( ot_peerlist *peer_list ) {
+  stats_issue_peers( -(ssize_t)peer_list->peer_count, -(ssize_t)peer_list->seed_count );
   if( peer_list->peers.data ) {
     if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
       ot_vector *bucket_list = (ot_vector*)(peer_list->peers.data);
@@ -98,6 +101,7 @@ void add_torrent_from_saved_state( ot_hash hash, ot_time base, size_t down_count
     
   byte_zero( torrent->peer_list, sizeof( ot_peerlist ) );
   torrent->peer_list->base = base;
+  torrent->peer_list->modified = g_now_seconds;
   torrent->peer_list->down_count = down_count;
 
   return mutex_bucket_unlock_by_hash( hash, 1 );
@@ -107,8 +111,11 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
   int         exactmatch, delta_torrentcount = 0;
   ot_torrent *torrent;
   ot_peer    *peer_dest;
-  ot_vector  *torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
+  ot_vector  *torrents_list;
 
+  OT_USDT2( add_peer_enter, ws->hash, proto );
+  torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
+  stats_trace_phase( ws, TRACE_LOCKED );
   if( !accesslist_hashisvalid( *ws->hash ) ) {
     mutex_bucket_unlock_by_hash( *ws->hash, 0 );
     if( proto == FLAG_TCP ) {
@@ -136,6 +143,7 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
     }
 
     byte_zero( torrent->peer_list, sizeof( ot_peerlist ) );
+    torrent->peer_list->modified = g_now_seconds;
     delta_torrentcount = 1;
   } else
     clean_single_torrent( torrent );
@@ -167,12 +175,15 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
 #endif
 
     torrent->peer_list->peer_count++;
+    torrent->peer_list->modified = g_now_seconds;
+    stats_issue_peers( 1, ( OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) ? 1 : 0 );
     if( OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) {
       torrent->peer_list->down_count++;
       stats_issue_event( EVENT_COMPLETED, 0, (uintptr_t)ws );
     }
     if( OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING )
       torrent->peer_list->seed_count++;
+    stats_top_update( torrent );
 
   } else {
     stats_issue_event( EVENT_RENEW, 0, OT_PEERTIME( peer_dest ) );
@@ -190,12 +201,21 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
     }
 #endif
 
-    if(  (OT_PEERFLAG(peer_dest) & PEER_FLAG_SEEDING )   && !(OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) )
+    if( ( OT_PEERFLAG(peer_dest) ^ OT_PEERFLAG(&ws->peer) ) & PEER_FLAG_SEEDING )
+      torrent->peer_list->modified = g_now_seconds;
+    if(  (OT_PEERFLAG(peer_dest) & PEER_FLAG_SEEDING )   && !(OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) ) {
       torrent->peer_list->seed_count--;
-    if( !(OT_PEERFLAG(peer_dest) & PEER_FLAG_SEEDING )   &&  (OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) )
+      stats_issue_peers( 0, -1 );
+      stats_top_update( torrent );
+    }
+    if( !(OT_PEERFLAG(peer_dest) & PEER_FLAG_SEEDING )   &&  (OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) ) {
       torrent->peer_list->seed_count++;
+      stats_issue_peers( 0, 1 );
+      stats_top_update( torrent );
+    }
     if( !(OT_PEERFLAG(peer_dest) & PEER_FLAG_COMPLETED ) &&  (OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) ) {
       torrent->peer_list->down_count++;
+      torrent->peer_list->modified = g_now_seconds;
       stats_issue_event( EVENT_COMPLETED, 0, (uintptr_t)ws );
     }
     if(   OT_PEERFLAG(peer_dest) & PEER_FLAG_COMPLETED )
@@ -216,7 +236,10 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
 #endif
 
   ws->reply_size = return_peers_for_torrent( torrent, amount, ws->reply, proto );
+  stats_trace_phase( ws, TRACE_SELECTED );
   mutex_bucket_unlock_by_hash( *ws->hash, delta_torrentcount );
+  stats_trace_phase( ws, TRACE_UNLOCKED );
+  OT_USDT2( add_peer_return, ws->hash, ws->reply_size );
   return ws->reply_size;
 }
 
@@ -332,8 +355,12 @@ size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply
 /* Fetches scrape info for a specific torrent */
 size_t return_udp_scrape_for_torrent( ot_hash hash, char *reply ) {
   int          exactmatch, delta_torrentcount = 0;
-  ot_vector   *torrents_list = mutex_bucket_lock_by_hash( hash );
-  ot_torrent  *torrent = binary_search( hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  ot_vector   *torrents_list;
+  ot_torrent  *torrent;
+
+  OT_USDT1( udp_scrape_enter, hash );
+  torrents_list = mutex_bucket_lock_by_hash( hash );
+  torrent = binary_search( hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
 
   if( !exactmatch ) {
     memset( reply, 0, 12);
@@ -351,6 +378,7 @@ size_t return_udp_scrape_for_torrent( ot_hash hash, char *reply ) {
     }
   }
   mutex_bucket_unlock_by_hash( hash, delta_torrentcount );
+  OT_USDT1( udp_scrape_return, hash );
   return 12;
 }
 
@@ -567,6 +595,7 @@ size_t return_tcp_scrape_for_torrent( ot_hash *hash_list, int amount, char *repl
   char *r = reply;
   int   exactmatch, i;
 
+  OT_USDT2( tcp_scrape_enter, hash_list, amount );
   r += sprintf( r, "d5:filesd" );
 
   for( i=0; i<amount; ++i ) {
@@ -590,16 +619,21 @@ size_t return_tcp_scrape_for_torrent( ot_hash *hash_list, int amount, char *repl
   }
 
   *r++ = 'e'; *r++ = 'e';
+  OT_USDT2( tcp_scrape_return, hash_list, r - reply );
   return r - reply;
 }
 
 static ot_peerlist dummy_list;
 size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
   int          exactmatch;
-  ot_vector   *torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
-  ot_torrent  *torrent = binary_search( ws->hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  ot_vector   *torrents_list;
+  ot_torrent  *torrent;
   ot_peerlist *peer_list = &dummy_list;
 
+  OT_USDT2( remove_peer_enter, ws->hash, proto );
+  torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
+  torrent = binary_search( ws->hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  stats_trace_phase( ws, TRACE_LOCKED );
 #ifdef WANT_SYNC_LIVE
   if( proto != FLAG_MCA ) {
     OT_PEERFLAG( &ws->peer ) |= PEER_FLAG_STOPPED;
@@ -610,8 +644,10 @@ size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
   if( exactmatch ) {
     peer_list = torrent->peer_list;
     switch( vector_remove_peer( &peer_list->peers, &ws->peer ) ) {
-      case 2:  peer_list->seed_count--; /* Fall throughs intended */
-      case 1:  peer_list->peer_count--; /* Fall throughs intended */
+      case 2:  peer_list->seed_count--; stats_issue_peers( 0, -1 ); /* Fall throughs intended */
+      case 1:  peer_list->peer_count--; stats_issue_peers( -1, 0 ); /* Fall throughs intended */
+               peer_list->modified = g_now_seconds;
+               stats_top_update( torrent );
       default: break;
     }
   }
@@ -628,12 +664,15 @@ size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
     ((uint32_t*)ws->reply)[4] = htonl( peer_list->seed_count);
     ws->reply_size = 20;
   }
+  stats_trace_phase( ws, TRACE_SELECTED );
 
 #ifdef WANT_PERSISTENCE
   persist_change(ws);
 #endif /* WANT_PERSISTENCE */
 
   mutex_bucket_unlock_by_hash( *ws->hash, 0 );
+  stats_trace_phase( ws, TRACE_UNLOCKED );
+  OT_USDT2( remove_peer_return, ws->hash, ws->reply_size );
   return ws->reply_size;
 }
 
@@ -666,6 +705,9 @@ void trackerlogic_init( ) {
     g_stats_path = "stats";
   g_stats_path_len = strlen( g_stats_path );
 
+  /* Buffers for the worker threads, sized by the config file */
+  iovec_pool_init( );
+
   /* Initialise background worker threads */
   mutex_init( );
   clean_init( );
@@ -713,4 +755,4 @@ void trackerlogic_deinit( void ) {
   mutex_deinit( );
 }
 
-const char *g_version_trackerlogic_c = "$Source: /home/cvsroot/opentracker/trackerlogic.c,v $: $Revision: 1.138 $\n";
+const char *g_version_trackerlogic_c = "$Source: /home/cvsroot/opentracker/trackerlogic.c,v $: $Revision: 1.144 $\n";
@@ -40,12 +40,21 @@ typedef struct { ot_ip6 address; int bits; }
    fullscrape more frequently than this amount in seconds */
 #define OT_MODEST_PEER_TIMEOUT (60*5)
 
+/* Full scrapes are rebuilt at most every this many seconds and shared by
+   all requests in between, fullscrape.cache in the config overrides it */
+#define OT_FULLSCRAPE_CACHE_INTERVAL 10
+
+/* Removed torrents are remembered this many seconds for delta full
+   scrapes, older tokens get a complete answer. fullscrape.delta.keep in
+   the config overrides it */
+#define OT_FULLSCRAPE_DELTA_KEEP (60*60)
+
 /* If peers come back before 10 minutes, don't live sync them */
 #define OT_CLIENT_SYNC_RENEW_BOUNDARY 10
 
 /* Number of tracker admin ip addresses allowed */
 #define OT_ADMINIP_MAX 64
-#define OT_MAX_THREADS 16
+#define OT_MAX_THREADS 64
 
 #define OT_PEER_TIMEOUT 45
 
@@ -96,9 +105,13 @@ typedef struct {
 
 struct ot_peerlist {
   ot_time        base;
+/* Seconds of the last change of any count, for delta full scrapes */
+  ot_time        modified;
   size_t         seed_count;
   size_t         peer_count;
   size_t         down_count;
+/* Which top tables in ot_stats.c hold this torrent */
+  int            top;
 /* normal peers vector or
    pointer to ot_vector[32] buckets if data != NULL and space == 0
 */
@@ -106,6 +119,18 @@ struct ot_peerlist {
 };
 #define OT_PEERLIST_HASBUCKETS(peer_list) ((peer_list)->peers.size > (peer_list)->peers.space)
 
+/* Phases a sampled announce is timed at, see stats_trace_begin */
+typedef enum {
+  TRACE_READ,       /* Request read, the same as request_start */
+  TRACE_PARSED,
+  TRACE_LOCKED,     /* Bucket lock acquired */
+  TRACE_SELECTED,   /* Peers selected and the reply formatted */
+  TRACE_UNLOCKED,
+  TRACE_WRITTEN,    /* Reply handed to the socket */
+
+  TRACE_PHASE_COUNT
+} ot_trace_phase;
+
 struct ot_workstruct {
   /* Thread specific, static */
   char    *inbuf;
@@ -124,6 +149,14 @@ struct ot_workstruct {
   ot_hash *hash;
   char    *peer_id;
 
+  /* When we started on the current request, see stats_latency_start */
+  uint64_t request_start;
+
+  /* Whether the current request is sampled and its phase times */
+  int        traced;
+  PROTO_FLAG trace_proto;
+  uint64_t   trace[TRACE_PHASE_COUNT];
+
   /* HTTP specific, non static */
   int      keep_alive;
   char    *request;